@@ -5,12 +5,22 @@
 #include <dirent.h>
 #include <errno.h>
 #include <math.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <algorithm>
 
+#include "AOCLUtils/options.h"
 #include "hifp/hifp.h"
+#include "hifp/fpid_index.h"
+#include "hifp/fpid_store.h"
+#include "hifp/fpid_server.h"
 #include "utils/utils.h"
-#include "utils/csv.h"
+#include "utils/metrics.h"
+#include "utils/thread_pool.h"
+#include "utils/stage_stats.h"
 
 using namespace std;
+using namespace aocl_utils;
 using namespace hifp;
 using namespace my_utils;
 
@@ -20,92 +30,546 @@ const char *CSVDIR = "./report";
 
 vector<string> song_names;
 vector<double> total_time;
+vector<int> song_status;
+FingerprintConfig fp_config;
+string store_path;        /* --store, one fingerprint store instead of .raw files */
+FpidStoreWriter store;
+unsigned int store_num_frame = 0;
+RunStats run_stats;
+bool stage_stats = false;  /* --stats, time every stage of a song separately */
+FpidServer *server = NULL;  /* --socket / --spool, stopped by SIGINT and SIGTERM */
+metrics_format_t report_format = METRICS_CSV;  /* --report_format */
+MetricsWriter report;       /* time of every song, written as songs finish */
 
 
-void save_csv(string csvpath);
+int fingerprint_song(int index);
+int fingerprint_file(const char *ifpath, vector<unsigned int> *fpid);
+int serve(int num_threads);
+void stop_server(int sig);
+int fingerprint_staged(FILE *ifp, vector<unsigned int> *fpid);
+int match_songs(const char *qdir, unsigned int k, int num_threads);
+int open_report(char *path);
 
 
 /* Entry point */
 int main(int argc, char **argv)
 {
+    Options options(argc, argv);
     DIR *dir = NULL;
     struct dirent *ep;
-    char ifpath[256];
-    char ofpath[256];
     char csvpath[256];
-    FILE *ifp = NULL;
-    FILE *ofp = NULL;
-    int r;
+    int num_threads = 1;
+
+    if (options.has("threads"))
+    {
+        num_threads = options.get<int>("threads");
+    }
+
+    /* fingerprint geometry, --samples=0 fingerprints whole tracks */
+    fp_config = default_fingerprint_config();
+    if (options.has("samples"))
+    {
+        fp_config.num_wave = options.get<unsigned int>("samples");
+    }
+    if (options.has("block"))
+    {
+        fp_config.block_size = options.get<unsigned int>("block");
+    }
+    if (options.has("levels"))
+    {
+        fp_config.dwt_levels = options.get<unsigned int>("levels");
+    }
+    if (options.has("bits"))
+    {
+        fp_config.bits_per_word = options.get<unsigned int>("bits");
+    }
+    if (options.has("rate"))
+    {
+        fp_config.sample_rate = options.get<unsigned int>("rate");
+    }
+    if (options.has("wavelet"))
+    {
+        ASSERT(parse_wavelet(options.get<string>("wavelet").c_str(), &fp_config.wavelet) == 0);
+    }
+    if (options.has("hop"))
+    {
+        fp_config.hop = options.get<unsigned int>("hop");
+    }
+    if (options.has("stats"))
+    {
+        stage_stats = true;
+    }
+    if (options.has("report_format"))
+    {
+        ASSERT(parse_metrics_format(options.get<string>("report_format"), &report_format) == 0);
+    }
+    ASSERT(check_fingerprint_config(&fp_config) == 0);
+
+    if (options.has("store"))
+    {
+        store_path = options.get<string>("store");
+        /* store records have a fixed size */
+        ASSERT(fp_config.num_wave != 0);
+        store_num_frame = config_num_frame(&fp_config, config_num_dwteco(&fp_config, NULL));
+    }
+
+    /* look up the songs of a directory in the saved FPIDs instead */
+    if (options.has("match"))
+    {
+        const string qdir = options.get<string>("match");
+        const unsigned int k = options.has("top") ? options.get<unsigned int>("top") : 5;
+
+        return match_songs(qdir.c_str(), k, num_threads);
+    }
+
+    printf("DWT kernel: %s \n", dwt_simd_name());
+    printf("Threads: %d \n", num_threads);
+    printf("Geometry: samples %u, block %u, levels %u, wavelet %s, bits %u, rate %u, hop %u \n",
+           fp_config.num_wave, fp_config.block_size, fp_config.dwt_levels, wavelet_name(fp_config.wavelet),
+           fp_config.bits_per_word, fp_config.sample_rate, fp_config.hop);
+
+    /* long-running mode, jobs come from a socket and/or a spool directory */
+    if (options.has("socket") || options.has("spool"))
+    {
+        server = new FpidServer();
+
+        if (options.has("socket"))
+        {
+            ASSERT(server->listen_socket(options.get<string>("socket").c_str()) == 0);
+            printf("Socket: %s \n", options.get<string>("socket").c_str());
+        }
+        if (options.has("spool"))
+        {
+            const unsigned int poll_ms = options.has("spool_poll_ms") ? options.get<unsigned int>("spool_poll_ms") : 200;
+
+            ASSERT(server->watch_spool(options.get<string>("spool").c_str(), poll_ms) == 0);
+            printf("Spool: %s \n", options.get<string>("spool").c_str());
+        }
+        server->set_batching(options.has("batch") ? options.get<unsigned int>("batch") : 16,
+                             options.has("batch_wait_ms") ? options.get<double>("batch_wait_ms") : 5.0);
+
+        const int r = serve(num_threads);
+
+        delete server;
+        server = NULL;
+        return r;
+    }
 
     dir = opendir(IDIR);
 
     ASSERT(dir != NULL);
 
+    /* collect and sort the songs so the printout order does not depend on scheduling */
     while ((ep = readdir(dir)) != NULL)
     {
         if (ep->d_type == DT_REG)
         {
-            sprintf(ifpath, "%s/%s", IDIR, ep->d_name);
-            sprintf(ofpath, "%s/%s.raw", ODIR, ep->d_name);
-
             song_names.push_back(ep->d_name);
+        }
+    }
 
-            ifp = fopen(ifpath, "rb+");
-            ASSERT(ifp != NULL);
+    closedir(dir);
+    dir = NULL;
 
-            ofp = fopen(ofpath, "wb");
-            ASSERT(ofp != NULL);
+    sort(song_names.begin(), song_names.end());
+    total_time.resize(song_names.size());
+    song_status.resize(song_names.size());
 
-            const double start_time = getCurrentTimestamp();
+    if (!store_path.empty())
+    {
+        ASSERT(store.open(store_path.c_str(), store_num_frame) == 0);
+        printf("Store: %s \n", store_path.c_str());
+    }
 
-            r = run_all(ifp, ofp);
-            ASSERT(r == 0);
+    ASSERT(open_report(csvpath) == 0);
 
-            const double end_time = getCurrentTimestamp();
-            const double total_time_tmp = (end_time-start_time) * 1e3;
-            total_time.push_back(total_time_tmp);
-            printf("%s : %lf \n", ep->d_name, total_time_tmp);
+    run_stats.start();
+    {
+        WorkStealingPool pool(num_threads);
 
+        pool.run((int)song_names.size(), [](int index, int worker) {
+            song_status[index] = fingerprint_song(index);
+        });
+    }
 
-            fclose(ifp);
-            ifp = NULL;
+    ASSERT(store.close() == 0);
+    run_stats.stop();
 
-            fclose(ofp);
-            ofp = NULL;
+    for (size_t i = 0; i < song_names.size(); i++)
+    {
+        if (song_status[i] != 0)
+        {
+            printf("%s : failed \n", song_names[i].c_str());
+            continue;
         }
+        printf("%s : %lf \n", song_names[i].c_str(), total_time[i]);
     }
 
-    sprintf(csvpath, "%s/%u.csv", CSVDIR, (int) round(getCurrentTimestamp()));
-    save_csv(csvpath);
+    run_stats.print_summary(stdout);
 
-    closedir(dir);
+    printf("Report (%s): %s \n", metrics_extension(report_format), csvpath);
+    ASSERT(report.close() == 0);
+
+    sprintf(csvpath, "%s/%u.json", CSVDIR, (int) round(getCurrentTimestamp()));
+    printf("Report (json): %s \n", csvpath);
+    run_stats.write_json(csvpath);
 
     return 0;
 
 err:
-    if (ifp != NULL)
+    if (dir != NULL)
     {
-        fclose(ifp);
+        closedir(dir);
     }
+    return 0;
+}
+
+
+/* Fingerprint one song, called concurrently from the pool workers */
+int fingerprint_song(int index)
+{
+    const double start_time = getCurrentTimestamp();
+    char ifpath[256];
+    char ofpath[256];
+    FILE *ofp = NULL;
+    vector<unsigned int> fpid;
+    double t;
+    int r;
+
+    sprintf(ifpath, "%s/%s", IDIR, song_names[index].c_str());
+    sprintf(ofpath, "%s/%s.raw", ODIR, song_names[index].c_str());
+
+    r = fingerprint_file(ifpath, &fpid);
+    ASSERT(r == 0);
+
+    t = getCurrentTimestamp();
+    if (!store_path.empty())
+    {
+        r = store.append(song_names[index], &fpid[0], (unsigned int)(fpid.size() / store_num_frame));
+        ASSERT(r == 0);
+    }
+    else
+    {
+        ofp = fopen(ofpath, "wb");
+        ASSERT(ofp != NULL);
+        r = save_fp_to_disk(ofp, &fpid[0], (unsigned int)fpid.size());
+        ASSERT(r == 0);
+        fclose(ofp);
+        ofp = NULL;
+    }
+    run_stats.record(STAGE_WRITE, (getCurrentTimestamp() - t) * 1e3);
+
+    {
+        const double end_time = getCurrentTimestamp();
+
+        total_time[index] = (end_time - start_time) * 1e3;
+        run_stats.record(STAGE_SONG, total_time[index]);
+        report.add_row(song_names[index].c_str(), &total_time[index]);
+    }
+
+    return 0;
+
+err:
     if (ofp != NULL)
     {
         fclose(ofp);
     }
-    if (dir != NULL)
+    return -1;
+}
+
+
+/* The FPID words of one WAV file, with the geometry of fp_config */
+int fingerprint_file(const char *ifpath, vector<unsigned int> *fpid)
+{
+    FILE *ifp = NULL;
+    struct stat st;
+    double t;
+    int r;
+
+    t = getCurrentTimestamp();
+    ifp = fopen(ifpath, "rb+");
+    ASSERT(ifp != NULL);
+    run_stats.record(STAGE_OPEN, (getCurrentTimestamp() - t) * 1e3);
+
+    if (stage_stats)
+    {
+        r = fingerprint_staged(ifp, fpid);
+    }
+    else
     {
+        r = gen_fpid_file(ifp, &fp_config, fpid);
+    }
+    ASSERT(r == 0);
+
+    run_stats.add_song(fstat(fileno(ifp), &st) == 0 ? (unsigned long long)st.st_size : 0);
+    fclose(ifp);
+
+    return 0;
+
+err:
+    if (ifp != NULL)
+    {
+        fclose(ifp);
+    }
+    return -1;
+}
+
+
+/*
+ * Long-running mode: fingerprint the jobs of the server a batch at a time
+ * across the worker threads, which stay up between batches, until SIGINT
+ * or SIGTERM. Queued jobs are finished before exiting.
+ */
+int serve(int num_threads)
+{
+    WorkStealingPool pool(num_threads);
+    vector<FpidJob> batch;
+    char csvpath[256];
+
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+
+    ASSERT(server->start() == 0);
+    ASSERT(open_report(csvpath) == 0);
+    printf("Serving, stop with SIGINT or SIGTERM \n");
+
+    run_stats.start();
+    while (server->next_batch(&batch))
+    {
+        pool.run((int)batch.size(), [&batch](int index, int worker) {
+            const double start_time = getCurrentTimestamp();
+            vector<unsigned int> fpid;
+            const int r = fingerprint_file(batch[index].path.c_str(), &fpid);
+            const double song_time = (getCurrentTimestamp() - start_time) * 1e3;
+
+            server->complete(batch[index], r, r == 0 ? &fpid[0] : NULL, fpid.size());
+            run_stats.record(STAGE_SONG, song_time);
+            if (r == 0)
+            {
+                report.add_row(batch[index].path.c_str(), &song_time);
+            }
+        });
+    }
+    run_stats.stop();
+
+    printf("\n");
+    printf("Served %llu job(s) in %llu batch(es) \n", server->num_jobs(), server->num_batches());
+    run_stats.print_summary(stdout);
+
+    printf("Report (%s): %s \n", metrics_extension(report_format), csvpath);
+    ASSERT(report.close() == 0);
+
+    sprintf(csvpath, "%s/%u.json", CSVDIR, (int) round(getCurrentTimestamp()));
+    printf("Report (json): %s \n", csvpath);
+    run_stats.write_json(csvpath);
+
+    return 0;
+
+err:
+    return -1;
+}
+
+
+void stop_server(int sig)
+{
+    if (server != NULL)
+    {
+        server->request_stop();
+    }
+}
+
+
+/*
+ * gen_fpid_file() one stage at a time for --stats: map and parse, gather
+ * the samples in use (which faults the PCM in), DWT, then pack. Slower than
+ * the fused path, which never materialises the DWT values. Sliding windows
+ * are timed as a whole under the DWT.
+ */
+int fingerprint_staged(FILE *ifp, vector<unsigned int> *fpid)
+{
+    WAVSOURCE src;
+    bool mapped = false;
+    vector<short int> wave;
+    vector<unsigned int> dwt_eco;
+    unsigned int num_dwteco;
+    double t;
+    int r;
+
+    t = getCurrentTimestamp();
+    r = open_wav_source(fileno(ifp), &src);
+    ASSERT(r == 0);
+    mapped = true;
+    run_stats.record(STAGE_PARSE, (getCurrentTimestamp() - t) * 1e3);
+
+    num_dwteco = config_num_dwteco(&fp_config, &src);
+    ASSERT(num_dwteco >= 2);
+
+    if (fp_config.hop != 0)
+    {
+        const unsigned int num_windows = config_num_windows(&fp_config, &src);
+
+        ASSERT(num_windows > 0);
+        fpid->assign((size_t)config_num_frame(&fp_config, num_dwteco) * num_windows, 0);
+
+        t = getCurrentTimestamp();
+        r = gen_fpid_windows(&src, &fp_config, &(*fpid)[0]);
+        ASSERT(r == 0);
+        run_stats.record(STAGE_DWT, (getCurrentTimestamp() - t) * 1e3);
+    }
+    else
+    {
+        fpid->assign(config_num_frame(&fp_config, num_dwteco), 0);
+
+        t = getCurrentTimestamp();
+        wave.resize((size_t)num_dwteco * fp_config.block_size);
+        r = decimate_wave(&src, &fp_config, &wave[0]);
+        ASSERT(r == 0);
+        run_stats.record(STAGE_READ, (getCurrentTimestamp() - t) * 1e3);
+
+        /* the gathered samples are one channel, block_size apart */
+        t = getCurrentTimestamp();
+        dwt_eco.resize(num_dwteco);
+        dwt_engine_blocks(fp_config.wavelet, fp_config.dwt_levels, &wave[0], 1, fp_config.block_size, num_dwteco,
+                          &dwt_eco[0]);
+        run_stats.record(STAGE_DWT, (getCurrentTimestamp() - t) * 1e3);
+
+        t = getCurrentTimestamp();
+        r = pack_fpid_config(&dwt_eco[0], num_dwteco, &fp_config, &(*fpid)[0]);
+        ASSERT(r == 0);
+        run_stats.record(STAGE_PACK, (getCurrentTimestamp() - t) * 1e3);
+    }
+
+    close_wav_source(&src);
+
+    return 0;
+
+err:
+    if (mapped)
+    {
+        close_wav_source(&src);
+    }
+    return -1;
+}
+
+
+/*
+ * Fingerprint every song of qdir with the first-window geometry and print
+ * its k nearest songs among the FPIDs saved in the store or in ODIR.
+ */
+int match_songs(const char *qdir, unsigned int k, int num_threads)
+{
+    FingerprintConfig qcfg = fp_config;
+    vector<string> qnames;
+    vector<unsigned int> qfpids;
+    vector<int> qstatus;
+    vector<vector<FpidMatch> > matches;
+    unsigned int num_frame;
+    DIR *dir = NULL;
+    struct dirent *ep;
+    int r;
+
+    /* a query is one window, sliding windows only apply to the catalogue */
+    qcfg.hop = 0;
+    ASSERT(qcfg.num_wave != 0);
+    num_frame = config_num_frame(&qcfg, config_num_dwteco(&qcfg, NULL));
+
+    {
+        FpidIndex index(num_frame);
+        const double start_time = getCurrentTimestamp();
+
+        r = store_path.empty() ? index.add_dir(ODIR) : index.add_store(store_path.c_str());
+        ASSERT(r == 0);
+        index.build();
+
+        printf("Index: %u song(s), %u FPID(s) from %s in %0.3f ms, popcount %s \n",
+               index.num_songs(), index.num_entries(), store_path.empty() ? ODIR : store_path.c_str(),
+               (getCurrentTimestamp() - start_time) * 1e3, popcount_simd_name());
+
+        dir = opendir(qdir);
+        ASSERT(dir != NULL);
+
+        while ((ep = readdir(dir)) != NULL)
+        {
+            if (ep->d_type == DT_REG)
+            {
+                qnames.push_back(ep->d_name);
+            }
+        }
+
         closedir(dir);
+        dir = NULL;
+
+        sort(qnames.begin(), qnames.end());
+        qfpids.resize(qnames.size() * num_frame);
+        qstatus.resize(qnames.size());
+
+        {
+            WorkStealingPool pool(num_threads);
+
+            pool.run((int)qnames.size(), [&](int index, int worker) {
+                char qpath[256];
+                FILE *qfp;
+                WAVSOURCE src;
+
+                sprintf(qpath, "%s/%s", qdir, qnames[index].c_str());
+                qstatus[index] = -1;
+
+                qfp = fopen(qpath, "rb");
+                if (qfp == NULL)
+                {
+                    return;
+                }
+                if (open_wav_source(fileno(qfp), &src) == 0)
+                {
+                    qstatus[index] = gen_fpid_config(&src, &qcfg, &qfpids[(size_t)index * num_frame]);
+                    close_wav_source(&src);
+                }
+                fclose(qfp);
+            });
+        }
+
+        const double query_time = getCurrentTimestamp();
+
+        r = index.query_batch(&qfpids[0], (unsigned int)qnames.size(), k, &matches, num_threads);
+        ASSERT(r == 0);
+
+        printf("Queried %lu song(s) in %0.3f ms \n", (unsigned long)qnames.size(),
+               (getCurrentTimestamp() - query_time) * 1e3);
+
+        for (size_t i = 0; i < qnames.size(); i++)
+        {
+            if (qstatus[i] != 0)
+            {
+                printf("%s : failed \n", qnames[i].c_str());
+                continue;
+            }
+
+            printf("%s : \n", qnames[i].c_str());
+            for (size_t j = 0; j < matches[i].size(); j++)
+            {
+                const FpidMatch &m = matches[i][j];
+
+                printf("  %lu. %s window %u, distance %u \n", (unsigned long)j + 1,
+                       index.song_name(m.song).c_str(), m.window, m.distance);
+            }
+        }
     }
+
     return 0;
+
+err:
+    if (dir != NULL)
+    {
+        closedir(dir);
+    }
+    return -1;
 }
 
 
-void save_csv(string csvpath)
+/* Start the per-song report, its path goes to path */
+int open_report(char *path)
 {
-    printf("Report (csv): %s \n", csvpath.c_str());
-    
-    csv_data c_data;
-    add_collumn(&c_data, "song_names", song_names);
-    add_collumn(&c_data, "total_time", total_time);
+    sprintf(path, "%s/%u.%s", CSVDIR, (int) round(getCurrentTimestamp()), metrics_extension(report_format));
 
-    write_csv_file_v(&c_data, csvpath);
+    return report.open(path, report_format, "song_names", vector<string>(1, "total_time"));
 }
@@ -4,5 +4,6 @@
 #include "AOCLUtils/opencl.h"
 #include "AOCLUtils/scoped_ptrs.h"
 #include "AOCLUtils/options.h"
+#include "AOCLUtils/buffer_pool.h"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef AOCL_UTILS_BUFFER_POOL_H
+#define AOCL_UTILS_BUFFER_POOL_H
+
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "AOCLUtils/opencl.h"
+
+namespace aocl_utils {
+
+// Pool of device buffers of one context, recycled instead of being created
+// and released for every use. Sizes are rounded up to size classes (a
+// quarter of a power of two apart, so at most 25% larger than asked for)
+// and a released buffer is handed out again for any request of the same
+// flags and class. Thread-safe. Every buffer the pool created is released
+// with the pool, so it must outlive the buffers it hands out.
+class BufferPool {
+public:
+  explicit BufferPool(cl_context context);
+  ~BufferPool();
+
+  // Returns a buffer of at least size bytes, checkError()s on failure.
+  cl_mem acquire(cl_mem_flags flags, size_t size);
+  // Returns a buffer from acquire() to the pool.
+  void release(cl_mem buf);
+  // Releases the buffers that are not in use.
+  void trim();
+
+  unsigned num_created() const;
+  unsigned num_reused() const;
+  size_t bytes_allocated() const;
+
+  static size_t size_class(size_t size);
+
+private:
+  typedef std::pair<cl_mem_flags, size_t> Key;
+
+  cl_context m_context;
+  std::map<Key, std::vector<cl_mem> > m_free;
+  std::map<cl_mem, Key> m_owned;
+  unsigned m_num_created;
+  unsigned m_num_reused;
+  size_t m_bytes;
+  mutable std::mutex m_lock;
+
+  // noncopyable
+  BufferPool(const BufferPool &);
+  BufferPool &operator =(const BufferPool &);
+};
+
+// scoped_buffer: a cl_mem from a BufferPool, returned to it when the handle
+// goes out of scope. Without a pool it owns a plain cl_mem and releases it
+// with clReleaseMemObject.
+class scoped_buffer {
+public:
+  typedef scoped_buffer this_type;
+
+  scoped_buffer() : m_pool(NULL), m_buf(NULL) {}
+  scoped_buffer(BufferPool *pool, cl_mem_flags flags, size_t size) : m_pool(NULL), m_buf(NULL) { reset(pool, flags, size); }
+  ~scoped_buffer() { reset(); }
+
+  cl_mem get() const { return m_buf; }
+  operator cl_mem() const { return m_buf; }
+
+  void reset(cl_mem buf = NULL) {
+    if (m_buf) {
+      if (m_pool) m_pool->release(m_buf);
+      else clReleaseMemObject(m_buf);
+    }
+    m_pool = NULL;
+    m_buf = buf;
+  }
+  void reset(BufferPool *pool, cl_mem_flags flags, size_t size) {
+    reset();
+    m_buf = pool->acquire(flags, size);
+    m_pool = pool;
+  }
+  cl_mem release() { cl_mem buf = m_buf; m_buf = NULL; m_pool = NULL; return buf; }
+
+private:
+  BufferPool *m_pool;
+  cl_mem m_buf;
+
+  // noncopyable
+  scoped_buffer(const this_type &);
+  this_type &operator =(const this_type &);
+};
+
+} // ns aocl_utils
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef HIFP_DWT_ENGINE_H
+#define HIFP_DWT_ENGINE_H
+
+namespace hifp
+{
+
+/*
+ * Fixed-point wavelet filters. A filter is the lowpass (scaling) half of a
+ * wavelet as NUM_TAPS integer taps summing to 1 << SHIFT, so every level of
+ * the DWT is an integer weighted average: multiply-adds, then a shift that
+ * rounds toward zero. For Haar that is the "/ 2" of dwt1(), bit for bit.
+ *
+ * To add a wavelet, define its filter here, give it a wavelet_t value and a
+ * case in dwt_engine.cpp; the CPU paths and the OpenCL build options
+ * (dwt_kernel_options()) all come from the same taps.
+ */
+struct HaarFilter
+{
+    static const int NUM_TAPS = 2;
+    static const int SHIFT    = 1;
+
+    static constexpr int tap(int) { return 1; }
+};
+
+/* Daubechies-4: (1 + sqrt 3, 3 + sqrt 3, 3 - sqrt 3, 1 - sqrt 3) / 8 in Q8 */
+struct Daub4Filter
+{
+    static const int NUM_TAPS = 4;
+    static const int SHIFT    = 8;
+
+    static constexpr int tap(int k) { return k == 0 ? 87 : k == 1 ? 151 : k == 2 ? 41 : -23; }
+};
+
+/*
+ * LEVELS levels of the DWT over a[0 .. 2^LEVELS), leaving the approximation
+ * coefficient in a[0]. Each level filters the previous one with periodic
+ * extension, so a filter longer than 2 taps wraps around inside the block
+ * and never reads past its 2^LEVELS samples.
+ *
+ * V is int for the scalar path or a GCC vector of ints holding the same
+ * sample of several blocks, one block per lane; every operation is
+ * lane-wise. It is always inlined, so the caller's target attribute decides
+ * the instructions, and vectors are only passed by pointer.
+ */
+template <class Filter, unsigned int LEVELS, class V>
+inline __attribute__((always_inline)) void dwt_reduce(
+    V * a
+)
+{
+    V b[(1u << LEVELS) / 2];
+
+    #pragma GCC unroll 8
+    for (unsigned int n = (1u << LEVELS) / 2; n >= 1; n /= 2)
+    {
+        #pragma GCC unroll 128
+        for (unsigned int i = 0; i < n; i++)
+        {
+            V acc = a[2 * i] * Filter::tap(0);
+
+            #pragma GCC unroll 16
+            for (int k = 1; k < Filter::NUM_TAPS; k++)
+            {
+                acc += a[(2 * i + k) & (2 * n - 1)] * Filter::tap(k);
+            }
+
+            /* divide by 2^SHIFT rounding toward zero: add 2^SHIFT - 1 to negative sums */
+            b[i] = (acc + ((acc >> 31) & ((1 << Filter::SHIFT) - 1))) >> Filter::SHIFT;
+        }
+        #pragma GCC unroll 128
+        for (unsigned int i = 0; i < n; i++)
+        {
+            a[i] = b[i];
+        }
+    }
+}
+
+/* DWT of one block, its first 2^LEVELS samples stride shorts apart */
+template <class Filter, unsigned int LEVELS>
+inline int dwt_block(
+    const short int * x,
+    int               stride
+)
+{
+    int a[1u << LEVELS];
+
+    for (unsigned int i = 0; i < (1u << LEVELS); i++)
+    {
+        a[i] = x[i * stride];
+    }
+    dwt_reduce<Filter, LEVELS>(a);
+
+    return a[0];
+}
+
+} // namespace hifp
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef HIFP_FPID_INDEX_H
+#define HIFP_FPID_INDEX_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace hifp
+{
+
+typedef struct
+{
+    unsigned int song;     /* index for FpidIndex::song_name() */
+    unsigned int window;   /* window of the song, 0 without sliding windows */
+    unsigned int distance; /* Hamming distance in bits */
+} FpidMatch;
+
+/*
+ * Hamming-distance index over FPIDs of num_frame words.
+ *
+ * Multi-index hashing: every FPID is cut into substrings of substring_bits
+ * bits and each substring position has its own table, a sorted array of
+ * (substring, entry) pairs. Two FPIDs within distance d agree to within
+ * d / num_substrings bits on at least one substring, so a query probes each
+ * table with its own substring and every value up to probe_radius bits
+ * away, and only the entries found are verified with a full popcount.
+ *
+ * Call build() after the last add() and before querying. Queries are
+ * read-only and may run concurrently.
+ */
+class FpidIndex
+{
+public:
+    /* substring_bits is 8, 16 or 32 */
+    explicit FpidIndex(unsigned int num_frame, unsigned int substring_bits = 16, unsigned int probe_radius = 1);
+
+    /*
+     * Add a song, num_windows FPIDs stored back to back. windows holds the
+     * window number of each FPID; without it they are numbered on from the
+     * song's last window. A known name adds windows to that song.
+     */
+    int add(const std::string &name, const unsigned int *fpid, unsigned int num_windows,
+            const unsigned int *windows = NULL);
+
+    /* Add every .raw file (save_fp_to_disk() output) of a directory */
+    int add_dir(const char *dir);
+
+    /* Add every song of a fingerprint store (fpid_store.h) */
+    int add_store(const char *path);
+
+    /* Sort the tables, needed after adding */
+    void build();
+
+    unsigned int num_frame() const { return m_num_frame; }
+    unsigned int num_songs() const { return (unsigned int)m_song_names.size(); }
+    unsigned int num_entries() const { return (unsigned int)m_entry_song.size(); }
+    const std::string &song_name(unsigned int song) const { return m_song_names[song]; }
+
+    /*
+     * The k songs nearest to fpid, best window per song, by increasing
+     * distance. The probes only guarantee to find entries within
+     * num_substrings * (probe_radius + 1) - 1 bits; when they find fewer
+     * than k songs or the k-th is farther than that, every entry is
+     * verified so the result is always the exact k nearest.
+     */
+    int query(const unsigned int *fpid, unsigned int k, std::vector<FpidMatch> *matches) const;
+
+    /* query() for num_queries FPIDs stored back to back, on num_threads threads */
+    int query_batch(const unsigned int *fpids, unsigned int num_queries, unsigned int k,
+                    std::vector<std::vector<FpidMatch> > *matches, int num_threads) const;
+
+private:
+    unsigned int substring(const unsigned int *fpid, unsigned int s) const;
+    void probe(unsigned int s, unsigned int key, unsigned int first_bit, unsigned int radius,
+               std::vector<unsigned int> *candidates) const;
+
+    unsigned int m_num_frame;
+    unsigned int m_substring_bits;
+    unsigned int m_num_substrings;
+    unsigned int m_probe_radius;
+    bool m_built;
+
+    std::vector<std::string> m_song_names;
+    std::unordered_map<std::string, unsigned int> m_song_ids;
+    std::vector<unsigned int> m_song_next_window;  /* one past the song's highest window */
+    std::vector<unsigned int> m_fpids;         /* num_frame words per entry */
+    std::vector<unsigned int> m_entry_song;
+    std::vector<unsigned int> m_entry_window;
+    /* per substring position: (substring << 32) | entry, sorted by build() */
+    std::vector<std::vector<unsigned long long> > m_tables;
+
+    FpidIndex(const FpidIndex &); // not implemented
+    void operator =(const FpidIndex &); // not implemented
+};
+
+/* Number of differing bits of two FPIDs, popcount dispatched at runtime */
+unsigned int hamming_distance(const unsigned int *a, const unsigned int *b, unsigned int num_words);
+const char *popcount_simd_name();
+
+} // namespace hifp
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef HIFP_FPID_SERVER_H
+#define HIFP_FPID_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace hifp
+{
+
+struct FpidConnection;
+
+/*
+ * Fingerprint job server for the long-running (--serve) mode of the hosts.
+ *
+ * Jobs arrive on a Unix stream socket, a spool directory, or both, and are
+ * queued in arrival order. The host takes them in batches with
+ * next_batch() and hands every result back with complete().
+ *
+ * Socket protocol: a client sends one WAV path per line and gets one line
+ * per path, possibly out of order:
+ *
+ *   OK<TAB>path<TAB>hex FPID words separated by spaces
+ *   ERR<TAB>path<TAB>message
+ *
+ * Spool directory: a file moved into <spool>/in (names starting with '.'
+ * are ignored, so writers can rename a finished temporary into place) is
+ * claimed by moving it to <spool>/work. Its FPID is written to
+ * <spool>/out/<name>.raw, in the format of the .raw files, and the input
+ * goes to <spool>/done, or to <spool>/failed when it cannot be
+ * fingerprinted.
+ */
+struct FpidJob
+{
+    std::string path;         /* WAV file to fingerprint */
+    std::string name;         /* spool file name, empty for socket jobs */
+    double      arrival_time; /* getCurrentTimestamp() when queued */
+    std::shared_ptr<FpidConnection> conn;  /* socket the reply goes to */
+};
+
+class FpidServer
+{
+public:
+    FpidServer();
+    ~FpidServer();
+
+    /* Accept jobs on a Unix socket at path, replacing a stale socket file */
+    int listen_socket(const char *path);
+
+    /* Take jobs from spool_dir/in, scanned every poll_ms */
+    int watch_spool(const char *spool_dir, unsigned int poll_ms);
+
+    /*
+     * A batch is handed out once max_batch jobs are queued, or max_wait_ms
+     * after its oldest job arrived, whichever comes first: full batches
+     * under load, bounded latency for a trickle.
+     */
+    void set_batching(unsigned int max_batch, double max_wait_ms);
+
+    /* Start the I/O thread */
+    int start();
+
+    /* Wait for the next batch; false once stopping and every job was handed out */
+    bool next_batch(std::vector<FpidJob> *batch);
+
+    /* Reply to a job, status 0 with its FPID words or an error */
+    void complete(const FpidJob &job, int status, const unsigned int *fpid, size_t num_words);
+
+    /* Stop taking jobs, queued jobs are still handed out. Async-signal-safe. */
+    void request_stop() { m_stop = true; }
+
+    unsigned long long num_jobs() const { return m_num_jobs; }
+    unsigned long long num_batches() const { return m_num_batches; }
+
+private:
+    void io_loop();
+    void accept_client();
+    void read_client(const std::shared_ptr<FpidConnection> &conn);
+    void scan_spool();
+    void push(const FpidJob &job);
+    void close_all();
+
+    int m_listen_fd;
+    std::string m_socket_path;
+    std::vector<std::shared_ptr<FpidConnection> > m_clients;
+
+    std::string m_spool_dir;
+    unsigned int m_poll_ms;
+
+    unsigned int m_max_batch;
+    double m_max_wait;        /* seconds */
+
+    std::deque<FpidJob> m_queue;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::atomic<bool> m_stop;
+    bool m_io_done;
+    std::thread m_io_thread;
+    std::atomic<unsigned long long> m_num_jobs;
+    std::atomic<unsigned long long> m_num_batches;
+
+    FpidServer(const FpidServer &); // not implemented
+    void operator =(const FpidServer &); // not implemented
+};
+
+} // namespace hifp
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef HIFP_FPID_STORE_H
+#define HIFP_FPID_STORE_H
+
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace hifp
+{
+
+/*
+ * Fingerprint store: every FPID of a run in one append-only file.
+ *
+ *   header | block | block | ... | footer | trailer
+ *
+ * A block holds fixed-size records (name offset, window, num_frame FPID
+ * words) followed by the string table of its song names, and is covered by
+ * a CRC-32C. The footer indexes the blocks and the trailer at the very end
+ * of the file points to the footer. Appending writes new blocks, a new
+ * footer and a new trailer after the old ones, so a file is never
+ * rewritten and the last trailer always describes every block.
+ * A file that does not end with a trailer (a run killed while appending)
+ * is recovered by walking its blocks from the header: every complete
+ * block with a matching checksum is kept, and the writer truncates the
+ * rest before appending.
+ * All fields are in host byte order.
+ */
+
+typedef struct
+{
+    char         magic[4];    /* "HFPS" */
+    unsigned int version;
+    unsigned int num_frame;   /* FPID words per record */
+    unsigned int reserved;
+} FPIDSTOREHEADER;
+
+typedef struct
+{
+    char         magic[4];    /* "HFPB" */
+    unsigned int num_records;
+    unsigned int names_size;  /* bytes of string table after the records, padded to end the block 8-byte aligned */
+    unsigned int checksum;    /* CRC-32C of the records and the string table */
+} FPIDBLOCKHEADER;
+
+typedef struct
+{
+    unsigned int name;        /* offset of the song name in the block's string table */
+    unsigned int window;      /* window of the song, 0 without sliding windows */
+    unsigned int fpid[1];     /* num_frame words */
+} FPIDRECORD;
+
+typedef struct
+{
+    unsigned long long offset;      /* of the block header */
+    unsigned int       num_records;
+    unsigned int       checksum;
+} FPIDBLOCKINDEX;
+
+typedef struct
+{
+    char               magic[4];    /* "HFPF" */
+    unsigned int       num_blocks;  /* FPIDBLOCKINDEX entries that follow */
+    unsigned long long num_records;
+} FPIDSTOREFOOTER;
+
+typedef struct
+{
+    unsigned long long footer_offset;
+    unsigned int       footer_checksum;  /* CRC-32C of the footer and its index */
+    char               magic[4];         /* "HFPT" */
+} FPIDSTORETRAILER;
+
+
+/* Appends songs to a store, thread-safe */
+class FpidStoreWriter
+{
+public:
+    FpidStoreWriter();
+    ~FpidStoreWriter();
+
+    /* Create path, or reopen it for appending when it already holds a store */
+    int open(const char *path, unsigned int num_frame, unsigned int block_records = 1024);
+
+    /* num_windows FPIDs of one song, back to back */
+    int append(const std::string &name, const unsigned int *fpid, unsigned int num_windows);
+
+    /* Write the pending block, the footer and the trailer */
+    int close();
+
+private:
+    int flush_block();
+
+    FILE *m_fp;
+    unsigned int m_num_frame;
+    unsigned int m_block_records;
+    unsigned long long m_offset;       /* end of the file */
+    unsigned long long m_num_records;
+    std::vector<unsigned int> m_records; /* records of the pending block */
+    std::string m_names;
+    unsigned int m_pending;
+    std::vector<FPIDBLOCKINDEX> m_index;
+    bool m_dirty;                      /* blocks added since open() */
+    std::mutex m_lock;
+
+    FpidStoreWriter(const FpidStoreWriter &); // not implemented
+    void operator =(const FpidStoreWriter &); // not implemented
+};
+
+
+/* Read-only memory mapping of a store, records are used in place */
+class FpidStoreReader
+{
+public:
+    FpidStoreReader();
+    ~FpidStoreReader();
+
+    int open(const char *path);
+    void close();
+
+    /* Check every block against its checksum */
+    int verify() const;
+
+    unsigned int num_frame() const { return m_num_frame; }
+    unsigned int num_blocks() const { return (unsigned int)m_index.size(); }
+    unsigned long long num_records() const { return m_num_records; }
+
+    /* Records of block b are contiguous, record_size() bytes apart */
+    size_t record_size() const { return 2 * sizeof(unsigned int) + m_num_frame * sizeof(unsigned int); }
+    unsigned int block_num_records(unsigned int b) const { return m_index[b].num_records; }
+    const FPIDRECORD *block_record(unsigned int b, unsigned int i) const;
+    const char *block_name(unsigned int b, const FPIDRECORD *record) const;
+
+private:
+    void *m_map;
+    size_t m_map_size;
+    unsigned int m_num_frame;
+    unsigned long long m_num_records;
+    std::vector<FPIDBLOCKINDEX> m_index;
+
+    FpidStoreReader(const FpidStoreReader &); // not implemented
+    void operator =(const FpidStoreReader &); // not implemented
+};
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t size);
+
+} // namespace hifp
+
+#endif
@@ -8,12 +8,14 @@
 #define NUM_WAVE 131072; /* Number of samples of PCM data */
 #define NUM_DWT_ECO 4096; /* Number of bits per FPIDs */
 #define NUM_FRAME 128;   /* Number of frames of generated FPID data */
+#define NUM_STREAM_BLOCK 32; /* Number of DWT blocks decoded per read when streaming */
 
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <vector>
 
 // #include "utils/utils.h"
 
@@ -42,6 +44,45 @@ typedef struct
     unsigned int size_wave; /* Number of bytes of waveform data */
 } WAVEHEADER;
 
+/*
+ * Read-only view of a memory-mapped WAV file.
+ * Samples are interleaved, so sample i of channel 0 is pcm[i * NumChannel];
+ * DWT block j starts at pcm[j * 32 * NumChannel].
+ */
+typedef struct
+{
+    WAVEHEADER        header;
+    void *            map;         /* mapping of the whole file */
+    size_t            map_size;
+    const short int * pcm;         /* first sample of the data chunk */
+    size_t            num_samples; /* number of shorts in the data chunk */
+} WAVSOURCE;
+
+/*
+ * Fingerprint geometry.
+ * The defaults reproduce NUM_WAVE / NUM_DWT_ECO / NUM_FRAME: 131072 samples,
+ * one 3-level Haar value per 32-sample block, 32 bits per FPID word.
+ * Each DWT value compares with the next one; the last bit is always 0.
+ */
+typedef struct
+{
+    unsigned int num_wave;      /* samples per channel to fingerprint, 0 = whole track */
+    unsigned int block_size;    /* samples per DWT block (decimation stride) */
+    unsigned int dwt_levels;    /* DWT levels, a block uses its first 2^dwt_levels samples */
+    unsigned int bits_per_word; /* comparison bits per FPID word, 1 to 32 */
+    unsigned int sample_rate;   /* required sample rate, 0 accepts any */
+    unsigned int hop;           /* samples between sliding windows, 0 = one fingerprint */
+    unsigned int wavelet;       /* wavelet_t of the DWT */
+} FingerprintConfig;
+
+/* Wavelets of the fixed-point DWT engine (dwt_engine.h) */
+enum wavelet_t
+{
+    WAVELET_HAAR,
+    WAVELET_DB4,
+    NUM_WAVELETS
+};
+
 #define ERRPRINT(c)                                                    \
     do                                                                 \
     {                                                                  \
@@ -69,16 +110,73 @@ typedef struct
 /* function prototype */
 int readwav8(FILE *fp, short int *wave16, unsigned short int numch);
 int dwt1(short int *wave16);
-WAVEHEADER read_wave_header(FILE *ifp);
+int read_wave_header(FILE *ifp, WAVEHEADER *wave_header);
 int read_wav_data(FILE *ifp, short int *wav_data, WAVEHEADER wave_header);
-int gen_fpid(short int *wave16, unsigned int *fpid);
+int gen_fpid(short int *wave16, unsigned int *plain_fpid, unsigned int *fpid, unsigned int *dwt_eco);
+int gen_fpid_stream(FILE *ifp, WAVEHEADER wave_header, unsigned int *fpid);
 int save_fp_to_disk(FILE *ofp, unsigned int *fpid);
+int save_fp_to_disk(FILE *ofp, const unsigned int *fpid, unsigned int num_frame);
 void verify_fpid(unsigned int *fpid, unsigned int *plain_fpid, unsigned int *dwt);
-int run_all(FILE *ifp, FILE *ofp);
+int gen_fpid_file(FILE *ifp, const FingerprintConfig *cfg, std::vector<unsigned int> *fpid);
+int run_all(FILE *ifp, FILE *ofp, const FingerprintConfig *cfg);
 
 void init_ref_dwt(unsigned int *ref_dwt);
 void init_ref_fpid(unsigned int *ref_fpid);
 
+/*
+ * Memory-mapped WAV input (wav_source.cpp). open_wav_source() returns
+ * WAV_NOT_MAPPED for a file that cannot be mapped (a pipe, ...), which can
+ * still be streamed, and -1 for one that is not a 16-bit PCM WAV.
+ */
+#define WAV_NOT_MAPPED (-2)
+int open_wav_source(int fd, WAVSOURCE *src);
+void close_wav_source(WAVSOURCE *src);
+int gen_fpid_mapped(const WAVSOURCE *src, unsigned int *fpid);
+
+/* SIMD kernels (dwt_simd.cpp), dispatched at runtime */
+void dwt_blocks(const short int *pcm, int numch, int nblocks, unsigned int *dwt_eco);
+unsigned int pack_fpid_word(const unsigned int *dwt_eco);
+void gather_taps8(const short int *pcm, int numch, int nblocks, size_t block_stride, short int *dst);
+const char *dwt_simd_name();
+
+/* Fixed-point DWT engine (dwt_engine.cpp), dispatched at runtime */
+const char *wavelet_name(unsigned int wavelet);
+int parse_wavelet(const char *name, unsigned int *wavelet);
+void dwt_engine_blocks(unsigned int wavelet, unsigned int levels, const short int *pcm, int numch, size_t block_size, size_t nblocks, unsigned int *dwt_eco);
+int dwt_kernel_options(unsigned int wavelet, char *options, size_t size);
+
+/* Fingerprint geometry (config.cpp) */
+FingerprintConfig default_fingerprint_config();
+bool is_default_config(const FingerprintConfig *cfg);
+int check_fingerprint_config(const FingerprintConfig *cfg);
+unsigned int config_num_dwteco(const FingerprintConfig *cfg, const WAVSOURCE *src);
+unsigned int config_num_frame(const FingerprintConfig *cfg, unsigned int num_dwteco);
+int gen_fpid_config(const WAVSOURCE *src, const FingerprintConfig *cfg, unsigned int *fpid);
+int decimate_wave(const WAVSOURCE *src, const FingerprintConfig *cfg, short int *wave16);
+int decimate_wave_dense(const WAVSOURCE *src, const FingerprintConfig *cfg, short int *wave16);
+int dwt_config_blocks(const WAVSOURCE *src, const FingerprintConfig *cfg, unsigned int nblocks, unsigned int *dwt_eco);
+int pack_fpid_config(const unsigned int *dwt_eco, unsigned int num_dwteco, const FingerprintConfig *cfg, unsigned int *fpid);
+
+/* Sliding-window fingerprints (windows.cpp) */
+unsigned int config_num_windows(const FingerprintConfig *cfg, const WAVSOURCE *src);
+int gen_fpid_windows(const WAVSOURCE *src, const FingerprintConfig *cfg, unsigned int *fpid);
+
+/* Differential testing (diff_test.cpp) */
+enum test_signal_t
+{
+    SIGNAL_SILENCE,
+    SIGNAL_NOISE,
+    SIGNAL_SINE,
+    SIGNAL_SQUARE,
+    SIGNAL_RAMP,
+    SIGNAL_EXTREMES,
+    SIGNAL_SIGN,
+    NUM_TEST_SIGNALS
+};
+const char *test_signal_name(int signal);
+int make_test_source(int signal, unsigned int numch, unsigned int num_samples, unsigned int seed, std::vector<short int> *pcm, WAVSOURCE *src);
+int first_fpid_mismatch(const unsigned int *expected, const unsigned int *actual, unsigned int num_frame);
+
 } // namespace hifp
 
 #endif
\ No newline at end of file
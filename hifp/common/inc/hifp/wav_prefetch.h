@@ -0,0 +1,94 @@
+#ifndef HIFP_WAV_PREFETCH_H
+#define HIFP_WAV_PREFETCH_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hifp/hifp.h"
+#include "utils/stage_stats.h"
+
+namespace hifp
+{
+
+/*
+ * Background WAV loader.
+ *
+ * Loader threads open, parse and decimate (decimate_wave()) the songs of a
+ * list in order into a ring of caller-owned buffers, so the thread driving
+ * the device never waits on the disk while buffers are available. Song i
+ * always lands in buffer i % num_buffers; a buffer is refilled once the
+ * consumer has released the song it held.
+ */
+class WavPrefetcher
+{
+public:
+    /* buffers hold buffer_samples shorts each, e.g. DMA-aligned host buffers */
+    WavPrefetcher(const FingerprintConfig *cfg, short int **buffers, unsigned int num_buffers,
+                  size_t buffer_samples, int num_threads = 1);
+    ~WavPrefetcher();
+
+    /* Record the open, parse and read times of the loaders */
+    void set_stats(my_utils::RunStats *stats) { m_stats = stats; }
+
+    /* Decimate into the dense layout (decimate_wave_dense()) */
+    void set_dense(bool dense) { m_dense = dense; }
+
+    /* Start loading the files of paths, in order */
+    void start(const std::vector<std::string> &paths);
+
+    /* Wait for a song, *status is 0 when it loaded; songs must be acquired in order */
+    short int *acquire(unsigned int song, int *status);
+
+    /* The buffer of a song may be refilled */
+    void release(unsigned int song);
+
+    /* Stop the loaders, songs not loaded yet are dropped */
+    void stop();
+
+    /* Time acquire() spent waiting for the loaders */
+    double wait_time_ms() const { return m_wait_time * 1e3; }
+
+private:
+    enum slot_state_t
+    {
+        SLOT_FREE,
+        SLOT_LOADING,
+        SLOT_READY
+    };
+
+    struct Slot
+    {
+        unsigned int next_song;  /* next song to use the buffer */
+        slot_state_t state;
+        int          status;
+    };
+
+    void loader();
+    void record(my_utils::stage_t stage, double *t);
+
+    FingerprintConfig m_config;
+    std::vector<short int *> m_buffers;
+    size_t m_buffer_samples;
+    int m_num_threads;
+    my_utils::RunStats *m_stats;
+    bool m_dense;
+
+    std::vector<std::string> m_paths;
+    std::vector<Slot> m_slots;
+    unsigned int m_next;      /* next song to hand to a loader */
+    bool m_stop;
+    double m_wait_time;
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::vector<std::thread> m_threads;
+
+    WavPrefetcher(const WavPrefetcher &); // not implemented
+    void operator =(const WavPrefetcher &); // not implemented
+};
+
+} // namespace hifp
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef UTILS_METRICS_H
+#define UTILS_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace my_utils
+{
+
+enum metrics_format_t
+{
+    METRICS_CSV,     /* text, one row per line */
+    METRICS_BINARY   /* blocks of columns, see MetricsWriter */
+};
+
+/* "csv" or "binary", -1 for anything else */
+int parse_metrics_format(const std::string &name, metrics_format_t *format);
+
+/* File extension of a format, without the dot */
+const char *metrics_extension(metrics_format_t format);
+
+/*
+ * Per-song report written while the run goes: each row is a song name and
+ * a fixed set of double columns. Rows are formatted into a buffer allocated
+ * once and written out in blocks of about 1 MB, so the memory used does not
+ * grow with the run and the report is complete as soon as the run ends.
+ * add_row() is thread-safe; rows are written in the order they are added.
+ *
+ * The binary format is for long runs, with no formatting and about half the
+ * size of the CSV. All integers are uint32 and values float64, in host byte
+ * order (the version number tells the order):
+ *
+ *   "HIFPMETR", version (1), number of value columns N,
+ *   then the key column name and the N column names as length + bytes
+ *   blocks of up to BINARY_BLOCK_ROWS rows:
+ *     number of rows R (> 0), bytes of the keys K,
+ *     R end offsets of the keys, the K bytes of the keys,
+ *     then each column as R values
+ *   a block of 0 rows marks the end of a complete file.
+ */
+class MetricsWriter
+{
+public:
+    static const unsigned int BINARY_BLOCK_ROWS = 16384;
+
+    MetricsWriter();
+    ~MetricsWriter();
+
+    /* Create path, truncating it, and write the column names */
+    int open(const char *path, metrics_format_t format, const char *key_name, const std::vector<std::string> &columns);
+
+    /* One row of a key and one value per column */
+    void add_row(const char *key, const double *values);
+
+    /* Write the remaining rows and close, 0 when every row was written */
+    int close();
+
+    bool is_open() const { return m_fp != NULL; }
+    unsigned long long num_rows() const { return m_num_rows; }
+
+private:
+    void append(const char *data, size_t size);
+    void add_csv_row(const char *key, const double *values);
+    void add_binary_row(const char *key, const double *values);
+    void write_block();
+    void flush();
+    void write(const void *data, size_t size);
+
+    FILE *m_fp;
+    metrics_format_t m_format;
+    unsigned int m_num_columns;
+    unsigned long long m_num_rows;
+    bool m_failed;
+
+    std::vector<char> m_buffer;   /* text, or the keys of the block */
+    size_t m_used;
+
+    std::vector<uint32_t> m_key_ends;  /* binary: rows of the current block */
+    std::vector<double> m_values;      /* column-major, BINARY_BLOCK_ROWS per column */
+    unsigned int m_block_rows;
+
+    std::mutex m_lock;
+
+    MetricsWriter(const MetricsWriter &); // not implemented
+    void operator =(const MetricsWriter &); // not implemented
+};
+
+} // namespace my_utils
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef UTILS_STAGE_STATS_H
+#define UTILS_STAGE_STATS_H
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+namespace my_utils
+{
+
+/* Stages of fingerprinting one song */
+enum stage_t
+{
+    STAGE_OPEN,      /* open the file */
+    STAGE_PARSE,     /* map it and parse the WAV header */
+    STAGE_READ,      /* bring in the PCM samples the fingerprint uses */
+    STAGE_DWT,
+    STAGE_PACK,      /* pack the comparisons into FPID words */
+    STAGE_TRANSFER,  /* host to device and back */
+    STAGE_KERNEL,
+    STAGE_WRITE,     /* save the FPID */
+    STAGE_SONG,      /* whole song, end to end */
+    NUM_STAGES
+};
+
+const char *stage_name(stage_t stage);
+
+/*
+ * Latency histogram with HDR-style log-linear buckets over nanoseconds:
+ * values below 128 ns have a bucket each, above that every power of two is
+ * split into 64 buckets, so percentiles are within 1.6% of the recorded
+ * value whatever its magnitude, in a fixed 30 KB.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(double ms);
+    void merge(const LatencyHistogram &other);
+
+    unsigned long long count() const { return m_count; }
+    double mean() const;
+    double max() const;
+
+    /* Smallest value at least p percent of the records are not above */
+    double percentile(double p) const;
+
+private:
+    static unsigned int bucket(unsigned long long ns);
+    static unsigned long long bucket_max(unsigned int b);
+
+    std::vector<unsigned long long> m_buckets;
+    unsigned long long m_count;
+    unsigned long long m_max;
+    double m_sum;
+};
+
+/*
+ * Per-stage histograms and throughput of a run, thread-safe. Stages that
+ * were never recorded are left out of the reports.
+ */
+class RunStats
+{
+public:
+    RunStats();
+
+    /* Wall clock of the run, for songs/s and MB/s */
+    void start();
+    void stop();
+
+    void record(stage_t stage, double ms);
+    /* One song fingerprinted from a file of bytes bytes */
+    void add_song(unsigned long long bytes);
+
+    void print_summary(FILE *fp) const;
+    int write_json(const char *path) const;
+
+private:
+    double wall_time() const;
+
+    LatencyHistogram m_stages[NUM_STAGES];
+    unsigned long long m_songs;
+    unsigned long long m_bytes;
+    double m_start_time;
+    double m_stop_time;
+    mutable std::mutex m_lock;
+
+    RunStats(const RunStats &); // not implemented
+    void operator =(const RunStats &); // not implemented
+};
+
+}
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef UTILS_THREAD_POOL_H
+#define UTILS_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace my_utils
+{
+
+/*
+ * Fixed-size work-stealing pool for index-based jobs.
+ *
+ * run(n, task) splits [0, n) into one contiguous range per worker. Each
+ * worker takes indices from the front of its own queue and, once empty,
+ * steals from the back of the other queues, so uneven jobs (e.g. files of
+ * different sizes) still keep every core busy.
+ *
+ * The worker threads are started once and wait between calls, so a caller
+ * that runs many small batches does not pay for thread creation each time.
+ * The thread calling run() works as worker 0.
+ */
+class WorkStealingPool
+{
+public:
+    explicit WorkStealingPool(int num_threads);
+    ~WorkStealingPool();
+
+    int size() const { return m_num_threads; }
+
+    /* Calls task(index, worker_id) for every index in [0, n), blocks until done */
+    void run(int n, const std::function<void(int, int)> &task);
+
+private:
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<int> items;
+    };
+
+    bool pop_local(int worker, int *index);
+    bool steal(int worker, int *index);
+    void worker_loop(int worker, const std::function<void(int, int)> &task);
+    void worker_main(int worker);
+
+    int m_num_threads;
+    std::vector<WorkQueue> m_queues;
+    std::vector<std::thread> m_threads;  /* workers 1 to num_threads - 1 */
+    std::mutex m_lock;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    const std::function<void(int, int)> *m_task;
+    unsigned int m_generation;           /* run() calls so far */
+    int m_pending;                       /* workers still busy in this run() */
+    bool m_stop;
+
+    WorkStealingPool(const WorkStealingPool &); // not implemented
+    void operator =(const WorkStealingPool &); // not implemented
+};
+
+}
+
+#endif
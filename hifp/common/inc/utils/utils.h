@@ -3,6 +3,7 @@
 #define NUM_FRAME 128;   /* Number of frames of generated FPID data */
 
 #include <stdio.h>
+#include <time.h>
 #include <algorithm>
 
 namespace my_utils
@@ -0,0 +1,113 @@
+#include "AOCLUtils/buffer_pool.h"
+
+namespace aocl_utils
+{
+
+// Smallest size class, requests below it share one class.
+static const size_t MIN_SIZE_CLASS = 4096;
+
+BufferPool::BufferPool(cl_context context)
+    : m_context(context),
+      m_num_created(0),
+      m_num_reused(0),
+      m_bytes(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    for (std::map<cl_mem, Key>::iterator it = m_owned.begin(); it != m_owned.end(); ++it)
+    {
+        clReleaseMemObject(it->first);
+    }
+}
+
+// Rounds size up to a multiple of a quarter of the power of two below it.
+size_t BufferPool::size_class(size_t size)
+{
+    if (size <= MIN_SIZE_CLASS)
+    {
+        return MIN_SIZE_CLASS;
+    }
+
+    unsigned log2 = 0;
+    for (size_t s = size - 1; s > 1; s >>= 1)
+    {
+        log2++;
+    }
+
+    const size_t step = (size_t)1 << (log2 - 2);
+    return (size + step - 1) & ~(step - 1);
+}
+
+cl_mem BufferPool::acquire(cl_mem_flags flags, size_t size)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    const Key key(flags, size_class(size));
+
+    std::vector<cl_mem> &free_list = m_free[key];
+    if (!free_list.empty())
+    {
+        cl_mem buf = free_list.back();
+        free_list.pop_back();
+        m_num_reused++;
+        return buf;
+    }
+
+    cl_int status;
+    cl_mem buf = clCreateBuffer(m_context, flags, key.second, NULL, &status);
+    checkError(status, "Failed to create pooled buffer of %lu bytes", (unsigned long)key.second);
+
+    m_owned[buf] = key;
+    m_num_created++;
+    m_bytes += key.second;
+    return buf;
+}
+
+void BufferPool::release(cl_mem buf)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    std::map<cl_mem, Key>::iterator it = m_owned.find(buf);
+    if (it == m_owned.end())
+    {
+        checkError(CL_INVALID_MEM_OBJECT, "Buffer was not acquired from this pool");
+    }
+    m_free[it->second].push_back(buf);
+}
+
+void BufferPool::trim()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    for (std::map<Key, std::vector<cl_mem> >::iterator it = m_free.begin(); it != m_free.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); ++i)
+        {
+            clReleaseMemObject(it->second[i]);
+            m_owned.erase(it->second[i]);
+            m_bytes -= it->first.second;
+        }
+    }
+    m_free.clear();
+}
+
+unsigned BufferPool::num_created() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_num_created;
+}
+
+unsigned BufferPool::num_reused() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_num_reused;
+}
+
+size_t BufferPool::bytes_allocated() const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_bytes;
+}
+
+} // namespace aocl_utils
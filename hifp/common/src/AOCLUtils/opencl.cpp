@@ -4,9 +4,12 @@
 
 #ifdef _WIN32 // Windows
 #include <windows.h>
+#include <direct.h> // _mkdir
+#include <process.h> // _getpid
 #else // Linux
 #include <stdio.h>
-#include <unistd.h> // readlink, chdir
+#include <unistd.h> // readlink, chdir, getpid
+#include <sys/stat.h> // mkdir
 #endif
 
 namespace aocl_utils
@@ -434,6 +437,7 @@ unsigned char *loadBinaryFile(const char *file_name, size_t *size)
         return NULL;
     }
 
+    fclose(fp);
     return binary;
 }
 
@@ -447,6 +451,148 @@ bool fileExists(const char *file_name)
 #endif
 }
 
+// 64-bit FNV-1a hash of size bytes, continuing from h.
+static unsigned long long hashBytes(const void *data, size_t size, unsigned long long h)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Hashes a string info parameter of the platform or the device, with its terminator.
+static unsigned long long hashInfo(cl_platform_id pid, cl_device_id did, cl_uint param, unsigned long long h)
+{
+    size_t sz = 0;
+    cl_int status;
+
+    status = pid != NULL ? clGetPlatformInfo(pid, param, 0, NULL, &sz) : clGetDeviceInfo(did, param, 0, NULL, &sz);
+    checkError(status, "Query for program cache key size failed");
+
+    scoped_array<char> value(sz);
+    status = pid != NULL ? clGetPlatformInfo(pid, param, sz, value, NULL) : clGetDeviceInfo(did, param, sz, value, NULL);
+    checkError(status, "Query for program cache key failed");
+
+    return hashBytes(value.get(), sz, h);
+}
+
+std::string getProgramCachePath(const char *cache_dir, cl_device_id device, const char *source, size_t source_size, const char *options)
+{
+    cl_platform_id platform;
+    unsigned long long h = 14695981039346656037ull;
+    char name[32];
+
+    cl_int status = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    checkError(status, "Failed to get device platform");
+
+    h = hashBytes(source, source_size, h);
+    h = hashBytes(options, strlen(options) + 1, h);
+    h = hashInfo(platform, NULL, CL_PLATFORM_NAME, h);
+    h = hashInfo(platform, NULL, CL_PLATFORM_VERSION, h);
+    h = hashInfo(NULL, device, CL_DEVICE_NAME, h);
+    h = hashInfo(NULL, device, CL_DEVICE_VERSION, h);
+    h = hashInfo(NULL, device, CL_DRIVER_VERSION, h);
+
+    snprintf(name, sizeof(name), "%016llx.bin", h);
+    return std::string(cache_dir) + "/" + name;
+}
+
+// Writes the binary of a program built for one device to path. The binary
+// goes to a temporary file first, so concurrent processes never read a
+// partial one.
+static void saveProgramBinary(cl_program program, const char *cache_dir, const std::string &path)
+{
+    size_t binary_size = 0;
+    cl_int status;
+
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
+    if (status != CL_SUCCESS || binary_size == 0)
+    {
+        return;
+    }
+
+    scoped_array<unsigned char> binary(binary_size);
+    unsigned char *binaries[1] = { binary.get() };
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL);
+    if (status != CL_SUCCESS)
+    {
+        return;
+    }
+
+    char tmp_path[1024];
+#ifdef _WIN32 // Windows
+    _mkdir(cache_dir);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path.c_str(), _getpid());
+#else // Linux
+    mkdir(cache_dir, 0777);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path.c_str(), getpid());
+#endif
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+    {
+        printf("Cannot write the program cache %s\n", cache_dir);
+        return;
+    }
+    bool ok = fwrite(binary.get(), binary_size, 1, fp) == 1;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path.c_str()) != 0)
+    {
+        remove(tmp_path);
+    }
+}
+
+cl_program createProgramWithCache(cl_context context, cl_device_id device, const char *source, size_t source_size, const char *options, const char *cache_dir)
+{
+    cl_program program = NULL;
+    cl_int status;
+    std::string path;
+
+    if (cache_dir != NULL && cache_dir[0] != '\0')
+    {
+        path = getProgramCachePath(cache_dir, device, source, source_size, options);
+
+        size_t binary_size;
+        scoped_array<unsigned char> binary(loadBinaryFile(path.c_str(), &binary_size));
+        if (binary != NULL)
+        {
+            const unsigned char *binary_ptr = binary.get();
+            cl_int binary_status = CL_SUCCESS;
+
+            program = clCreateProgramWithBinary(context, 1, &device, &binary_size, &binary_ptr, &binary_status, &status);
+            if (status == CL_SUCCESS && binary_status == CL_SUCCESS &&
+                clBuildProgram(program, 1, &device, options, NULL, NULL) == CL_SUCCESS)
+            {
+                printf("Using cached program binary: %s\n", path.c_str());
+                return program;
+            }
+
+            // A binary the runtime rejects is rebuilt and replaced.
+            if (program != NULL)
+            {
+                clReleaseProgram(program);
+            }
+        }
+    }
+
+    program = clCreateProgramWithSource(context, 1, &source, &source_size, &status);
+    checkError(status, "Failed to create program with source");
+
+    status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    checkError(status, "Failed to build program");
+
+    if (!path.empty())
+    {
+        saveProgramBinary(program, cache_dir, path);
+    }
+
+    return program;
+}
+
 std::string getBoardBinaryFile(const char *prefix, cl_device_id device)
 {
     // First check if <prefix>.aocx exists. Use it if it does.
@@ -1,4 +1,4 @@
-#include "AOCLUtils/aocl_utils.h"
+#include "AOCLUtils/options.h"
 #include <algorithm>
 #include <iostream>
 #include <stdlib.h>
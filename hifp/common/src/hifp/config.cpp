@@ -0,0 +1,343 @@
+#include "hifp/hifp.h"
+
+namespace hifp
+{
+
+const int NUMWAVE   = NUM_WAVE;
+const int NUMDWTECO = NUM_DWT_ECO;
+const int NUMFRAME  = NUM_FRAME;
+
+const unsigned int MAX_DWT_LEVELS = 8;
+const unsigned int NUM_CHUNK_BLOCKS = 256;  /* DWT values computed at a time by gen_fpid_config() */
+
+FingerprintConfig default_fingerprint_config()
+{
+    FingerprintConfig cfg;
+
+    cfg.num_wave      = NUMWAVE;
+    cfg.block_size    = NUMWAVE / NUMDWTECO;
+    cfg.dwt_levels    = 3;
+    cfg.bits_per_word = NUMDWTECO / NUMFRAME;
+    cfg.sample_rate   = 44100;
+    cfg.hop           = 0;
+    cfg.wavelet       = WAVELET_HAAR;
+
+    return cfg;
+}
+
+bool is_default_config(
+    const FingerprintConfig * cfg
+)
+{
+    const FingerprintConfig def = default_fingerprint_config();
+
+    return cfg->num_wave == def.num_wave
+        && cfg->block_size == def.block_size
+        && cfg->dwt_levels == def.dwt_levels
+        && cfg->bits_per_word == def.bits_per_word
+        && cfg->hop == def.hop
+        && cfg->wavelet == def.wavelet;
+}
+
+int check_fingerprint_config(
+    const FingerprintConfig * cfg
+)
+{
+    ASSERT(cfg->dwt_levels >= 1 && cfg->dwt_levels <= MAX_DWT_LEVELS);
+    ASSERT(cfg->wavelet < NUM_WAVELETS);
+    ASSERT(cfg->block_size >= (1u << cfg->dwt_levels));
+    ASSERT(cfg->bits_per_word >= 1 && cfg->bits_per_word <= 32);
+    ASSERT(cfg->num_wave == 0 || cfg->num_wave >= 2 * cfg->block_size);
+    /* windows start on a block boundary and have a fixed length */
+    ASSERT(cfg->hop % cfg->block_size == 0);
+    ASSERT(cfg->hop == 0 || cfg->num_wave != 0);
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/*
+ * Number of DWT values (= FPID bits) of a fingerprint.
+ * For whole tracks (num_wave == 0) it is every complete block of the track,
+ * rounded down to whole FPID words; src may be NULL otherwise.
+ */
+unsigned int config_num_dwteco(
+    const FingerprintConfig * cfg,
+    const WAVSOURCE *         src
+)
+{
+    if (cfg->num_wave != 0)
+    {
+        return cfg->num_wave / cfg->block_size;
+    }
+
+    const unsigned int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const size_t num_blocks = src->num_samples / numch / cfg->block_size;
+
+    return (unsigned int)(num_blocks - num_blocks % cfg->bits_per_word);
+}
+
+unsigned int config_num_frame(
+    const FingerprintConfig * cfg,
+    unsigned int              num_dwteco
+)
+{
+    return (num_dwteco + cfg->bits_per_word - 1) / cfg->bits_per_word;
+}
+
+/*
+ * FPID generation for any geometry over a mapped file.
+ * fpid must hold config_num_frame() words. The default geometry (and any
+ * 32-sample, 3-level Haar, 32-bit geometry with whole words) runs on the
+ * SIMD kernels of dwt_simd.cpp; everything else computes the DWT values a
+ * chunk at a time on the DWT engine, then packs them.
+ */
+int gen_fpid_config(
+    const WAVSOURCE *         src,
+    const FingerprintConfig * cfg,
+    unsigned int *            fpid
+)
+{
+    const int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const int block_size = cfg->block_size * numch;  /* shorts per DWT block */
+    unsigned int num_dwteco;
+    unsigned int num_frame;
+    int r;
+
+    r = check_fingerprint_config(cfg);
+    ASSERT(r == 0);
+    ASSERT(cfg->sample_rate == 0 || src->header.SampleRate == cfg->sample_rate);
+
+    num_dwteco = config_num_dwteco(cfg, src);
+    num_frame  = config_num_frame(cfg, num_dwteco);
+    ASSERT(num_dwteco >= 2);
+    ASSERT(src->num_samples >= (size_t)num_dwteco * block_size);
+
+    if (cfg->block_size == 32 && cfg->dwt_levels == 3 && cfg->wavelet == WAVELET_HAAR &&
+        cfg->bits_per_word == 32 && num_dwteco % 32 == 0)
+    {
+        unsigned int dwt_buf[33];
+
+        dwt_blocks(src->pcm, numch, 1, &dwt_buf[0]);
+
+        for (unsigned int k = 0; k < num_frame; k++)
+        {
+            /* last word holds 31 comparisons, the padding value never compares greater */
+            const int n = (k < num_frame - 1) ? 32 : 31;
+            dwt_blocks(&src->pcm[((size_t)32 * k + 1) * block_size], numch, n, &dwt_buf[1]);
+            if (n == 31)
+            {
+                dwt_buf[32] = 0xFFFFFFFF;
+            }
+
+            fpid[k] = pack_fpid_word(dwt_buf);
+            dwt_buf[0] = dwt_buf[32];
+        }
+
+        return 0;
+    }
+
+    {
+        const unsigned int bpw = cfg->bits_per_word;
+        unsigned int dwt_buf[NUM_CHUNK_BLOCKS];
+        unsigned int dwt_prev;
+        unsigned int dwt_cur;
+        unsigned int word = 0;
+        unsigned int nbits = 0;
+        unsigned int k = 0;
+
+        dwt_engine_blocks(cfg->wavelet, cfg->dwt_levels, src->pcm, numch, cfg->block_size, 1, &dwt_prev);
+
+        for (unsigned int j = 1; j <= num_dwteco; j++)
+        {
+            /* the bit after the last DWT value is padding */
+            if (j < num_dwteco)
+            {
+                /* next chunk of DWT values */
+                if ((j - 1) % NUM_CHUNK_BLOCKS == 0)
+                {
+                    const unsigned int n = (num_dwteco - j < NUM_CHUNK_BLOCKS) ? num_dwteco - j : NUM_CHUNK_BLOCKS;
+
+                    dwt_engine_blocks(cfg->wavelet, cfg->dwt_levels, &src->pcm[(size_t)j * block_size], numch,
+                                      cfg->block_size, n, dwt_buf);
+                }
+                dwt_cur = dwt_buf[(j - 1) % NUM_CHUNK_BLOCKS];
+                word = (word << 1) | (dwt_prev > dwt_cur ? 1 : 0);
+                dwt_prev = dwt_cur;
+            }
+            else
+            {
+                word <<= 1;
+            }
+
+            if (++nbits == bpw)
+            {
+                fpid[k++] = word;
+                word = 0;
+                nbits = 0;
+            }
+        }
+
+        /* left-align a partial last word */
+        if (nbits > 0)
+        {
+            fpid[k] = word << (bpw - nbits);
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/* DWT values of the first nblocks blocks of a track, on the DWT engine */
+int dwt_config_blocks(
+    const WAVSOURCE *         src,
+    const FingerprintConfig * cfg,
+    unsigned int              nblocks,
+    unsigned int *            dwt_eco
+)
+{
+    const int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const size_t block_size = (size_t)cfg->block_size * numch;  /* shorts per DWT block */
+
+    ASSERT(src->num_samples >= nblocks * block_size);
+
+    dwt_engine_blocks(cfg->wavelet, cfg->dwt_levels, src->pcm, numch, cfg->block_size, nblocks, dwt_eco);
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/*
+ * Pack the comparisons of num_dwteco DWT values into FPID words, the second
+ * half of gen_fpid_config() for callers that time or reuse the DWT.
+ */
+int pack_fpid_config(
+    const unsigned int *      dwt_eco,
+    unsigned int              num_dwteco,
+    const FingerprintConfig * cfg,
+    unsigned int *            fpid
+)
+{
+    const unsigned int bpw = cfg->bits_per_word;
+    unsigned int word = 0;
+    unsigned int nbits = 0;
+    unsigned int k = 0;
+
+    ASSERT(num_dwteco >= 2);
+
+    for (unsigned int j = 1; j <= num_dwteco; j++)
+    {
+        /* the bit after the last DWT value is padding */
+        word = (word << 1) | ((j < num_dwteco && dwt_eco[j - 1] > dwt_eco[j]) ? 1 : 0);
+
+        if (++nbits == bpw)
+        {
+            fpid[k++] = word;
+            word = 0;
+            nbits = 0;
+        }
+    }
+
+    /* left-align a partial last word */
+    if (nbits > 0)
+    {
+        fpid[k] = word << (bpw - nbits);
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/*
+ * Copy the samples the DWT uses into a block-strided buffer, the layout the
+ * OpenCL kernels read: block j occupies wave16[j * block_size ...] and only
+ * its first 2^dwt_levels samples (channel 0) are written. wave16 must hold
+ * config_num_dwteco() * block_size samples. For the default geometry this
+ * matches read_wav_data().
+ */
+int decimate_wave(
+    const WAVSOURCE *         src,
+    const FingerprintConfig * cfg,
+    short int *               wave16
+)
+{
+    const int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const unsigned int taps = 1u << cfg->dwt_levels;
+    unsigned int num_dwteco;
+
+    ASSERT(cfg->sample_rate == 0 || src->header.SampleRate == cfg->sample_rate);
+
+    num_dwteco = config_num_dwteco(cfg, src);
+    ASSERT(src->num_samples >= (size_t)num_dwteco * cfg->block_size * numch);
+
+    for (unsigned int j = 0; j < num_dwteco; j++)
+    {
+        const short int *blk = &src->pcm[(size_t)j * cfg->block_size * numch];
+        short int *dst = &wave16[(size_t)j * cfg->block_size];
+
+        for (unsigned int i = 0; i < taps; i++)
+        {
+            dst[i] = blk[i * numch];
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/*
+ * Copy the samples the DWT uses into a dense buffer, 2^dwt_levels per block
+ * back to back, so only those reach the device: a quarter of the bytes of
+ * the block-strided layout for the default geometry. wave16 must hold
+ * config_num_dwteco() << dwt_levels samples.
+ */
+int decimate_wave_dense(
+    const WAVSOURCE *         src,
+    const FingerprintConfig * cfg,
+    short int *               wave16
+)
+{
+    const int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const unsigned int taps = 1u << cfg->dwt_levels;
+    unsigned int num_dwteco;
+
+    ASSERT(cfg->sample_rate == 0 || src->header.SampleRate == cfg->sample_rate);
+
+    num_dwteco = config_num_dwteco(cfg, src);
+    ASSERT(src->num_samples >= (size_t)num_dwteco * cfg->block_size * numch);
+
+    if (taps == 8)
+    {
+        gather_taps8(src->pcm, numch, (int)num_dwteco, cfg->block_size, wave16);
+        return 0;
+    }
+
+    for (unsigned int j = 0; j < num_dwteco; j++)
+    {
+        const short int *blk = &src->pcm[(size_t)j * cfg->block_size * numch];
+        short int *dst = &wave16[(size_t)j * taps];
+
+        for (unsigned int i = 0; i < taps; i++)
+        {
+            dst[i] = blk[i * numch];
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+} // namespace hifp
@@ -0,0 +1,140 @@
+#include "hifp/hifp.h"
+
+#include <math.h>
+#include <vector>
+
+namespace hifp
+{
+
+/*
+ * Differential testing helpers.
+ *
+ * The synthetic signals are chosen to reach the corners of the DWT: all
+ * zero, full-scale noise and square waves whose coefficients are large and
+ * negative, -32768/32767 extremes, and small coefficients of random sign,
+ * where a signed comparison disagrees with the reference's unsigned
+ * comparison of sign-extended values. The right channel of a stereo signal
+ * carries independent noise, so reading the wrong channel or stride shows
+ * up as a mismatch.
+ */
+
+static const char *const TEST_SIGNAL_NAMES[NUM_TEST_SIGNALS] = {
+    "silence",
+    "noise",
+    "sine",
+    "square",
+    "ramp",
+    "extremes",
+    "sign"
+};
+
+const char *test_signal_name(
+    int signal
+)
+{
+    return (signal >= 0 && signal < NUM_TEST_SIGNALS) ? TEST_SIGNAL_NAMES[signal] : "unknown";
+}
+
+/* Sample i of a signal, state is a per-signal LCG */
+static short int test_sample(
+    int            signal,
+    unsigned int   i,
+    unsigned int * state
+)
+{
+    static const short int extremes[5] = { -32768, 32767, -1, 0, 1 };
+
+    *state = *state * 1664525u + 1013904223u;
+
+    switch (signal)
+    {
+    case SIGNAL_NOISE:
+        return (short int)(*state >> 16);
+    case SIGNAL_SINE:
+        return (short int)(30000.0 * sin(2.0 * M_PI * 440.0 * i / 44100.0));
+    case SIGNAL_SQUARE:
+        return ((i / 50) % 2 == 0) ? 32767 : -32768;
+    case SIGNAL_RAMP:
+        return (short int)(i * 97);
+    case SIGNAL_EXTREMES:
+        return extremes[(*state >> 16) % 5];
+    case SIGNAL_SIGN:
+    {
+        /* constant +-1..3 over runs of 8 samples, so DWT blocks of any size get random signs */
+        const unsigned int h = (i / 8) * 2654435761u;
+
+        return (short int)(((h >> 31) ? -1 : 1) * (int)(1 + (h >> 16) % 3));
+    }
+    default:
+        return 0;
+    }
+}
+
+/*
+ * A WAVSOURCE over num_samples samples per channel of a synthetic 44.1 kHz
+ * signal held in *pcm. The source maps nothing: it must not be passed to
+ * close_wav_source() and is valid as long as *pcm is.
+ */
+int make_test_source(
+    int                      signal,
+    unsigned int             numch,
+    unsigned int             num_samples,
+    unsigned int             seed,
+    std::vector<short int> * pcm,
+    WAVSOURCE *              src
+)
+{
+    unsigned int left = seed * 2 + 1;
+    unsigned int right = seed * 2 + 2;
+
+    ASSERT(signal >= 0 && signal < NUM_TEST_SIGNALS);
+    ASSERT(numch == 1 || numch == 2);
+
+    pcm->resize((size_t)num_samples * numch);
+    for (unsigned int i = 0; i < num_samples; i++)
+    {
+        (*pcm)[(size_t)i * numch] = test_sample(signal, i, &left);
+        if (numch == 2)
+        {
+            (*pcm)[(size_t)i * numch + 1] = test_sample(SIGNAL_NOISE, i, &right);
+        }
+    }
+
+    memset(src, 0, sizeof(WAVSOURCE));
+    src->header.FormatId      = 1;
+    src->header.NumChannel    = (unsigned short)numch;
+    src->header.SampleRate    = 44100;
+    src->header.BitsPerSample = 16;
+    src->header.BlockAlign    = (unsigned short)(numch * 2);
+    src->header.ByteRate      = 44100 * numch * 2;
+    src->header.size_wave     = (unsigned int)(pcm->size() * sizeof(short int));
+    src->map                  = NULL;
+    src->map_size             = pcm->size() * sizeof(short int);
+    src->pcm                  = &(*pcm)[0];
+    src->num_samples          = pcm->size();
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/* Index of the first word where actual differs from expected, -1 when they match */
+int first_fpid_mismatch(
+    const unsigned int * expected,
+    const unsigned int * actual,
+    unsigned int         num_frame
+)
+{
+    for (unsigned int k = 0; k < num_frame; k++)
+    {
+        if (expected[k] != actual[k])
+        {
+            return (int)k;
+        }
+    }
+
+    return -1;
+}
+
+} // namespace hifp
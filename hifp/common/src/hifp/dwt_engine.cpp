@@ -0,0 +1,291 @@
+#include "hifp/hifp.h"
+#include "hifp/dwt_engine.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HIFP_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HIFP_NEON 1
+#endif
+
+namespace hifp
+{
+
+/*
+ * Instantiations of the DWT engine for every wavelet and level count of
+ * FingerprintConfig, on each instruction set. The vector paths use the
+ * vertical layout of dwt_simd.cpp: lane i of x[p] holds sample p of block
+ * i, so dwt_reduce() runs on whole vectors. All paths are bit-identical.
+ */
+
+typedef int v4si __attribute__((vector_size(16)));
+typedef int v8si __attribute__((vector_size(32)));
+
+typedef void (*dwt_engine_fn)(const short int *, int, size_t, size_t, unsigned int *);
+
+static const char *const WAVELET_NAMES[NUM_WAVELETS] = {
+    "haar",
+    "db4"
+};
+
+const unsigned int MAX_ENGINE_LEVELS = 8;  /* MAX_DWT_LEVELS of config.cpp */
+
+
+template <class Filter, unsigned int LEVELS>
+static void dwt_engine_scalar(
+    const short int * pcm,
+    int               numch,
+    size_t            block_size,
+    size_t            nblocks,
+    unsigned int *    dwt_eco
+)
+{
+    const size_t bs = block_size * numch;
+
+    for (size_t b = 0; b < nblocks; b++)
+    {
+        dwt_eco[b] = dwt_block<Filter, LEVELS>(&pcm[b * bs], numch);
+    }
+}
+
+
+#if defined(HIFP_X86) || defined(HIFP_NEON)
+
+/* 4 blocks per iteration; pmulld needs SSE4.1 for filters with taps other than 1 */
+template <class Filter, unsigned int LEVELS>
+#ifdef HIFP_X86
+__attribute__((target("sse4.1")))
+#endif
+static void dwt_engine_v4(
+    const short int * pcm,
+    int               numch,
+    size_t            block_size,
+    size_t            nblocks,
+    unsigned int *    dwt_eco
+)
+{
+    const size_t bs = block_size * numch;
+    size_t b = 0;
+
+    for (; b + 4 <= nblocks; b += 4)
+    {
+        const short int *p0 = &pcm[b * bs];
+        v4si x[1u << LEVELS];
+
+        for (unsigned int p = 0; p < (1u << LEVELS); p++)
+        {
+            const size_t o = p * numch;
+            const v4si v = { p0[o], p0[bs + o], p0[2 * bs + o], p0[3 * bs + o] };
+
+            x[p] = v;
+        }
+
+        dwt_reduce<Filter, LEVELS>(x);
+
+        memcpy(&dwt_eco[b], &x[0], sizeof(v4si));
+    }
+
+    dwt_engine_scalar<Filter, LEVELS>(&pcm[b * bs], numch, block_size, nblocks - b, &dwt_eco[b]);
+}
+
+#endif
+
+
+#ifdef HIFP_X86
+
+/*
+ * AVX2: 8 blocks per iteration, samples fetched with 32-bit gathers. Every
+ * gather stays inside the first 2^LEVELS samples of its block: sample p of
+ * a mono block is the high half of samples p - 1 and p (sample 0 the low
+ * half of 0 and 1), and of a stereo block the low half of its frame.
+ */
+template <class Filter, unsigned int LEVELS>
+__attribute__((target("avx2")))
+static void dwt_engine_avx2(
+    const short int * pcm,
+    int               numch,
+    size_t            block_size,
+    size_t            nblocks,
+    unsigned int *    dwt_eco
+)
+{
+    const size_t bs = block_size * numch;
+    /* byte offsets of sample 0 of 8 consecutive blocks */
+    const __m256i vidx = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                            _mm256_set1_epi32((int)(bs * sizeof(short int))));
+    size_t b = 0;
+
+    if (bs * 8 * sizeof(short int) > 0x7FFFFFFF)
+    {
+        dwt_engine_v4<Filter, LEVELS>(pcm, numch, block_size, nblocks, dwt_eco);
+        return;
+    }
+
+    for (; b + 8 <= nblocks; b += 8)
+    {
+        const short int *p0 = &pcm[b * bs];
+        v8si x[1u << LEVELS];
+
+        for (unsigned int p = 0; p < (1u << LEVELS); p++)
+        {
+            __m256i v;
+
+            if (numch == 2 || p == 0)
+            {
+                v = _mm256_i32gather_epi32((const int *)(p0 + p * numch), vidx, 1);
+                v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+            }
+            else
+            {
+                v = _mm256_i32gather_epi32((const int *)(p0 + p - 1), vidx, 1);
+                v = _mm256_srai_epi32(v, 16);
+            }
+            x[p] = (v8si)v;
+        }
+
+        dwt_reduce<Filter, LEVELS>(x);
+
+        _mm256_storeu_si256((__m256i *)&dwt_eco[b], (__m256i)x[0]);
+    }
+
+    dwt_engine_v4<Filter, LEVELS>(&pcm[b * bs], numch, block_size, nblocks - b, &dwt_eco[b]);
+}
+
+#endif
+
+
+/* Fastest path of one wavelet and level count on this CPU */
+template <class Filter, unsigned int LEVELS>
+static dwt_engine_fn select_engine()
+{
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return dwt_engine_avx2<Filter, LEVELS>;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return dwt_engine_v4<Filter, LEVELS>;
+    }
+#elif defined(HIFP_NEON)
+    return dwt_engine_v4<Filter, LEVELS>;
+#endif
+    return dwt_engine_scalar<Filter, LEVELS>;
+}
+
+template <class Filter>
+static dwt_engine_fn select_engine(
+    unsigned int levels
+)
+{
+    switch (levels)
+    {
+    case 1: return select_engine<Filter, 1>();
+    case 2: return select_engine<Filter, 2>();
+    case 3: return select_engine<Filter, 3>();
+    case 4: return select_engine<Filter, 4>();
+    case 5: return select_engine<Filter, 5>();
+    case 6: return select_engine<Filter, 6>();
+    case 7: return select_engine<Filter, 7>();
+    case 8: return select_engine<Filter, 8>();
+    default: return NULL;
+    }
+}
+
+/* Engines of every wavelet and level count, resolved once */
+struct EngineTable
+{
+    dwt_engine_fn fn[NUM_WAVELETS][MAX_ENGINE_LEVELS + 1];
+
+    EngineTable()
+    {
+        for (unsigned int l = 0; l <= MAX_ENGINE_LEVELS; l++)
+        {
+            fn[WAVELET_HAAR][l] = select_engine<HaarFilter>(l);
+            fn[WAVELET_DB4][l]  = select_engine<Daub4Filter>(l);
+        }
+    }
+};
+
+const char *wavelet_name(
+    unsigned int wavelet
+)
+{
+    return (wavelet < NUM_WAVELETS) ? WAVELET_NAMES[wavelet] : "unknown";
+}
+
+int parse_wavelet(
+    const char *   name,
+    unsigned int * wavelet
+)
+{
+    for (unsigned int w = 0; w < NUM_WAVELETS; w++)
+    {
+        if (strcmp(name, WAVELET_NAMES[w]) == 0)
+        {
+            *wavelet = w;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * DWT values of nblocks blocks of block_size samples per channel, the first
+ * 2^levels samples of channel 0 of each. wavelet and levels must have
+ * passed check_fingerprint_config().
+ */
+void dwt_engine_blocks(
+    unsigned int      wavelet,
+    unsigned int      levels,
+    const short int * pcm,
+    int               numch,
+    size_t            block_size,
+    size_t            nblocks,
+    unsigned int *    dwt_eco
+)
+{
+    static const EngineTable table;
+
+    table.fn[wavelet][levels](pcm, numch, block_size, nblocks, dwt_eco);
+}
+
+/*
+ * OpenCL build options describing a wavelet's filter to hifp.cl, from the
+ * same taps as the CPU paths: -DDWT_FILTER_TAPS, -DDWT_SHIFT and the taps
+ * as -DDWT_FILTER. Returns -1 when they do not fit size bytes.
+ */
+template <class Filter>
+static int filter_options(
+    char * options,
+    size_t size
+)
+{
+    int n = snprintf(options, size, "-DDWT_FILTER_TAPS=%d -DDWT_SHIFT=%d -DDWT_FILTER=",
+                     Filter::NUM_TAPS, Filter::SHIFT);
+
+    for (int k = 0; k < Filter::NUM_TAPS && n >= 0 && (size_t)n < size; k++)
+    {
+        n += snprintf(options + n, size - n, k == 0 ? "%d" : ",%d", Filter::tap(k));
+    }
+
+    return (n >= 0 && (size_t)n < size) ? 0 : -1;
+}
+
+int dwt_kernel_options(
+    unsigned int wavelet,
+    char *       options,
+    size_t       size
+)
+{
+    switch (wavelet)
+    {
+    case WAVELET_HAAR: return filter_options<HaarFilter>(options, size);
+    case WAVELET_DB4:  return filter_options<Daub4Filter>(options, size);
+    default:           return -1;
+    }
+}
+
+} // namespace hifp
@@ -0,0 +1,223 @@
+#include "hifp/hifp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HIFP_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#define HIFP_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace hifp
+{
+
+/*
+ * SIMD kernels of the default geometry. dwt_blocks() is the 3-level Haar
+ * DWT of 32-sample blocks on the DWT engine (dwt_engine.cpp), which has the
+ * vectorised paths of every wavelet and level count.
+ *
+ * pack_fpid_word() compares 33 consecutive DWT values as unsigned ints (the
+ * same as gen_fpid()) and returns the 32 comparison bits MSB first.
+ */
+
+typedef unsigned int (*pack_fpid_word_fn)(const unsigned int *);
+
+
+/* Scalar fallback */
+static unsigned int pack_fpid_word_scalar(
+    const unsigned int * dwt_eco
+)
+{
+    unsigned int word = 0;
+
+    for (int i = 0; i < 32; i++)
+    {
+        word = (word << 1) | (dwt_eco[i] > dwt_eco[i + 1] ? 1 : 0);
+    }
+
+    return word;
+}
+
+
+#ifdef HIFP_X86
+
+/* SSE4.1: 4 comparisons per iteration */
+__attribute__((target("sse4.1")))
+static unsigned int pack_fpid_word_sse41(
+    const unsigned int * dwt_eco
+)
+{
+    const __m128i bias = _mm_set1_epi32((int)0x80000000);
+    unsigned int word = 0;
+
+    for (int g = 0; g < 8; g++)
+    {
+        __m128i cur  = _mm_loadu_si128((const __m128i *)&dwt_eco[4 * g]);
+        __m128i next = _mm_loadu_si128((const __m128i *)&dwt_eco[4 * g + 1]);
+        __m128i gt   = _mm_cmpgt_epi32(_mm_xor_si128(cur, bias), _mm_xor_si128(next, bias));
+
+        /* reverse lanes so the first comparison lands in the highest bit */
+        gt = _mm_shuffle_epi32(gt, _MM_SHUFFLE(0, 1, 2, 3));
+        word |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(gt)) << (28 - 4 * g);
+    }
+
+    return word;
+}
+
+
+/* AVX2: 8 comparisons per iteration */
+__attribute__((target("avx2")))
+static unsigned int pack_fpid_word_avx2(
+    const unsigned int * dwt_eco
+)
+{
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+    const __m256i rev  = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    unsigned int word = 0;
+
+    for (int g = 0; g < 4; g++)
+    {
+        __m256i cur  = _mm256_loadu_si256((const __m256i *)&dwt_eco[8 * g]);
+        __m256i next = _mm256_loadu_si256((const __m256i *)&dwt_eco[8 * g + 1]);
+        __m256i gt   = _mm256_cmpgt_epi32(_mm256_xor_si256(cur, bias), _mm256_xor_si256(next, bias));
+
+        /* reverse lanes so the first comparison lands in the highest bit */
+        gt = _mm256_permutevar8x32_epi32(gt, rev);
+        word |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(gt)) << (24 - 8 * g);
+    }
+
+    return word;
+}
+
+#endif /* HIFP_X86 */
+
+
+#ifdef HIFP_NEON
+
+/* NEON: 4 comparisons per iteration */
+static unsigned int pack_fpid_word_neon(
+    const unsigned int * dwt_eco
+)
+{
+    /* weights put the first comparison of each group in the highest bit */
+    const uint32_t w[4] = {8, 4, 2, 1};
+    const uint32x4_t weights = vld1q_u32(w);
+    unsigned int word = 0;
+
+    for (int g = 0; g < 8; g++)
+    {
+        uint32x4_t cur  = vld1q_u32(&dwt_eco[4 * g]);
+        uint32x4_t next = vld1q_u32(&dwt_eco[4 * g + 1]);
+        uint32x4_t gt   = vandq_u32(vcgtq_u32(cur, next), weights);
+
+        word |= vaddvq_u32(gt) << (28 - 4 * g);
+    }
+
+    return word;
+}
+
+#endif /* HIFP_NEON */
+
+
+/* Runtime dispatch, resolved once */
+static pack_fpid_word_fn select_pack_fpid_word()
+{
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return pack_fpid_word_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return pack_fpid_word_sse41;
+    }
+#elif defined(HIFP_NEON)
+    return pack_fpid_word_neon;
+#endif
+    return pack_fpid_word_scalar;
+}
+
+void dwt_blocks(
+    const short int * pcm,
+    int               numch,
+    int               nblocks,
+    unsigned int *    dwt_eco
+)
+{
+    dwt_engine_blocks(WAVELET_HAAR, 3, pcm, numch, 32, nblocks, dwt_eco);
+}
+
+unsigned int pack_fpid_word(
+    const unsigned int * dwt_eco
+)
+{
+    static const pack_fpid_word_fn fn = select_pack_fpid_word();
+
+    return fn(dwt_eco);
+}
+
+/*
+ * Gather the first 8 samples (channel 0) of nblocks blocks block_stride
+ * samples apart into dst, 8 per block back to back: the dense layout of
+ * the OpenCL host. Stereo samples are deinterleaved 8 at a time; SSE2 and
+ * NEON are part of the base x86-64 and AArch64 ABIs, so no dispatch.
+ */
+void gather_taps8(
+    const short int * pcm,
+    int               numch,
+    int               nblocks,
+    size_t            block_stride,
+    short int *       dst
+)
+{
+    for (int b = 0; b < nblocks; b++)
+    {
+        const short int *blk = &pcm[(size_t)b * block_stride * numch];
+        short int *out = &dst[(size_t)b * 8];
+
+        if (numch == 1)
+        {
+            memcpy(out, blk, 8 * sizeof(short int));
+            continue;
+        }
+#if defined(__SSE2__)
+        {
+            /* keep the low (left) half of each 32-bit frame, sign-extended, then repack */
+            const __m128i lo = _mm_loadu_si128((const __m128i *)blk);
+            const __m128i hi = _mm_loadu_si128((const __m128i *)(blk + 8));
+            const __m128i l0 = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+            const __m128i l1 = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+
+            _mm_storeu_si128((__m128i *)out, _mm_packs_epi32(l0, l1));
+        }
+#elif defined(HIFP_NEON)
+        vst1q_s16(out, vld2q_s16(blk).val[0]);
+#else
+        for (int i = 0; i < 8; i++)
+        {
+            out[i] = blk[i * numch];
+        }
+#endif
+    }
+}
+
+const char *dwt_simd_name()
+{
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return "avx2";
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return "sse4.1";
+    }
+#elif defined(HIFP_NEON)
+    return "neon";
+#endif
+    return "scalar";
+}
+
+} // namespace hifp
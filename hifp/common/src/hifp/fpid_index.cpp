@@ -0,0 +1,475 @@
+#include "hifp/hifp.h"
+#include "hifp/fpid_index.h"
+#include "hifp/fpid_store.h"
+#include "utils/thread_pool.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HIFP_X86 1
+#include <immintrin.h>
+#endif
+
+namespace hifp
+{
+
+/*
+ * Popcount verifier. The scalar path counts 32-bit words with
+ * __builtin_popcount, the POPCNT path 64 bits at a time and the AVX-512
+ * path 512 bits at a time with VPOPCNTQ, 8 vectors per 4096-bit FPID.
+ */
+
+typedef unsigned int (*hamming_fn)(const unsigned int *, const unsigned int *, unsigned int);
+
+static unsigned int hamming_scalar(
+    const unsigned int * a,
+    const unsigned int * b,
+    unsigned int         num_words
+)
+{
+    unsigned int distance = 0;
+
+    for (unsigned int i = 0; i < num_words; i++)
+    {
+        distance += __builtin_popcount(a[i] ^ b[i]);
+    }
+
+    return distance;
+}
+
+
+#ifdef HIFP_X86
+
+__attribute__((target("popcnt")))
+static unsigned int hamming_popcnt(
+    const unsigned int * a,
+    const unsigned int * b,
+    unsigned int         num_words
+)
+{
+    unsigned int distance = 0;
+    unsigned int i = 0;
+
+    for (; i + 2 <= num_words; i += 2)
+    {
+        unsigned long long x, y;
+
+        memcpy(&x, &a[i], sizeof(x));
+        memcpy(&y, &b[i], sizeof(y));
+        distance += __builtin_popcountll(x ^ y);
+    }
+    for (; i < num_words; i++)
+    {
+        distance += __builtin_popcount(a[i] ^ b[i]);
+    }
+
+    return distance;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static unsigned int hamming_avx512(
+    const unsigned int * a,
+    const unsigned int * b,
+    unsigned int         num_words
+)
+{
+    __m512i acc = _mm512_setzero_si512();
+    unsigned long long lanes[8];
+    unsigned int distance = 0;
+    unsigned int i = 0;
+
+    for (; i + 16 <= num_words; i += 16)
+    {
+        __m512i x = _mm512_loadu_si512((const void *)&a[i]);
+        __m512i y = _mm512_loadu_si512((const void *)&b[i]);
+
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(x, y)));
+    }
+
+    _mm512_storeu_si512((void *)lanes, acc);
+    for (int l = 0; l < 8; l++)
+    {
+        distance += (unsigned int)lanes[l];
+    }
+
+    return distance + hamming_popcnt(&a[i], &b[i], num_words - i);
+}
+
+#endif /* HIFP_X86 */
+
+
+static hamming_fn select_hamming()
+{
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        return hamming_avx512;
+    }
+    if (__builtin_cpu_supports("popcnt"))
+    {
+        return hamming_popcnt;
+    }
+#endif
+    return hamming_scalar;
+}
+
+unsigned int hamming_distance(
+    const unsigned int * a,
+    const unsigned int * b,
+    unsigned int         num_words
+)
+{
+    static const hamming_fn fn = select_hamming();
+
+    return fn(a, b, num_words);
+}
+
+const char *popcount_simd_name()
+{
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        return "avx512-vpopcntdq";
+    }
+    if (__builtin_cpu_supports("popcnt"))
+    {
+        return "popcnt";
+    }
+#endif
+    return "scalar";
+}
+
+
+FpidIndex::FpidIndex(unsigned int num_frame, unsigned int substring_bits, unsigned int probe_radius)
+    : m_num_frame(num_frame),
+      m_substring_bits(substring_bits),
+      m_num_substrings(num_frame * (32 / substring_bits)),
+      m_probe_radius(probe_radius),
+      m_built(true),
+      m_tables(m_num_substrings)
+{
+}
+
+/* Substring s, MSB first within each word */
+unsigned int FpidIndex::substring(const unsigned int *fpid, unsigned int s) const
+{
+    const unsigned int per_word = 32 / m_substring_bits;
+    const unsigned int shift = 32 - m_substring_bits * (s % per_word + 1);
+    const unsigned int mask = (m_substring_bits == 32) ? 0xFFFFFFFF : ((1u << m_substring_bits) - 1);
+
+    return (fpid[s / per_word] >> shift) & mask;
+}
+
+int FpidIndex::add(const std::string &name, const unsigned int *fpid, unsigned int num_windows,
+                   const unsigned int *windows)
+{
+    std::unordered_map<std::string, unsigned int>::iterator it = m_song_ids.find(name);
+    unsigned int song;
+
+    ASSERT(m_substring_bits == 8 || m_substring_bits == 16 || m_substring_bits == 32);
+    ASSERT(num_windows > 0);
+
+    if (it != m_song_ids.end())
+    {
+        song = it->second;
+    }
+    else
+    {
+        song = (unsigned int)m_song_names.size();
+        m_song_ids[name] = song;
+        m_song_names.push_back(name);
+        m_song_next_window.push_back(0);
+    }
+
+    for (unsigned int w = 0; w < num_windows; w++)
+    {
+        const unsigned int *window = &fpid[(size_t)w * m_num_frame];
+        const unsigned int entry = (unsigned int)m_entry_song.size();
+        const unsigned int number = (windows != NULL) ? windows[w] : m_song_next_window[song];
+
+        m_fpids.insert(m_fpids.end(), window, window + m_num_frame);
+        m_entry_song.push_back(song);
+        m_entry_window.push_back(number);
+        m_song_next_window[song] = std::max(m_song_next_window[song], number + 1);
+
+        for (unsigned int s = 0; s < m_num_substrings; s++)
+        {
+            m_tables[s].push_back(((unsigned long long)substring(window, s) << 32) | entry);
+        }
+    }
+    m_built = false;
+
+    return 0;
+
+err:
+    return -1;
+}
+
+int FpidIndex::add_dir(const char *dir)
+{
+    const size_t fpid_size = m_num_frame * sizeof(unsigned int);
+    std::vector<std::string> names;
+    std::vector<unsigned int> fpid;
+    DIR *dp = NULL;
+    struct dirent *ep;
+    char path[256];
+    FILE *fp;
+    long size;
+
+    dp = opendir(dir);
+    ASSERT(dp != NULL);
+
+    while ((ep = readdir(dp)) != NULL)
+    {
+        const size_t len = strlen(ep->d_name);
+
+        if (ep->d_type == DT_REG && len > 4 && strcmp(&ep->d_name[len - 4], ".raw") == 0)
+        {
+            names.push_back(ep->d_name);
+        }
+    }
+    closedir(dp);
+
+    /* song numbers do not depend on the directory order */
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        sprintf(path, "%s/%s", dir, names[i].c_str());
+
+        fp = fopen(path, "rb");
+        ASSERT(fp != NULL);
+
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        /* FPIDs of another geometry */
+        if (size <= 0 || size % fpid_size != 0)
+        {
+            printf("%s : %ld bytes, not a multiple of %lu, skipped \n", path, size, (unsigned long)fpid_size);
+            fclose(fp);
+            continue;
+        }
+
+        fpid.resize(size / sizeof(unsigned int));
+        if (fread(&fpid[0], 1, size, fp) != (size_t)size)
+        {
+            ERRPRINT();
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+
+        add(names[i].substr(0, names[i].size() - 4), &fpid[0], (unsigned int)(size / fpid_size));
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+int FpidIndex::add_store(const char *path)
+{
+    FpidStoreReader store;
+    std::vector<unsigned int> fpid;
+    std::vector<unsigned int> windows;
+    int r;
+
+    r = store.open(path);
+    ASSERT(r == 0);
+    ASSERT(store.num_frame() == m_num_frame);
+    r = store.verify();
+    ASSERT(r == 0);
+
+    /* the windows of a song are consecutive records of one block */
+    for (unsigned int b = 0; b < store.num_blocks(); b++)
+    {
+        const unsigned int n = store.block_num_records(b);
+
+        for (unsigned int i = 0; i < n; )
+        {
+            const FPIDRECORD *first = store.block_record(b, i);
+            unsigned int num_windows = 0;
+
+            fpid.clear();
+            windows.clear();
+            while (i + num_windows < n && store.block_record(b, i + num_windows)->name == first->name)
+            {
+                const FPIDRECORD *record = store.block_record(b, i + num_windows);
+
+                fpid.insert(fpid.end(), record->fpid, record->fpid + m_num_frame);
+                windows.push_back(record->window);
+                num_windows++;
+            }
+
+            add(store.block_name(b, first), &fpid[0], num_windows, &windows[0]);
+            i += num_windows;
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+void FpidIndex::build()
+{
+    for (unsigned int s = 0; s < m_num_substrings; s++)
+    {
+        std::sort(m_tables[s].begin(), m_tables[s].end());
+    }
+    m_built = true;
+}
+
+/* Entries whose substring s is within radius bits of key, flipping bits from first_bit on */
+void FpidIndex::probe(unsigned int s, unsigned int key, unsigned int first_bit, unsigned int radius,
+                      std::vector<unsigned int> *candidates) const
+{
+    const std::vector<unsigned long long> &table = m_tables[s];
+    std::vector<unsigned long long>::const_iterator it =
+        std::lower_bound(table.begin(), table.end(), (unsigned long long)key << 32);
+
+    for (; it != table.end() && (unsigned int)(*it >> 32) == key; ++it)
+    {
+        candidates->push_back((unsigned int)*it);
+    }
+
+    if (radius == 0)
+    {
+        return;
+    }
+
+    for (unsigned int b = first_bit; b < m_substring_bits; b++)
+    {
+        probe(s, key ^ (1u << b), b + 1, radius - 1, candidates);
+    }
+}
+
+static bool match_less(const FpidMatch &a, const FpidMatch &b)
+{
+    if (a.distance != b.distance)
+    {
+        return a.distance < b.distance;
+    }
+    if (a.song != b.song)
+    {
+        return a.song < b.song;
+    }
+    return a.window < b.window;
+}
+
+int FpidIndex::query(const unsigned int *fpid, unsigned int k, std::vector<FpidMatch> *matches) const
+{
+    std::vector<unsigned int> candidates;
+    std::unordered_map<unsigned int, size_t> song_match;
+
+    ASSERT(m_built);
+
+    matches->clear();
+
+    for (unsigned int s = 0; s < m_num_substrings; s++)
+    {
+        probe(s, substring(fpid, s), 0, m_probe_radius, &candidates);
+    }
+
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    /* too few songs share a substring, or the k-th is too far to be sure, verify everything */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        const unsigned int num_candidates = (pass == 0) ? (unsigned int)candidates.size() : num_entries();
+
+        for (unsigned int c = 0; c < num_candidates; c++)
+        {
+            const unsigned int entry = (pass == 0) ? candidates[c] : c;
+            FpidMatch m;
+
+            m.song     = m_entry_song[entry];
+            m.window   = m_entry_window[entry];
+            m.distance = hamming_distance(fpid, &m_fpids[(size_t)entry * m_num_frame], m_num_frame);
+
+            /* best window per song */
+            std::unordered_map<unsigned int, size_t>::iterator it = song_match.find(m.song);
+            if (it == song_match.end())
+            {
+                song_match[m.song] = matches->size();
+                matches->push_back(m);
+            }
+            else if (match_less(m, (*matches)[it->second]))
+            {
+                (*matches)[it->second] = m;
+            }
+        }
+
+        if (pass == 1 || candidates.size() == num_entries())
+        {
+            break;
+        }
+
+        /*
+         * The probes find every entry nearer than num_substrings * (probe_radius + 1)
+         * bits, so the k songs found are the nearest only when the k-th is within that.
+         */
+        if (matches->size() >= k)
+        {
+            if (k == 0)
+            {
+                break;
+            }
+            std::nth_element(matches->begin(), matches->begin() + (k - 1), matches->end(), match_less);
+            if ((*matches)[k - 1].distance < m_num_substrings * (m_probe_radius + 1))
+            {
+                break;
+            }
+        }
+        matches->clear();
+        song_match.clear();
+    }
+
+    if (matches->size() > k)
+    {
+        std::partial_sort(matches->begin(), matches->begin() + k, matches->end(), match_less);
+        matches->resize(k);
+    }
+    else
+    {
+        std::sort(matches->begin(), matches->end(), match_less);
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+int FpidIndex::query_batch(const unsigned int *fpids, unsigned int num_queries, unsigned int k,
+                           std::vector<std::vector<FpidMatch> > *matches, int num_threads) const
+{
+    my_utils::WorkStealingPool pool(num_threads);
+    std::vector<int> status(num_queries, 0);
+
+    matches->resize(num_queries);
+
+    pool.run((int)num_queries, [&](int index, int worker) {
+        status[index] = query(&fpids[(size_t)index * m_num_frame], k, &(*matches)[index]);
+    });
+
+    for (unsigned int i = 0; i < num_queries; i++)
+    {
+        ASSERT(status[i] == 0);
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+} // namespace hifp
@@ -0,0 +1,476 @@
+#include "hifp/fpid_server.h"
+#include "hifp/hifp.h"
+#include "utils/utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using my_utils::getCurrentTimestamp;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  /* SO_NOSIGPIPE is set on the socket instead */
+#endif
+
+namespace hifp
+{
+
+/* A client of the socket, closed once it hung up and every reply was sent */
+struct FpidConnection
+{
+    int         fd;
+    std::string input;  /* bytes after the last complete line */
+    bool        eof;
+    std::mutex  write_lock;
+
+    explicit FpidConnection(int fd) : fd(fd), eof(false) {}
+    ~FpidConnection() { close(fd); }
+};
+
+static const int IO_TIMEOUT_MS = 100;  /* how quickly the I/O thread notices a stop */
+
+static void send_all(
+    FpidConnection *    conn,
+    const std::string & line
+)
+{
+    std::lock_guard<std::mutex> guard(conn->write_lock);
+    size_t sent = 0;
+
+    while (sent < line.size())
+    {
+        const ssize_t n = send(conn->fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+
+        /* a client that went away loses its replies */
+        if (n <= 0)
+        {
+            return;
+        }
+        sent += (size_t)n;
+    }
+}
+
+FpidServer::FpidServer()
+    : m_listen_fd(-1),
+      m_poll_ms(200),
+      m_max_batch(16),
+      m_max_wait(0.005),
+      m_stop(false),
+      m_io_done(false),
+      m_num_jobs(0),
+      m_num_batches(0)
+{
+}
+
+FpidServer::~FpidServer()
+{
+    request_stop();
+    if (m_io_thread.joinable())
+    {
+        m_io_thread.join();
+    }
+    close_all();
+}
+
+int FpidServer::listen_socket(
+    const char * path
+)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int r;
+
+    ASSERT(strlen(path) < sizeof(addr.sun_path));
+
+    /* a socket file left behind by a server that did not shut down */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(m_listen_fd >= 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    r = bind(m_listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    ASSERT(r == 0);
+    r = listen(m_listen_fd, 64);
+    ASSERT(r == 0);
+
+    m_socket_path = path;
+
+    return 0;
+
+err:
+    if (m_listen_fd >= 0)
+    {
+        close(m_listen_fd);
+        m_listen_fd = -1;
+    }
+    return -1;
+}
+
+int FpidServer::watch_spool(
+    const char * spool_dir,
+    unsigned int poll_ms
+)
+{
+    static const char *const SUBDIRS[] = { "in", "work", "out", "done", "failed" };
+    std::string work;
+    DIR *dir;
+    struct dirent *ep;
+
+    mkdir(spool_dir, 0777);
+    for (size_t i = 0; i < sizeof(SUBDIRS) / sizeof(SUBDIRS[0]); i++)
+    {
+        const std::string sub = std::string(spool_dir) + "/" + SUBDIRS[i];
+
+        ASSERT(mkdir(sub.c_str(), 0777) == 0 || errno == EEXIST);
+    }
+
+    /* jobs claimed by a server that did not finish them are taken again */
+    work = std::string(spool_dir) + "/work";
+    dir = opendir(work.c_str());
+    ASSERT(dir != NULL);
+    while ((ep = readdir(dir)) != NULL)
+    {
+        if (ep->d_name[0] != '.')
+        {
+            rename((work + "/" + ep->d_name).c_str(), (std::string(spool_dir) + "/in/" + ep->d_name).c_str());
+        }
+    }
+    closedir(dir);
+
+    m_spool_dir = spool_dir;
+    m_poll_ms = poll_ms > 0 ? poll_ms : 1;
+    errno = 0;
+
+    return 0;
+
+err:
+    return -1;
+}
+
+void FpidServer::set_batching(
+    unsigned int max_batch,
+    double       max_wait_ms
+)
+{
+    m_max_batch = max_batch > 0 ? max_batch : 1;
+    m_max_wait = max_wait_ms * 1e-3;
+}
+
+int FpidServer::start()
+{
+    ASSERT(m_listen_fd >= 0 || !m_spool_dir.empty());
+
+    m_stop = false;
+    m_io_done = false;
+    m_io_thread = std::thread(&FpidServer::io_loop, this);
+
+    return 0;
+
+err:
+    return -1;
+}
+
+void FpidServer::io_loop()
+{
+    double last_scan = 0.0;
+
+    while (!m_stop)
+    {
+        std::vector<struct pollfd> fds;
+
+        if (m_listen_fd >= 0)
+        {
+            struct pollfd p = { m_listen_fd, POLLIN, 0 };
+            fds.push_back(p);
+        }
+        for (size_t i = 0; i < m_clients.size(); i++)
+        {
+            struct pollfd p = { m_clients[i]->fd, POLLIN, 0 };
+            fds.push_back(p);
+        }
+
+        if (!fds.empty())
+        {
+            poll(&fds[0], fds.size(), IO_TIMEOUT_MS);
+        }
+        else
+        {
+            usleep(IO_TIMEOUT_MS * 1000);
+        }
+
+        size_t k = 0;
+        if (m_listen_fd >= 0 && (fds[k++].revents & POLLIN))
+        {
+            accept_client();
+        }
+        for (size_t i = 0; k < fds.size(); i++, k++)
+        {
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                read_client(m_clients[i]);
+            }
+        }
+
+        /* hung-up clients stay open until the replies of their jobs are sent */
+        for (size_t i = 0; i < m_clients.size(); )
+        {
+            if (m_clients[i]->eof)
+            {
+                m_clients.erase(m_clients.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+
+        if (!m_spool_dir.empty() && (getCurrentTimestamp() - last_scan) * 1e3 >= m_poll_ms)
+        {
+            scan_spool();
+            last_scan = getCurrentTimestamp();
+        }
+    }
+
+    close_all();
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_io_done = true;
+    }
+    m_changed.notify_all();
+}
+
+void FpidServer::accept_client()
+{
+    const int fd = accept(m_listen_fd, NULL, NULL);
+
+    if (fd < 0)
+    {
+        return;
+    }
+
+#ifdef SO_NOSIGPIPE
+    {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    }
+#endif
+
+    m_clients.push_back(std::make_shared<FpidConnection>(fd));
+}
+
+void FpidServer::read_client(
+    const std::shared_ptr<FpidConnection> & conn
+)
+{
+    char buf[4096];
+    const ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+    size_t start = 0;
+    size_t end;
+
+    if (n <= 0)
+    {
+        conn->eof = true;
+        return;
+    }
+    conn->input.append(buf, (size_t)n);
+
+    /* one job per complete line */
+    while ((end = conn->input.find('\n', start)) != std::string::npos)
+    {
+        std::string path = conn->input.substr(start, end - start);
+
+        if (!path.empty() && path[path.size() - 1] == '\r')
+        {
+            path.erase(path.size() - 1);
+        }
+        if (!path.empty())
+        {
+            FpidJob job;
+
+            job.path = path;
+            job.arrival_time = getCurrentTimestamp();
+            job.conn = conn;
+            push(job);
+        }
+        start = end + 1;
+    }
+    conn->input.erase(0, start);
+}
+
+void FpidServer::scan_spool()
+{
+    const std::string in = m_spool_dir + "/in";
+    std::vector<std::string> names;
+    DIR *dir;
+    struct dirent *ep;
+
+    dir = opendir(in.c_str());
+    if (dir == NULL)
+    {
+        return;
+    }
+    while ((ep = readdir(dir)) != NULL)
+    {
+        if (ep->d_name[0] != '.')
+        {
+            names.push_back(ep->d_name);
+        }
+    }
+    closedir(dir);
+
+    /* files of one scan in name order, so a batch dropped at once keeps its order */
+    std::sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        const std::string work = m_spool_dir + "/work/" + names[i];
+        struct stat st;
+
+        /* the rename claims the file, directories are left alone */
+        if (stat((in + "/" + names[i]).c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+            rename((in + "/" + names[i]).c_str(), work.c_str()) != 0)
+        {
+            continue;
+        }
+
+        FpidJob job;
+
+        job.path = work;
+        job.name = names[i];
+        job.arrival_time = getCurrentTimestamp();
+        push(job);
+    }
+}
+
+void FpidServer::push(
+    const FpidJob & job
+)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_queue.push_back(job);
+    }
+    m_num_jobs++;
+    m_changed.notify_all();
+}
+
+bool FpidServer::next_batch(
+    std::vector<FpidJob> * batch
+)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+
+    batch->clear();
+
+    m_changed.wait(guard, [this] { return !m_queue.empty() || m_io_done; });
+    if (m_queue.empty())
+    {
+        return false;
+    }
+
+    /* fill up until the oldest job has waited max_wait */
+    const double deadline = m_queue.front().arrival_time + m_max_wait;
+
+    while (m_queue.size() < m_max_batch && !m_io_done)
+    {
+        const double left = deadline - getCurrentTimestamp();
+
+        if (left <= 0.0)
+        {
+            break;
+        }
+        m_changed.wait_for(guard, std::chrono::duration<double>(left));
+    }
+
+    while (!m_queue.empty() && batch->size() < m_max_batch)
+    {
+        batch->push_back(m_queue.front());
+        m_queue.pop_front();
+    }
+    m_num_batches++;
+
+    return true;
+}
+
+void FpidServer::complete(
+    const FpidJob &      job,
+    int                  status,
+    const unsigned int * fpid,
+    size_t               num_words
+)
+{
+    if (job.conn)
+    {
+        std::string line = (status == 0 ? "OK\t" : "ERR\t") + job.path + "\t";
+        char word[16];
+
+        if (status == 0)
+        {
+            for (size_t k = 0; k < num_words; k++)
+            {
+                snprintf(word, sizeof(word), k == 0 ? "%08x" : " %08x", fpid[k]);
+                line += word;
+            }
+        }
+        else
+        {
+            line += "cannot fingerprint";
+        }
+        line += "\n";
+
+        send_all(job.conn.get(), line);
+        return;
+    }
+
+    /* spool job: write the FPID under a temporary name, then publish it */
+    if (status == 0)
+    {
+        const std::string out = m_spool_dir + "/out/" + job.name + ".raw";
+        const std::string tmp = m_spool_dir + "/out/." + job.name + ".raw.tmp";
+        FILE *ofp = fopen(tmp.c_str(), "wb");
+
+        status = -1;
+        if (ofp != NULL)
+        {
+            const bool ok = save_fp_to_disk(ofp, fpid, (unsigned int)num_words) == 0;
+
+            if (fclose(ofp) == 0 && ok && rename(tmp.c_str(), out.c_str()) == 0)
+            {
+                status = 0;
+            }
+            else
+            {
+                unlink(tmp.c_str());
+            }
+        }
+    }
+
+    rename(job.path.c_str(), (m_spool_dir + (status == 0 ? "/done/" : "/failed/") + job.name).c_str());
+}
+
+void FpidServer::close_all()
+{
+    m_clients.clear();
+
+    if (m_listen_fd >= 0)
+    {
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        unlink(m_socket_path.c_str());
+    }
+}
+
+} // namespace hifp
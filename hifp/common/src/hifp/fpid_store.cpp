@@ -0,0 +1,594 @@
+#include "hifp/hifp.h"
+#include "hifp/fpid_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HIFP_X86 1
+#include <immintrin.h>
+#endif
+
+namespace hifp
+{
+
+const unsigned int FPID_STORE_VERSION = 1;
+
+
+/*
+ * CRC-32C (Castagnoli), with the SSE4.2 crc32 instruction when present.
+ * crc is the value returned for the preceding data, 0 to start.
+ */
+typedef unsigned int (*crc32c_fn)(unsigned int, const unsigned char *, size_t);
+
+static unsigned int crc32c_table[256];
+
+static unsigned int crc32c_scalar(
+    unsigned int          crc,
+    const unsigned char * p,
+    size_t                size
+)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crc32c_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HIFP_X86
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(
+    unsigned int          crc,
+    const unsigned char * p,
+    size_t                size
+)
+{
+    unsigned long long crc64 = crc;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        unsigned long long v;
+
+        memcpy(&v, &p[i], sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = (unsigned int)crc64;
+    for (; i < size; i++)
+    {
+        crc = _mm_crc32_u8(crc, p[i]);
+    }
+
+    return crc;
+}
+#endif
+
+static crc32c_fn select_crc32c()
+{
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        unsigned int c = i;
+
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+        }
+        crc32c_table[i] = c;
+    }
+
+#if defined(HIFP_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return crc32c_sse42;
+    }
+#endif
+    return crc32c_scalar;
+}
+
+unsigned int crc32c(
+    unsigned int crc,
+    const void * data,
+    size_t       size
+)
+{
+    static const crc32c_fn fn = select_crc32c();
+
+    return ~fn(~crc, (const unsigned char *)data, size);
+}
+
+
+/*
+ * Block index of the last trailer of a store of size bytes. *blocks_end is
+ * the footer offset, every block lies before it. -1 when the file does not
+ * end with a valid trailer and footer.
+ */
+static int load_store_index(
+    int                           fd,
+    unsigned long long            size,
+    std::vector<FPIDBLOCKINDEX> * index,
+    unsigned long long *          num_records,
+    unsigned long long *          blocks_end
+)
+{
+    FPIDSTOREFOOTER footer;
+    FPIDSTORETRAILER trailer;
+    unsigned long long index_size;
+    unsigned int crc;
+
+    if (size < sizeof(FPIDSTOREHEADER) + sizeof(footer) + sizeof(trailer) ||
+        pread(fd, &trailer, sizeof(trailer), size - sizeof(trailer)) != (ssize_t)sizeof(trailer) ||
+        memcmp(trailer.magic, "HFPT", 4) != 0 ||
+        trailer.footer_offset + sizeof(footer) > size - sizeof(trailer) ||
+        pread(fd, &footer, sizeof(footer), trailer.footer_offset) != (ssize_t)sizeof(footer) ||
+        memcmp(footer.magic, "HFPF", 4) != 0)
+    {
+        return -1;
+    }
+
+    index_size = (unsigned long long)footer.num_blocks * sizeof(FPIDBLOCKINDEX);
+    if (trailer.footer_offset + sizeof(footer) + index_size > size - sizeof(trailer))
+    {
+        return -1;
+    }
+
+    index->resize(footer.num_blocks);
+    if (footer.num_blocks > 0 &&
+        pread(fd, &(*index)[0], index_size, trailer.footer_offset + sizeof(footer)) != (ssize_t)index_size)
+    {
+        return -1;
+    }
+
+    crc = crc32c(0, &footer, sizeof(footer));
+    crc = crc32c(crc, index->empty() ? NULL : &(*index)[0], index_size);
+    if (crc != trailer.footer_checksum)
+    {
+        return -1;
+    }
+
+    *num_records = footer.num_records;
+    *blocks_end  = trailer.footer_offset;
+
+    return 0;
+}
+
+/*
+ * Rebuild the block index of a store without a valid trailer, e.g. after a
+ * crash while appending: walk the file from the header, keeping every block
+ * whose checksum matches and skipping the footers and trailers of earlier
+ * runs, up to the first item that is incomplete or damaged. *end is the
+ * offset after the last complete item, where appending resumes.
+ */
+static void recover_store_index(
+    int                           fd,
+    unsigned long long            size,
+    unsigned int                  num_frame,
+    std::vector<FPIDBLOCKINDEX> * index,
+    unsigned long long *          num_records,
+    unsigned long long *          end
+)
+{
+    const unsigned long long record_size = (2 + (unsigned long long)num_frame) * sizeof(unsigned int);
+    unsigned long long p = sizeof(FPIDSTOREHEADER);
+    std::vector<unsigned char> body;
+
+    index->clear();
+    *num_records = 0;
+
+    while (p + sizeof(FPIDBLOCKHEADER) <= size)
+    {
+        FPIDBLOCKHEADER block;
+
+        if (pread(fd, &block, sizeof(block), p) != (ssize_t)sizeof(block))
+        {
+            break;
+        }
+
+        if (memcmp(block.magic, "HFPB", 4) == 0)
+        {
+            const unsigned long long body_size = block.num_records * record_size + block.names_size;
+            FPIDBLOCKINDEX entry;
+
+            if (block.num_records == 0 || p + sizeof(block) + body_size > size)
+            {
+                break;
+            }
+            body.resize(body_size);
+            if (pread(fd, &body[0], body_size, p + sizeof(block)) != (ssize_t)body_size ||
+                crc32c(0, &body[0], body_size) != block.checksum)
+            {
+                break;
+            }
+
+            entry.offset      = p;
+            entry.num_records = block.num_records;
+            entry.checksum    = block.checksum;
+            index->push_back(entry);
+
+            *num_records += block.num_records;
+            p += sizeof(block) + body_size;
+        }
+        else if (memcmp(block.magic, "HFPF", 4) == 0)
+        {
+            /* footer and trailer of an earlier run, the blocks are already indexed */
+            FPIDSTOREFOOTER footer;
+            FPIDSTORETRAILER trailer;
+            unsigned long long trailer_offset;
+
+            if (pread(fd, &footer, sizeof(footer), p) != (ssize_t)sizeof(footer))
+            {
+                break;
+            }
+            trailer_offset = p + sizeof(footer) + (unsigned long long)footer.num_blocks * sizeof(FPIDBLOCKINDEX);
+            if (trailer_offset + sizeof(trailer) > size ||
+                pread(fd, &trailer, sizeof(trailer), trailer_offset) != (ssize_t)sizeof(trailer) ||
+                memcmp(trailer.magic, "HFPT", 4) != 0 || trailer.footer_offset != p)
+            {
+                break;
+            }
+            p = trailer_offset + sizeof(trailer);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    *end = p;
+}
+
+
+FpidStoreWriter::FpidStoreWriter()
+    : m_fp(NULL),
+      m_num_frame(0),
+      m_block_records(0),
+      m_offset(0),
+      m_num_records(0),
+      m_pending(0),
+      m_dirty(false)
+{
+}
+
+FpidStoreWriter::~FpidStoreWriter()
+{
+    close();
+}
+
+int FpidStoreWriter::open(const char *path, unsigned int num_frame, unsigned int block_records)
+{
+    FPIDSTOREHEADER header;
+    unsigned long long blocks_end;
+    off_t size = 0;
+
+    ASSERT(m_fp == NULL);
+    ASSERT(num_frame > 0 && block_records > 0);
+
+    m_num_frame     = num_frame;
+    m_block_records = block_records;
+    m_num_records   = 0;
+    m_pending       = 0;
+    m_dirty         = false;
+    m_index.clear();
+
+    m_fp = fopen(path, "r+b");
+    if (m_fp != NULL)
+    {
+        fseeko(m_fp, 0, SEEK_END);
+        size = ftello(m_fp);
+    }
+
+    /* new store */
+    if (size == 0)
+    {
+        if (m_fp == NULL)
+        {
+            m_fp = fopen(path, "w+b");
+            ASSERT(m_fp != NULL);
+        }
+
+        memcpy(header.magic, "HFPS", 4);
+        header.version   = FPID_STORE_VERSION;
+        header.num_frame = num_frame;
+        header.reserved  = 0;
+
+        ASSERT(fwrite(&header, sizeof(header), 1, m_fp) == 1);
+        m_offset = sizeof(header);
+        m_dirty  = true;
+
+        return 0;
+    }
+
+    /* existing store, load the block index of the last trailer */
+    ASSERT(size >= (off_t)sizeof(header));
+
+    fseeko(m_fp, 0, SEEK_SET);
+    ASSERT(fread(&header, sizeof(header), 1, m_fp) == 1);
+    ASSERT(memcmp(header.magic, "HFPS", 4) == 0);
+    ASSERT(header.version == FPID_STORE_VERSION);
+    ASSERT(header.num_frame == num_frame);
+
+    if (load_store_index(fileno(m_fp), size, &m_index, &m_num_records, &blocks_end) == 0)
+    {
+        m_offset = size;
+        return 0;
+    }
+
+    /* no trailer: an append was interrupted, keep the complete blocks and drop the rest */
+    recover_store_index(fileno(m_fp), size, num_frame, &m_index, &m_num_records, &m_offset);
+    printf("%s : no valid trailer, recovered %lu block(s), %llu record(s), dropped %llu byte(s) \n",
+           path, (unsigned long)m_index.size(), m_num_records, (unsigned long long)size - m_offset);
+
+    ASSERT(fflush(m_fp) == 0);
+    ASSERT(ftruncate(fileno(m_fp), m_offset) == 0);
+    m_dirty = true;
+
+    return 0;
+
+err:
+    if (m_fp != NULL)
+    {
+        fclose(m_fp);
+        m_fp = NULL;
+    }
+    return -1;
+}
+
+int FpidStoreWriter::append(const std::string &name, const unsigned int *fpid, unsigned int num_windows)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    const unsigned int name_offset = (unsigned int)m_names.size();
+
+    ASSERT(m_fp != NULL);
+
+    m_names.append(name.c_str(), name.size() + 1);
+
+    /* all windows of a song go to the same block */
+    for (unsigned int w = 0; w < num_windows; w++)
+    {
+        const unsigned int *window = &fpid[(size_t)w * m_num_frame];
+
+        m_records.push_back(name_offset);
+        m_records.push_back(w);
+        m_records.insert(m_records.end(), window, window + m_num_frame);
+    }
+    m_pending += num_windows;
+
+    if (m_pending >= m_block_records)
+    {
+        ASSERT(flush_block() == 0);
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/* Write the pending records as one block, called with m_lock held */
+int FpidStoreWriter::flush_block()
+{
+    const size_t records_size = m_records.size() * sizeof(unsigned int);
+    FPIDBLOCKHEADER block;
+    FPIDBLOCKINDEX entry;
+
+    if (m_pending == 0)
+    {
+        return 0;
+    }
+
+    /* the next block starts 8-byte aligned */
+    m_names.resize(m_names.size() + (8 - (records_size + m_names.size()) % 8) % 8, '\0');
+
+    memcpy(block.magic, "HFPB", 4);
+    block.num_records = m_pending;
+    block.names_size  = (unsigned int)m_names.size();
+    block.checksum    = crc32c(crc32c(0, &m_records[0], records_size), m_names.data(), m_names.size());
+
+    fseeko(m_fp, m_offset, SEEK_SET);
+    ASSERT(fwrite(&block, sizeof(block), 1, m_fp) == 1);
+    ASSERT(fwrite(&m_records[0], 1, records_size, m_fp) == records_size);
+    ASSERT(m_names.empty() || fwrite(m_names.data(), 1, m_names.size(), m_fp) == m_names.size());
+
+    entry.offset      = m_offset;
+    entry.num_records = m_pending;
+    entry.checksum    = block.checksum;
+    m_index.push_back(entry);
+
+    m_offset      += sizeof(block) + records_size + m_names.size();
+    m_num_records += m_pending;
+    m_dirty        = true;
+
+    m_records.clear();
+    m_names.clear();
+    m_pending = 0;
+
+    return 0;
+
+err:
+    return -1;
+}
+
+int FpidStoreWriter::close()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    FPIDSTOREFOOTER footer;
+    FPIDSTORETRAILER trailer;
+    int r = 0;
+
+    if (m_fp == NULL)
+    {
+        return 0;
+    }
+
+    ASSERT(flush_block() == 0);
+
+    if (m_dirty)
+    {
+        memcpy(footer.magic, "HFPF", 4);
+        footer.num_blocks  = (unsigned int)m_index.size();
+        footer.num_records = m_num_records;
+
+        trailer.footer_offset   = m_offset;
+        trailer.footer_checksum = crc32c(0, &footer, sizeof(footer));
+        trailer.footer_checksum = crc32c(trailer.footer_checksum, m_index.empty() ? NULL : &m_index[0],
+                                         m_index.size() * sizeof(FPIDBLOCKINDEX));
+        memcpy(trailer.magic, "HFPT", 4);
+
+        fseeko(m_fp, m_offset, SEEK_SET);
+        ASSERT(fwrite(&footer, sizeof(footer), 1, m_fp) == 1);
+        ASSERT(m_index.empty() || fwrite(&m_index[0], sizeof(FPIDBLOCKINDEX), m_index.size(), m_fp) == m_index.size());
+        ASSERT(fwrite(&trailer, sizeof(trailer), 1, m_fp) == 1);
+    }
+
+    goto done;
+
+err:
+    r = -1;
+
+done:
+    if (fclose(m_fp) != 0)
+    {
+        r = -1;
+    }
+    m_fp = NULL;
+    m_index.clear();
+
+    return r;
+}
+
+
+FpidStoreReader::FpidStoreReader()
+    : m_map(NULL),
+      m_map_size(0),
+      m_num_frame(0),
+      m_num_records(0)
+{
+}
+
+FpidStoreReader::~FpidStoreReader()
+{
+    close();
+}
+
+int FpidStoreReader::open(const char *path)
+{
+    const unsigned char *base;
+    FPIDSTOREHEADER header;
+    unsigned long long blocks_end;
+    struct stat st;
+    int fd = -1;
+
+    close();
+
+    fd = ::open(path, O_RDONLY);
+    ASSERT(fd >= 0);
+    ASSERT(fstat(fd, &st) == 0);
+    ASSERT((size_t)st.st_size >= sizeof(header));
+
+    ASSERT(pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header));
+    ASSERT(memcmp(header.magic, "HFPS", 4) == 0);
+    ASSERT(header.version == FPID_STORE_VERSION);
+    m_num_frame = header.num_frame;
+
+    /* a store whose last append was interrupted has no trailer, read its complete blocks */
+    if (load_store_index(fd, st.st_size, &m_index, &m_num_records, &blocks_end) != 0)
+    {
+        recover_store_index(fd, st.st_size, m_num_frame, &m_index, &m_num_records, &blocks_end);
+        printf("%s : no valid trailer, reading %lu recovered block(s) \n", path, (unsigned long)m_index.size());
+    }
+
+    m_map_size = st.st_size;
+    m_map = mmap(NULL, m_map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m_map == MAP_FAILED)
+    {
+        m_map = NULL;
+        ERRPRINT();
+        goto err;
+    }
+    ::close(fd);
+    fd = -1;
+
+    base = (const unsigned char *)m_map;
+
+    /* every block lies before the footer */
+    for (size_t b = 0; b < m_index.size(); b++)
+    {
+        FPIDBLOCKHEADER block;
+
+        ASSERT(m_index[b].offset + sizeof(block) <= blocks_end);
+        memcpy(&block, base + m_index[b].offset, sizeof(block));
+        ASSERT(memcmp(block.magic, "HFPB", 4) == 0);
+        ASSERT(block.num_records == m_index[b].num_records);
+        ASSERT(m_index[b].offset + sizeof(block) + block.num_records * record_size() + block.names_size
+               <= blocks_end);
+    }
+
+    return 0;
+
+err:
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    close();
+    return -1;
+}
+
+void FpidStoreReader::close()
+{
+    if (m_map != NULL)
+    {
+        munmap(m_map, m_map_size);
+    }
+    m_map = NULL;
+    m_map_size = 0;
+    m_num_frame = 0;
+    m_num_records = 0;
+    m_index.clear();
+}
+
+int FpidStoreReader::verify() const
+{
+    for (unsigned int b = 0; b < num_blocks(); b++)
+    {
+        const unsigned char *p = (const unsigned char *)m_map + m_index[b].offset;
+        FPIDBLOCKHEADER block;
+        const char *names;
+
+        memcpy(&block, p, sizeof(block));
+        p += sizeof(block);
+        names = (const char *)p + block.num_records * record_size();
+
+        ASSERT(crc32c(0, p, block.num_records * record_size() + block.names_size) == block.checksum);
+        ASSERT(block.checksum == m_index[b].checksum);
+
+        /* names are NUL-terminated inside the table */
+        ASSERT(block.names_size > 0 && names[block.names_size - 1] == '\0');
+        for (unsigned int i = 0; i < block.num_records; i++)
+        {
+            ASSERT(block_record(b, i)->name < block.names_size);
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+const FPIDRECORD *FpidStoreReader::block_record(unsigned int b, unsigned int i) const
+{
+    return (const FPIDRECORD *)((const unsigned char *)m_map + m_index[b].offset + sizeof(FPIDBLOCKHEADER)
+                                + i * record_size());
+}
+
+const char *FpidStoreReader::block_name(unsigned int b, const FPIDRECORD *record) const
+{
+    return (const char *)block_record(b, m_index[b].num_records) + record->name;
+}
+
+} // namespace hifp
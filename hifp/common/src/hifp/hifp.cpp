@@ -1,4 +1,5 @@
 #include "hifp/hifp.h"
+#include "hifp/dwt_engine.h"
 
 namespace hifp
 {
@@ -10,31 +11,17 @@ const int _PRINT_DWT        = PRINT_DWT;
 const int NUMWAVE   = NUM_WAVE;
 const int NUMDWTECO = NUM_DWT_ECO;
 const int NUMFRAME  = NUM_FRAME;
+const int NUMSTREAMBLOCK = NUM_STREAM_BLOCK;
 
 unsigned int ref_fpid[NUMFRAME];
 unsigned int ref_dwt_eco[NUMDWTECO];
 
+/* 3-level Haar DWT of 8 consecutive samples */
 int dwt1(
    short int * wave16
 )
 {
-    int dwt_eco1;
-    int dwt_tmp[4];
-
-    /* 1st round */
-    dwt_tmp[0] = (wave16[0] + wave16[1]) / 2;
-    dwt_tmp[1] = (wave16[2] + wave16[3]) / 2;
-    dwt_tmp[2] = (wave16[4] + wave16[5]) / 2;
-    dwt_tmp[3] = (wave16[6] + wave16[7]) / 2;
-
-    /* 2nd round */
-    dwt_tmp[0] = (dwt_tmp[0] + dwt_tmp[1]) / 2;
-    dwt_tmp[1] = (dwt_tmp[2] + dwt_tmp[3]) / 2;
-
-    /* 3rd round */
-    dwt_eco1 = (dwt_tmp[0] + dwt_tmp[1]) / 2;
-
-    return dwt_eco1;
+    return dwt_block<HaarFilter, 3>(wave16, 1);
 }
 
 int readwav8(
@@ -73,34 +60,97 @@ err:
     return -1;
 }
 
-WAVEHEADER read_wave_header(
-    FILE * ifp
+/* Skip n bytes of a file, reading them when it cannot seek (a pipe) */
+static int skip_bytes(
+    FILE *       ifp,
+    unsigned int n
+)
+{
+    char buf[256];
+
+    if (fseek(ifp, n, SEEK_CUR) == 0)
+    {
+        return 0;
+    }
+
+    while (n > 0)
+    {
+        const size_t len = (n < sizeof(buf)) ? n : sizeof(buf);
+
+        ASSERT(fread(buf, 1, len, ifp) == len);
+        n -= (unsigned int)len;
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+/*
+ * Parse the RIFF header and walk the chunk list up to the "data" chunk.
+ * Unknown chunks (LIST, fact, ...) and fmt extensions are skipped, and the
+ * file is left positioned at the first PCM sample. -1 for a file that is
+ * not a 16-bit PCM WAV.
+ */
+int read_wave_header(
+    FILE *       ifp,
+    WAVEHEADER * wave_header
 )
 {
     size_t rsz;
-    WAVEHEADER wave_header;
+    int r;
+    unsigned int chunk[2];  /* chunk ID, chunk size */
+    bool has_fmt = false;
+
+    memset(wave_header, 0, sizeof(WAVEHEADER));
 
-    rsz = fread(&wave_header, sizeof(unsigned int), 5, ifp);
-    ASSERT(rsz == 5);
-    rsz = fread(&wave_header.FormatId, sizeof(unsigned short int), 2, ifp);
-    ASSERT(rsz == 2);
-    rsz = fread(&wave_header.SampleRate, sizeof(unsigned int), 2, ifp);
-    ASSERT(rsz == 2);
-    rsz = fread(&wave_header.BlockAlign, sizeof(unsigned short int), 2, ifp);
-    ASSERT(rsz == 2);
-    rsz = fread(&wave_header.data, sizeof(unsigned int), 2, ifp);
-    ASSERT(rsz == 2);
-    ASSERT(memcmp(&wave_header.riff, "RIFF", 4) == 0);
-    ASSERT(memcmp(&wave_header.wave, "WAVE", 4) == 0);
-    ASSERT(memcmp(&wave_header.fmt, "fmt ", 4) == 0);
-    ASSERT(memcmp(&wave_header.data, "data", 4) == 0);
-    ASSERT(wave_header.BitsPerSample == 16);
-    ASSERT(wave_header.SampleRate == 44100);
-
-    return wave_header;
+    rsz = fread(wave_header, sizeof(unsigned int), 3, ifp);
+    ASSERT(rsz == 3);
+    ASSERT(memcmp(&wave_header->riff, "RIFF", 4) == 0);
+    ASSERT(memcmp(&wave_header->wave, "WAVE", 4) == 0);
+
+    for (;;)
+    {
+        rsz = fread(chunk, sizeof(unsigned int), 2, ifp);
+        ASSERT(rsz == 2);
+
+        if (memcmp(&chunk[0], "fmt ", 4) == 0)
+        {
+            ASSERT(chunk[1] >= 16);
+            wave_header->fmt = chunk[0];
+            wave_header->size_fmt = chunk[1];
+            rsz = fread(&wave_header->FormatId, sizeof(unsigned short int), 2, ifp);
+            ASSERT(rsz == 2);
+            rsz = fread(&wave_header->SampleRate, sizeof(unsigned int), 2, ifp);
+            ASSERT(rsz == 2);
+            rsz = fread(&wave_header->BlockAlign, sizeof(unsigned short int), 2, ifp);
+            ASSERT(rsz == 2);
+            r = skip_bytes(ifp, (chunk[1] - 16) + (chunk[1] & 1));
+            ASSERT(r == 0);
+            has_fmt = true;
+        }
+        else if (memcmp(&chunk[0], "data", 4) == 0)
+        {
+            wave_header->data = chunk[0];
+            wave_header->size_wave = chunk[1];
+            break;
+        }
+        else
+        {
+            /* chunks are padded to an even size */
+            r = skip_bytes(ifp, chunk[1] + (chunk[1] & 1));
+            ASSERT(r == 0);
+        }
+    }
+
+    ASSERT(has_fmt);
+    ASSERT(wave_header->BitsPerSample == 16);
+
+    return 0;
 
 err:
-    return wave_header;
+    return -1;
 }
 
 int read_wav_data(
@@ -155,6 +205,59 @@ err:
     return -1;
 }
 
+/*
+ * Single-pass FPID generation straight from the file.
+ * PCM is read in chunks of NUMSTREAMBLOCK DWT blocks, each chunk is reduced
+ * to DWT values with dwt_blocks() and every FPID word whose 33 values are
+ * known is packed immediately, so neither wave16 nor the full dwt_eco array
+ * is ever materialised. Output is identical to read_wav_data() followed by
+ * gen_fpid().
+ */
+int gen_fpid_stream(
+    FILE *         ifp, 
+    WAVEHEADER     wave_header, 
+    unsigned int * fpid
+)
+{
+    const int numch = (wave_header.NumChannel == 2) ? 2 : 1;
+    const int block_size = 32 * numch;  /* shorts per DWT block */
+
+    short int buf[NUMSTREAMBLOCK * 64];
+    unsigned int dwt_buf[NUMSTREAMBLOCK + 33];
+    int pending = 0;  /* DWT values not yet packed into a word */
+    int k = 0;
+    size_t rsz;
+    int n, w;
+
+    for (int j = 0; j < NUMDWTECO; j += n)
+    {
+        n = NUMDWTECO - j < NUMSTREAMBLOCK ? NUMDWTECO - j : NUMSTREAMBLOCK;
+
+        rsz = fread(buf, sizeof(short int), n * block_size, ifp);
+        ASSERT(rsz == (size_t)(n * block_size));
+
+        dwt_blocks(buf, numch, n, &dwt_buf[pending]);
+        pending += n;
+
+        /* a word needs its 32 values plus the first of the next word */
+        for (w = 0; pending - w * 32 >= 33; w++)
+        {
+            fpid[k++] = pack_fpid_word(&dwt_buf[w * 32]);
+        }
+        memmove(dwt_buf, &dwt_buf[w * 32], (pending - w * 32) * sizeof(unsigned int));
+        pending -= w * 32;
+    }
+
+    /* last word holds 31 comparisons, the padding value never compares greater */
+    dwt_buf[pending] = 0xFFFFFFFF;
+    fpid[k] = pack_fpid_word(dwt_buf);
+
+    return 0;
+
+err:
+    return -1;
+}
+
 int save_fp_to_disk(
     FILE *         ofp, 
     unsigned int * fpid
@@ -171,6 +274,23 @@ err:
     return -1;
 }
 
+int save_fp_to_disk(
+    FILE *               ofp, 
+    const unsigned int * fpid, 
+    unsigned int         num_frame
+)
+{
+    size_t wsz;
+
+    wsz = fwrite(fpid, sizeof(unsigned int), num_frame, ofp);
+    ASSERT(wsz == num_frame);
+
+    return 0;
+
+err:
+    return -1;
+}
+
 void verify_fpid(
     unsigned int * fpid, 
     unsigned int * plain_fpid, 
@@ -265,29 +385,80 @@ void verify_fpid(
     printf("\n\n");
 }
 
-int run_all(
-    FILE * ifp, 
-    FILE * ofp
+/*
+ * Fingerprint one file with any geometry. fpid receives every FPID word,
+ * one FPID per window back to back when cfg->hop is set.
+ */
+int gen_fpid_file(
+    FILE *                      ifp, 
+    const FingerprintConfig *   cfg, 
+    std::vector<unsigned int> * fpid
 )
 {
     WAVEHEADER wave_header;
-    short int wave16[NUMWAVE];
-    unsigned int fpid[NUMFRAME];
-    unsigned int plain_fpid[NUMFRAME];
-    unsigned int dwt_eco[NUMDWTECO];
-
-    /* initialize all array elements to zero */
-    memset(wave16, 0, sizeof(wave16));
-    memset(fpid, 0, sizeof(fpid));
-    memset(plain_fpid, 0, sizeof(plain_fpid));
-    memset(dwt_eco, 0, sizeof(dwt_eco));
-
-    /* run all */
-    wave_header = read_wave_header(ifp);
-    read_wav_data(ifp, wave16, wave_header);
-    gen_fpid(wave16, plain_fpid, fpid, dwt_eco);
-    // verify_fpid(fpid, plain_fpid, dwt_eco);
-    // save_fp_to_disk(ofp, fpid);
+    WAVSOURCE wav_source;
+    unsigned int num_frame = 0;
+    int r;
+
+    /* straight from a mapping of the file when possible */
+    r = open_wav_source(fileno(ifp), &wav_source);
+    if (r == 0)
+    {
+        num_frame = config_num_frame(cfg, config_num_dwteco(cfg, &wav_source));
+
+        if (cfg->hop != 0)
+        {
+            /* one FPID per window, back to back */
+            num_frame *= config_num_windows(cfg, &wav_source);
+            fpid->assign(num_frame, 0);
+
+            r = num_frame > 0 ? gen_fpid_windows(&wav_source, cfg, &(*fpid)[0]) : -1;
+        }
+        else
+        {
+            fpid->assign(num_frame, 0);
+
+            r = gen_fpid_config(&wav_source, cfg, &(*fpid)[0]);
+        }
+        close_wav_source(&wav_source);
+    }
+    else
+    {
+        /* a file that cannot be mapped is streamed, one the parser rejected is not retried */
+        ASSERT(r == WAV_NOT_MAPPED);
+
+        /* the streaming reader only knows the default geometry */
+        ASSERT(is_default_config(cfg));
+
+        fpid->assign(NUMFRAME, 0);
+
+        r = read_wave_header(ifp, &wave_header);
+        ASSERT(r == 0);
+        ASSERT(cfg->sample_rate == 0 || wave_header.SampleRate == cfg->sample_rate);
+        r = gen_fpid_stream(ifp, wave_header, &(*fpid)[0]);
+    }
+    ASSERT(r == 0);
+
+    return 0;
+
+err:
+    return -1;
+}
+
+int run_all(
+    FILE *                    ifp, 
+    FILE *                    ofp, 
+    const FingerprintConfig * cfg
+)
+{
+    std::vector<unsigned int> fpid;
+    int r;
+
+    r = gen_fpid_file(ifp, cfg, &fpid);
+    ASSERT(r == 0);
+    // verify_fpid(&fpid[0], NULL, NULL);
+    r = save_fp_to_disk(ofp, &fpid[0], (unsigned int)fpid.size());
+    ASSERT(r == 0);
 
     return 0;
 
@@ -0,0 +1,163 @@
+#include "hifp/wav_prefetch.h"
+#include "utils/utils.h"
+
+using my_utils::getCurrentTimestamp;
+
+namespace hifp
+{
+
+WavPrefetcher::WavPrefetcher(const FingerprintConfig *cfg, short int **buffers, unsigned int num_buffers,
+                             size_t buffer_samples, int num_threads)
+    : m_config(*cfg),
+      m_buffers(buffers, buffers + num_buffers),
+      m_buffer_samples(buffer_samples),
+      m_num_threads(num_threads > 0 ? num_threads : 1),
+      m_stats(NULL),
+      m_dense(false),
+      m_slots(num_buffers),
+      m_next(0),
+      m_stop(false),
+      m_wait_time(0.0)
+{
+}
+
+WavPrefetcher::~WavPrefetcher()
+{
+    stop();
+}
+
+void WavPrefetcher::start(const std::vector<std::string> &paths)
+{
+    stop();
+
+    m_paths = paths;
+    m_next = 0;
+    m_stop = false;
+    m_wait_time = 0.0;
+
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        m_slots[i].next_song = (unsigned int)i;
+        m_slots[i].state     = SLOT_FREE;
+        m_slots[i].status    = 0;
+    }
+
+    for (int t = 0; t < m_num_threads; t++)
+    {
+        m_threads.push_back(std::thread(&WavPrefetcher::loader, this));
+    }
+}
+
+void WavPrefetcher::loader()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+
+    while (!m_stop && m_next < m_paths.size())
+    {
+        const unsigned int song = m_next++;
+        Slot &slot = m_slots[song % m_slots.size()];
+        short int *wave = m_buffers[song % m_slots.size()];
+        WAVSOURCE src;
+        FILE *fp;
+        double t;
+        int status = -1;
+
+        /* wait for the consumer to release the previous song of this buffer */
+        m_changed.wait(guard, [&] { return m_stop || (slot.state == SLOT_FREE && slot.next_song == song); });
+        if (m_stop)
+        {
+            break;
+        }
+        slot.state = SLOT_LOADING;
+
+        guard.unlock();
+
+        t = getCurrentTimestamp();
+        fp = fopen(m_paths[song].c_str(), "rb");
+        if (fp != NULL)
+        {
+            record(my_utils::STAGE_OPEN, &t);
+
+            if (open_wav_source(fileno(fp), &src) == 0)
+            {
+                record(my_utils::STAGE_PARSE, &t);
+
+                const size_t stride = m_dense ? (1u << m_config.dwt_levels) : m_config.block_size;
+
+                memset(wave, 0, m_buffer_samples * sizeof(short int));
+                if (config_num_dwteco(&m_config, &src) * stride <= m_buffer_samples)
+                {
+                    status = m_dense ? decimate_wave_dense(&src, &m_config, wave) : decimate_wave(&src, &m_config, wave);
+                }
+                record(my_utils::STAGE_READ, &t);
+
+                if (status == 0 && m_stats != NULL)
+                {
+                    m_stats->add_song(src.map_size);
+                }
+                close_wav_source(&src);
+            }
+            fclose(fp);
+        }
+
+        guard.lock();
+
+        slot.state  = SLOT_READY;
+        slot.status = status;
+        m_changed.notify_all();
+    }
+}
+
+/* Time since *t for a stage, then restart *t */
+void WavPrefetcher::record(my_utils::stage_t stage, double *t)
+{
+    const double now = getCurrentTimestamp();
+
+    if (m_stats != NULL)
+    {
+        m_stats->record(stage, (now - *t) * 1e3);
+    }
+    *t = now;
+}
+
+short int *WavPrefetcher::acquire(unsigned int song, int *status)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    Slot &slot = m_slots[song % m_slots.size()];
+    const double start_time = getCurrentTimestamp();
+
+    m_changed.wait(guard, [&] { return m_stop || (slot.state == SLOT_READY && slot.next_song == song); });
+    m_wait_time += getCurrentTimestamp() - start_time;
+
+    *status = m_stop ? -1 : slot.status;
+
+    return m_buffers[song % m_slots.size()];
+}
+
+void WavPrefetcher::release(unsigned int song)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    Slot &slot = m_slots[song % m_slots.size()];
+
+    slot.state = SLOT_FREE;
+    slot.next_song = song + (unsigned int)m_slots.size();
+    m_changed.notify_all();
+}
+
+void WavPrefetcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+
+        m_stop = true;
+        m_changed.notify_all();
+    }
+
+    for (size_t t = 0; t < m_threads.size(); t++)
+    {
+        m_threads[t].join();
+    }
+    m_threads.clear();
+}
+
+} // namespace hifp
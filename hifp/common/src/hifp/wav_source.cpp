@@ -0,0 +1,118 @@
+#include "hifp/hifp.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace hifp
+{
+
+/*
+ * Map the whole file and walk the RIFF chunks in place.
+ * Nothing is copied: src->pcm points into the mapping, and the DWT reads
+ * only the samples it needs through the interleaved (strided) view.
+ */
+int open_wav_source(
+    int         fd,
+    WAVSOURCE * src
+)
+{
+    struct stat st;
+    const unsigned char *p;
+    const unsigned char *end;
+    unsigned int chunk_size;
+    bool has_fmt = false;
+    int r;
+
+    memset(src, 0, sizeof(WAVSOURCE));
+
+    r = fstat(fd, &st);
+    ASSERT(r == 0);
+    if (!S_ISREG(st.st_mode))
+    {
+        return WAV_NOT_MAPPED;
+    }
+    ASSERT(st.st_size >= 12);
+
+    src->map_size = st.st_size;
+    src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src->map == MAP_FAILED)
+    {
+        src->map = NULL;
+        close_wav_source(src);
+        return WAV_NOT_MAPPED;
+    }
+
+    p   = (const unsigned char *)src->map;
+    end = p + src->map_size;
+
+    /* RIFF header */
+    memcpy(&src->header.riff, p, 3 * sizeof(unsigned int));
+    ASSERT(memcmp(&src->header.riff, "RIFF", 4) == 0);
+    ASSERT(memcmp(&src->header.wave, "WAVE", 4) == 0);
+    p += 12;
+
+    /* Chunk list */
+    while (src->pcm == NULL)
+    {
+        ASSERT(end - p >= 8);
+        memcpy(&chunk_size, p + 4, sizeof(unsigned int));
+
+        if (memcmp(p, "fmt ", 4) == 0)
+        {
+            ASSERT(chunk_size >= 16 && (size_t)(end - p) >= 8 + 16);
+            memcpy(&src->header.fmt, p, 2 * sizeof(unsigned int));
+            memcpy(&src->header.FormatId, p + 8, 16);
+            has_fmt = true;
+        }
+        else if (memcmp(p, "data", 4) == 0)
+        {
+            memcpy(&src->header.data, p, 2 * sizeof(unsigned int));
+            src->pcm = (const short int *)(p + 8);
+            /* tolerate a truncated file, only what is mapped is usable */
+            if (chunk_size > (size_t)(end - p) - 8)
+            {
+                chunk_size = (unsigned int)((end - p) - 8);
+            }
+            src->num_samples = chunk_size / sizeof(short int);
+            break;
+        }
+
+        /* chunks are padded to an even size */
+        ASSERT((size_t)(end - p) - 8 >= chunk_size);
+        p += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    ASSERT(has_fmt);
+    ASSERT(src->header.BitsPerSample == 16);
+
+    return 0;
+
+err:
+    close_wav_source(src);
+    return -1;
+}
+
+void close_wav_source(
+    WAVSOURCE * src
+)
+{
+    if (src->map != NULL)
+    {
+        munmap(src->map, src->map_size);
+    }
+    memset(src, 0, sizeof(WAVSOURCE));
+}
+
+/* FPID generation over a mapped file with the default geometry */
+int gen_fpid_mapped(
+    const WAVSOURCE * src,
+    unsigned int *    fpid
+)
+{
+    const FingerprintConfig cfg = default_fingerprint_config();
+
+    return gen_fpid_config(src, &cfg, fpid);
+}
+
+} // namespace hifp
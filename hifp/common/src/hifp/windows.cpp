@@ -0,0 +1,115 @@
+#include "hifp/hifp.h"
+
+#include <vector>
+
+namespace hifp
+{
+
+/*
+ * Sliding-window fingerprints.
+ *
+ * Window w covers the cfg->num_wave samples starting at sample w * cfg->hop
+ * and gets the same FPID gen_fpid_config() computes for a track cut there.
+ * Overlapping windows share their DWT values and comparison bits, so both
+ * are computed once for the whole track: the DWT values into one array,
+ * the comparisons into one MSB-first bit stream. A window then only copies
+ * its bits out of the stream, a funnel shift per FPID word.
+ */
+
+/* Number of complete windows in a track, 0 when the track is too short */
+unsigned int config_num_windows(
+    const FingerprintConfig * cfg,
+    const WAVSOURCE *         src
+)
+{
+    const unsigned int numch = (src->header.NumChannel == 2) ? 2 : 1;
+    const size_t track_blocks = src->num_samples / numch / cfg->block_size;
+    const size_t window_blocks = cfg->num_wave / cfg->block_size;
+    const size_t hop_blocks = cfg->hop / cfg->block_size;
+
+    if (hop_blocks == 0 || track_blocks < window_blocks)
+    {
+        return 0;
+    }
+
+    return (unsigned int)((track_blocks - window_blocks) / hop_blocks + 1);
+}
+
+/*
+ * FPIDs of every window of a track, stored back to back.
+ * fpid must hold config_num_windows() * config_num_frame() words.
+ */
+int gen_fpid_windows(
+    const WAVSOURCE *         src,
+    const FingerprintConfig * cfg,
+    unsigned int *            fpid
+)
+{
+    const unsigned int bpw = cfg->bits_per_word;
+    unsigned int num_windows;
+    unsigned int window_blocks;
+    unsigned int hop_blocks;
+    unsigned int num_frame;
+    unsigned int num_blocks;
+    std::vector<unsigned int> dwt_eco;
+    std::vector<unsigned int> bits;
+    int r;
+
+    r = check_fingerprint_config(cfg);
+    ASSERT(r == 0);
+    ASSERT(cfg->hop != 0);
+    ASSERT(cfg->sample_rate == 0 || src->header.SampleRate == cfg->sample_rate);
+
+    num_windows = config_num_windows(cfg, src);
+    ASSERT(num_windows > 0);
+
+    window_blocks = cfg->num_wave / cfg->block_size;
+    hop_blocks    = cfg->hop / cfg->block_size;
+    num_frame     = config_num_frame(cfg, window_blocks);
+    num_blocks    = (num_windows - 1) * hop_blocks + window_blocks;
+
+    /* DWT values of the track, once */
+    dwt_eco.resize(num_blocks);
+    r = dwt_config_blocks(src, cfg, num_blocks, &dwt_eco[0]);
+    ASSERT(r == 0);
+
+    /* bit j compares value j with value j + 1, one spare word for the funnel shift */
+    bits.assign((num_blocks + 31) / 32 + 1, 0);
+    for (unsigned int j = 0; j + 1 < num_blocks; j++)
+    {
+        if (dwt_eco[j] > dwt_eco[j + 1])
+        {
+            bits[j / 32] |= 0x80000000u >> (j % 32);
+        }
+    }
+
+    for (unsigned int w = 0; w < num_windows; w++)
+    {
+        const unsigned int first = w * hop_blocks;
+        unsigned int *out = &fpid[(size_t)w * num_frame];
+
+        for (unsigned int k = 0; k < num_frame; k++)
+        {
+            const unsigned int pos = first + k * bpw;
+            const unsigned long long pair =
+                ((unsigned long long)bits[pos / 32] << 32) | bits[pos / 32 + 1];
+            unsigned long long word = (pair << (pos % 32)) >> (64 - bpw);
+
+            /* bits past the window's last comparison read as 0, like the padding bit */
+            const unsigned int valid = window_blocks - 1 - k * bpw;
+            if (valid < bpw)
+            {
+                word &= ~((1ull << (bpw - valid)) - 1);
+            }
+
+            out[k] = (unsigned int)word;
+        }
+    }
+
+    return 0;
+
+err:
+    return -1;
+}
+
+} // namespace hifp
@@ -0,0 +1,305 @@
+#include "utils/metrics.h"
+
+#include <string.h>
+
+namespace my_utils
+{
+
+static const size_t BUFFER_SIZE = 1 << 20;  /* bytes written per fwrite */
+static const uint32_t BINARY_VERSION = 1;
+
+int parse_metrics_format(
+    const std::string & name,
+    metrics_format_t *  format
+)
+{
+    if (name == "csv")
+    {
+        *format = METRICS_CSV;
+    }
+    else if (name == "binary")
+    {
+        *format = METRICS_BINARY;
+    }
+    else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *metrics_extension(
+    metrics_format_t format
+)
+{
+    return (format == METRICS_BINARY) ? "bin" : "csv";
+}
+
+MetricsWriter::MetricsWriter()
+    : m_fp(NULL),
+      m_format(METRICS_CSV),
+      m_num_columns(0),
+      m_num_rows(0),
+      m_failed(false),
+      m_used(0),
+      m_block_rows(0)
+{
+}
+
+MetricsWriter::~MetricsWriter()
+{
+    close();
+}
+
+int MetricsWriter::open(
+    const char *                     path,
+    metrics_format_t                 format,
+    const char *                     key_name,
+    const std::vector<std::string> & columns
+)
+{
+    close();
+
+    m_fp = fopen(path, "wb");
+    if (m_fp == NULL)
+    {
+        return -1;
+    }
+    /* rows are already written out in large blocks */
+    setvbuf(m_fp, NULL, _IONBF, 0);
+
+    m_format = format;
+    m_num_columns = (unsigned int)columns.size();
+    m_num_rows = 0;
+    m_failed = false;
+    m_used = 0;
+    m_block_rows = 0;
+
+    /* every buffer is sized here, add_row() does not allocate */
+    m_buffer.resize(BUFFER_SIZE);
+    if (m_format == METRICS_BINARY)
+    {
+        m_key_ends.resize(BINARY_BLOCK_ROWS);
+        m_values.resize((size_t)BINARY_BLOCK_ROWS * m_num_columns);
+    }
+
+    if (m_format == METRICS_CSV)
+    {
+        append(key_name, strlen(key_name));
+        for (size_t c = 0; c < columns.size(); c++)
+        {
+            append(",", 1);
+            append(columns[c].data(), columns[c].size());
+        }
+        append("\n", 1);
+    }
+    else
+    {
+        const uint32_t head[2] = { BINARY_VERSION, m_num_columns };
+
+        write("HIFPMETR", 8);
+        write(head, sizeof(head));
+        for (size_t c = 0; c <= columns.size(); c++)
+        {
+            const char *name = (c == 0) ? key_name : columns[c - 1].c_str();
+            const uint32_t len = (uint32_t)strlen(name);
+
+            write(&len, sizeof(len));
+            write(name, len);
+        }
+    }
+
+    return m_failed ? -1 : 0;
+}
+
+void MetricsWriter::add_row(
+    const char *   key,
+    const double * values
+)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (m_fp == NULL)
+    {
+        return;
+    }
+
+    if (m_format == METRICS_CSV)
+    {
+        add_csv_row(key, values);
+    }
+    else
+    {
+        add_binary_row(key, values);
+    }
+    m_num_rows++;
+}
+
+void MetricsWriter::add_csv_row(
+    const char *   key,
+    const double * values
+)
+{
+    const size_t len = strlen(key);
+
+    /* names with a separator, quote or line break are quoted */
+    if (strpbrk(key, ",\"\r\n") == NULL)
+    {
+        append(key, len);
+    }
+    else
+    {
+        append("\"", 1);
+        for (const char *p = key; *p != '\0'; p++)
+        {
+            append(p, 1);
+            if (*p == '"')
+            {
+                append(p, 1);
+            }
+        }
+        append("\"", 1);
+    }
+
+    for (unsigned int c = 0; c < m_num_columns; c++)
+    {
+        char field[352];  /* "%f" of the largest double is 316 characters */
+        const int n = snprintf(field, sizeof(field), ",%f", values[c]);
+
+        append(field, (size_t)n);
+    }
+    append("\n", 1);
+}
+
+void MetricsWriter::add_binary_row(
+    const char *   key,
+    const double * values
+)
+{
+    const size_t len = strlen(key);
+
+    /* keys past the buffer would not fit a block */
+    if (m_used + len > m_buffer.size())
+    {
+        write_block();
+    }
+    if (len <= m_buffer.size())
+    {
+        memcpy(&m_buffer[m_used], key, len);
+        m_used += len;
+    }
+
+    m_key_ends[m_block_rows] = (uint32_t)m_used;
+    for (unsigned int c = 0; c < m_num_columns; c++)
+    {
+        m_values[(size_t)c * BINARY_BLOCK_ROWS + m_block_rows] = values[c];
+    }
+
+    if (++m_block_rows == BINARY_BLOCK_ROWS)
+    {
+        write_block();
+    }
+}
+
+/* Queue text, writing the buffer out whenever it is full */
+void MetricsWriter::append(
+    const char * data,
+    size_t       size
+)
+{
+    while (size > 0)
+    {
+        size_t n = m_buffer.size() - m_used;
+
+        if (n == 0)
+        {
+            flush();
+            n = m_buffer.size();
+        }
+        if (n > size)
+        {
+            n = size;
+        }
+
+        memcpy(&m_buffer[m_used], data, n);
+        m_used += n;
+        data += n;
+        size -= n;
+    }
+}
+
+void MetricsWriter::write_block()
+{
+    if (m_block_rows == 0)
+    {
+        return;
+    }
+
+    const uint32_t head[2] = { m_block_rows, (uint32_t)m_used };
+
+    write(head, sizeof(head));
+    write(&m_key_ends[0], m_block_rows * sizeof(uint32_t));
+    write(&m_buffer[0], m_used);
+    for (unsigned int c = 0; c < m_num_columns; c++)
+    {
+        write(&m_values[(size_t)c * BINARY_BLOCK_ROWS], m_block_rows * sizeof(double));
+    }
+
+    m_block_rows = 0;
+    m_used = 0;
+}
+
+void MetricsWriter::flush()
+{
+    write(&m_buffer[0], m_used);
+    m_used = 0;
+}
+
+void MetricsWriter::write(
+    const void * data,
+    size_t       size
+)
+{
+    if (size > 0 && fwrite(data, 1, size, m_fp) != size)
+    {
+        m_failed = true;
+    }
+}
+
+int MetricsWriter::close()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    if (m_fp == NULL)
+    {
+        return 0;
+    }
+
+    if (m_format == METRICS_CSV)
+    {
+        flush();
+    }
+    else
+    {
+        const uint32_t end = 0;
+
+        write_block();
+        write(&end, sizeof(end));
+    }
+
+    if (fclose(m_fp) != 0)
+    {
+        m_failed = true;
+    }
+    m_fp = NULL;
+
+    /* the buffers go with the file */
+    std::vector<char>().swap(m_buffer);
+    std::vector<uint32_t>().swap(m_key_ends);
+    std::vector<double>().swap(m_values);
+
+    return m_failed ? -1 : 0;
+}
+
+} // namespace my_utils
@@ -0,0 +1,264 @@
+#include "utils/stage_stats.h"
+#include "utils/utils.h"
+
+namespace my_utils
+{
+
+static const char *const STAGE_NAMES[NUM_STAGES] = {
+    "open",
+    "parse",
+    "read",
+    "dwt",
+    "pack",
+    "transfer",
+    "kernel",
+    "write",
+    "song"
+};
+
+static const unsigned int NUM_LINEAR = 128;    /* one bucket per ns below this */
+static const unsigned int SUB_BUCKETS = 64;    /* buckets per power of two above */
+static const unsigned int NUM_BUCKETS = NUM_LINEAR + 57 * SUB_BUCKETS;
+
+const char *stage_name(
+    stage_t stage
+)
+{
+    return STAGE_NAMES[stage];
+}
+
+
+LatencyHistogram::LatencyHistogram(
+) : m_buckets(NUM_BUCKETS, 0),
+    m_count(0),
+    m_max(0),
+    m_sum(0.0)
+{
+}
+
+unsigned int LatencyHistogram::bucket(
+    unsigned long long ns
+)
+{
+    if (ns < NUM_LINEAR)
+    {
+        return (unsigned int)ns;
+    }
+
+    /* the top 7 bits of ns select the bucket within its power of two */
+    const unsigned int shift = 63 - __builtin_clzll(ns) - 6;
+    const unsigned int sub = (unsigned int)(ns >> shift) - SUB_BUCKETS;
+
+    return NUM_LINEAR + (shift - 1) * SUB_BUCKETS + sub;
+}
+
+unsigned long long LatencyHistogram::bucket_max(
+    unsigned int b
+)
+{
+    if (b < NUM_LINEAR)
+    {
+        return b;
+    }
+
+    const unsigned int shift = (b - NUM_LINEAR) / SUB_BUCKETS + 1;
+    const unsigned long long sub = (b - NUM_LINEAR) % SUB_BUCKETS + SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(
+    double ms
+)
+{
+    const unsigned long long ns = (ms > 0.0) ? (unsigned long long)(ms * 1e6 + 0.5) : 0;
+
+    m_buckets[bucket(ns)]++;
+    m_count++;
+    m_sum += ms;
+    if (ns > m_max)
+    {
+        m_max = ns;
+    }
+}
+
+void LatencyHistogram::merge(
+    const LatencyHistogram &other
+)
+{
+    for (unsigned int b = 0; b < NUM_BUCKETS; b++)
+    {
+        m_buckets[b] += other.m_buckets[b];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    if (other.m_max > m_max)
+    {
+        m_max = other.m_max;
+    }
+}
+
+double LatencyHistogram::mean() const
+{
+    return (m_count > 0) ? m_sum / m_count : 0.0;
+}
+
+double LatencyHistogram::max() const
+{
+    return m_max * 1e-6;
+}
+
+double LatencyHistogram::percentile(
+    double p
+) const
+{
+    unsigned long long rank = (unsigned long long)(p / 100.0 * m_count + 0.999999);
+    unsigned long long seen = 0;
+
+    if (m_count == 0)
+    {
+        return 0.0;
+    }
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    for (unsigned int b = 0; b < NUM_BUCKETS; b++)
+    {
+        seen += m_buckets[b];
+        if (seen >= rank)
+        {
+            /* report the top of the bucket, but never above what was recorded */
+            const unsigned long long ns = bucket_max(b);
+
+            return (ns < m_max ? ns : m_max) * 1e-6;
+        }
+    }
+
+    return max();
+}
+
+
+RunStats::RunStats(
+) : m_songs(0),
+    m_bytes(0),
+    m_start_time(0.0),
+    m_stop_time(0.0)
+{
+}
+
+void RunStats::start()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_start_time = getCurrentTimestamp();
+    m_stop_time = 0.0;
+}
+
+void RunStats::stop()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_stop_time = getCurrentTimestamp();
+}
+
+/* Seconds since start(), up to stop() once stopped */
+double RunStats::wall_time() const
+{
+    const double end_time = (m_stop_time > 0.0) ? m_stop_time : getCurrentTimestamp();
+
+    return (m_start_time > 0.0) ? end_time - m_start_time : 0.0;
+}
+
+void RunStats::record(
+    stage_t stage,
+    double  ms
+)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_stages[stage].record(ms);
+}
+
+void RunStats::add_song(
+    unsigned long long bytes
+)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_songs++;
+    m_bytes += bytes;
+}
+
+void RunStats::print_summary(
+    FILE *fp
+) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    const double seconds = wall_time();
+
+    fprintf(fp, "\n");
+    fprintf(fp, "%-10s %8s %10s %10s %10s %10s %10s\n", "stage (ms)", "count", "mean", "p50", "p90", "p99", "max");
+    for (int s = 0; s < NUM_STAGES; s++)
+    {
+        const LatencyHistogram &h = m_stages[s];
+
+        if (h.count() == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%-10s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                STAGE_NAMES[s], h.count(), h.mean(),
+                h.percentile(50.0), h.percentile(90.0), h.percentile(99.0), h.max());
+    }
+
+    fprintf(fp, "\n");
+    fprintf(fp, "Songs: %llu in %0.3f s, %0.1f songs/s, %0.1f MB/s\n",
+            m_songs, seconds,
+            seconds > 0.0 ? m_songs / seconds : 0.0,
+            seconds > 0.0 ? m_bytes / seconds * 1e-6 : 0.0);
+}
+
+int RunStats::write_json(
+    const char *path
+) const
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    const double seconds = wall_time();
+    bool first = true;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"songs\": %llu,\n", m_songs);
+    fprintf(fp, "  \"bytes\": %llu,\n", m_bytes);
+    fprintf(fp, "  \"seconds\": %0.6f,\n", seconds);
+    fprintf(fp, "  \"songs_per_s\": %0.3f,\n", seconds > 0.0 ? m_songs / seconds : 0.0);
+    fprintf(fp, "  \"mb_per_s\": %0.3f,\n", seconds > 0.0 ? m_bytes / seconds * 1e-6 : 0.0);
+    fprintf(fp, "  \"stages_ms\": {");
+    for (int s = 0; s < NUM_STAGES; s++)
+    {
+        const LatencyHistogram &h = m_stages[s];
+
+        if (h.count() == 0)
+        {
+            continue;
+        }
+        fprintf(fp, "%s\n    \"%s\": {\"count\": %llu, \"mean\": %0.6f, \"p50\": %0.6f, \"p90\": %0.6f, \"p99\": %0.6f, \"max\": %0.6f}",
+                first ? "" : ",", STAGE_NAMES[s], h.count(), h.mean(),
+                h.percentile(50.0), h.percentile(90.0), h.percentile(99.0), h.max());
+        first = false;
+    }
+    fprintf(fp, "\n  }\n");
+    fprintf(fp, "}\n");
+
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+}
@@ -0,0 +1,166 @@
+#include "utils/thread_pool.h"
+
+namespace my_utils
+{
+
+WorkStealingPool::WorkStealingPool(
+    int num_threads
+) : m_num_threads(num_threads > 0 ? num_threads : 1),
+    m_queues(m_num_threads),
+    m_task(NULL),
+    m_generation(0),
+    m_pending(0),
+    m_stop(false)
+{
+    for (int w = 1; w < m_num_threads; w++)
+    {
+        m_threads.push_back(std::thread(&WorkStealingPool::worker_main, this, w));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_start.notify_all();
+    for (size_t w = 0; w < m_threads.size(); w++)
+    {
+        m_threads[w].join();
+    }
+}
+
+bool WorkStealingPool::pop_local(
+    int   worker, 
+    int * index
+)
+{
+    WorkQueue &q = m_queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+
+    if (q.items.empty())
+    {
+        return false;
+    }
+    *index = q.items.front();
+    q.items.pop_front();
+
+    return true;
+}
+
+bool WorkStealingPool::steal(
+    int   worker, 
+    int * index
+)
+{
+    for (int i = 1; i < m_num_threads; i++)
+    {
+        WorkQueue &q = m_queues[(worker + i) % m_num_threads];
+        std::lock_guard<std::mutex> guard(q.lock);
+
+        if (!q.items.empty())
+        {
+            *index = q.items.back();
+            q.items.pop_back();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkStealingPool::worker_loop(
+    int                                     worker, 
+    const std::function<void(int, int)> &   task
+)
+{
+    int index;
+
+    /* jobs are never added during run(), so empty everywhere means done */
+    while (pop_local(worker, &index) || steal(worker, &index))
+    {
+        task(index, worker);
+    }
+}
+
+void WorkStealingPool::worker_main(
+    int worker
+)
+{
+    unsigned int generation = 0;
+
+    for (;;)
+    {
+        const std::function<void(int, int)> *task;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            while (!m_stop && m_generation == generation)
+            {
+                m_start.wait(guard);
+            }
+            if (m_stop)
+            {
+                return;
+            }
+            generation = m_generation;
+            task = m_task;
+        }
+
+        worker_loop(worker, *task);
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (--m_pending == 0)
+            {
+                m_done.notify_one();
+            }
+        }
+    }
+}
+
+void WorkStealingPool::run(
+    int                                     n, 
+    const std::function<void(int, int)> &   task
+)
+{
+    /* contiguous initial split keeps neighbouring jobs on the same worker */
+    for (int w = 0; w < m_num_threads; w++)
+    {
+        const int begin = (int)((long long)n * w / m_num_threads);
+        const int end   = (int)((long long)n * (w + 1) / m_num_threads);
+
+        for (int i = begin; i < end; i++)
+        {
+            m_queues[w].items.push_back(i);
+        }
+    }
+
+    if (m_num_threads == 1)
+    {
+        worker_loop(0, task);
+        return;
+    }
+
+    /* the queues are filled before the workers see the new generation */
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_task    = &task;
+        m_pending = m_num_threads - 1;
+        m_generation++;
+    }
+    m_start.notify_all();
+
+    worker_loop(0, task);
+
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        while (m_pending > 0)
+        {
+            m_done.wait(guard);
+        }
+        m_task = NULL;
+    }
+}
+
+}
@@ -1,70 +1,325 @@
+/*
+ * Fingerprint geometry. The block layout is fixed when the kernel is built
+ * and can be overridden with build options (-DDWT_BLOCK=64 ...). The number
+ * of blocks per song is a kernel argument, so one binary serves previews and
+ * whole tracks. NUMDWTECO / NUMFRAME are the defaults the host uses.
+ */
+#ifndef NUMWAVE
 #define NUMWAVE   131072 /* Number of samples of PCM data */
+#endif
+#ifndef NUMDWTECO
 #define NUMDWTECO 4096   /* Number of bits per FPIDs */
+#endif
+#ifndef NUMFRAME
 #define NUMFRAME  128    /* Number of frames of generated FPID data */
+#endif
+#ifndef DWT_BLOCK
+#define DWT_BLOCK  32    /* Samples per DWT block (decimation stride) */
+#endif
+#ifndef DWT_LEVELS
+#define DWT_LEVELS 3     /* DWT levels, a block uses its first 2^DWT_LEVELS samples */
+#endif
+#ifndef DWT_FILTER_TAPS
+#define DWT_FILTER_TAPS 2      /* Wavelet filter, Haar unless the host passes another */
+#define DWT_SHIFT       1
+#define DWT_FILTER      1, 1
+#endif
+#ifndef FPID_BITS
+#define FPID_BITS  32    /* Comparison bits per FPID word */
+#endif
 
+#ifndef DWT_VECTOR
+#define DWT_VECTOR 0     /* 1: read a block's samples with one vloadN, DWT_LEVELS 1 to 4 */
+#endif
+#ifndef DWT_DENSE
+#define DWT_DENSE 0      /* 1: wave16 holds only the DWT_TAPS samples of each block, back to back */
+#endif
+#ifndef DWT_BLOCKS_PER_ITEM
+#define DWT_BLOCKS_PER_ITEM 1  /* Blocks per dwt work-item */
+#endif
 
-__kernel void dwt(
+#define DWT_TAPS (1 << DWT_LEVELS)
+
+__constant int dwt_filter[DWT_FILTER_TAPS] = { DWT_FILTER };
+
+/* Shorts between the first samples of consecutive blocks in wave16 */
+#if DWT_DENSE
+#define WAVE_STRIDE DWT_TAPS
+#else
+#define WAVE_STRIDE DWT_BLOCK
+#endif
+
+
+/*
+ * DWT_LEVELS-level wavelet transform of the block at wave_offset. The filter
+ * is DWT_FILTER_TAPS integer taps summing to 1 << DWT_SHIFT; the host passes
+ * them from the CPU DWT engine (dwt_engine.h) so both compute the same
+ * values. Each level wraps around inside the block (periodic extension).
+ * The coefficient is signed; kernels store it into unsigned dwteco, which
+ * sign-extends it exactly like the CPU reference, so FPID comparisons are
+ * unsigned on both sides (-1 compares above 1).
+ */
+int dwt_block(
     __global const short int * wave16,
-    __global unsigned int *    dwteco
+    int                        wave_offset
 )
 {
-    int global_id  = get_global_id(0);
-    int wave_offset = global_id * 32;
+    int a[DWT_TAPS];
+    int b[DWT_TAPS / 2];
+    int i = 0;
+    int k = 0;
+    int n = 0;
+
+#if DWT_VECTOR
+    /* one vector load per block */
+#if DWT_TAPS == 16
+    vstore16(convert_int16(vload16(0, wave16 + wave_offset)), 0, a);
+#elif DWT_TAPS == 8
+    vstore8(convert_int8(vload8(0, wave16 + wave_offset)), 0, a);
+#elif DWT_TAPS == 4
+    vstore4(convert_int4(vload4(0, wave16 + wave_offset)), 0, a);
+#elif DWT_TAPS == 2
+    vstore2(convert_int2(vload2(0, wave16 + wave_offset)), 0, a);
+#else
+#error "DWT_VECTOR needs DWT_LEVELS 1 to 4"
+#endif
+#else
+    #pragma unroll
+    for (i=0; i<DWT_TAPS; i++) {
+        a[i] = wave16[wave_offset + i];
+    }
+#endif
+
+    #pragma unroll
+    for (n=DWT_TAPS/2; n>=1; n/=2) {
+        #pragma unroll
+        for (i=0; i<n; i++) {
+            int acc = 0;
 
-    short int dwteco_tmp[4];
+            #pragma unroll
+            for (k=0; k<DWT_FILTER_TAPS; k++) {
+                acc += a[(2 * i + k) & (2 * n - 1)] * dwt_filter[k];
+            }
+            /* divide by 2^DWT_SHIFT rounding toward zero */
+            b[i] = (acc + ((acc >> 31) & ((1 << DWT_SHIFT) - 1))) >> DWT_SHIFT;
+        }
+        #pragma unroll
+        for (i=0; i<n; i++) {
+            a[i] = b[i];
+        }
+    }
+
+    return a[0];
+}
 
-    /* 3-stages HAAR wavelet transform */
-    /* 1st round */
-    dwteco_tmp[0] = (wave16[wave_offset]     + wave16[wave_offset + 1]) / 2;
-    dwteco_tmp[1] = (wave16[wave_offset + 2] + wave16[wave_offset + 3]) / 2;
-    dwteco_tmp[2] = (wave16[wave_offset + 4] + wave16[wave_offset + 5]) / 2;
-    dwteco_tmp[3] = (wave16[wave_offset + 6] + wave16[wave_offset + 7]) / 2;
 
-    /* 2nd round */
-    dwteco_tmp[0] = (dwteco_tmp[0] + dwteco_tmp[1]) / 2;
-    dwteco_tmp[1] = (dwteco_tmp[2] + dwteco_tmp[3]) / 2;
+/*
+ * One DWT value per block. A work-item covers DWT_BLOCKS_PER_ITEM blocks
+ * global size apart, so neighbouring work-items still read neighbouring
+ * blocks on every iteration; launch num_dwteco / DWT_BLOCKS_PER_ITEM
+ * (rounded up) work-items.
+ */
+__kernel void dwt(
+    __global const short int * wave16,
+    __global unsigned int *    dwteco,
+    const unsigned int         num_dwteco
+)
+{
+    int global_id = get_global_id(0);
+    int stride    = get_global_size(0);
+    int block     = 0;
+    int k = 0;
 
-    /* 3rd round */
-    dwteco_tmp[0] = (dwteco_tmp[0] + dwteco_tmp[1]) / 2;
+    #pragma unroll
+    for (k=0; k<DWT_BLOCKS_PER_ITEM; k++) {
+        block = global_id + k * stride;
 
-    dwteco[global_id] = dwteco_tmp[0];
+        if (block < num_dwteco) {
+            dwteco[block] = (unsigned int)dwt_block(wave16, block * WAVE_STRIDE);
+        }
+    }
 }
 
 
+/*
+ * Word global_id holds the comparisons of DWT values global_id * FPID_BITS
+ * onwards. The bit after the last DWT value is a 0 padding bit, and a last
+ * partial word is left-aligned. The word is built in a register and stored
+ * once, so the kernel neither depends on the previous content of fpid nor
+ * goes through global memory for every bit.
+ */
 __kernel void generate_fpid(
     __global const unsigned int * dwteco,
-    __global unsigned int *       fpid
+    __global unsigned int *       fpid,
+    const unsigned int            num_dwteco
 )
 {
     int global_id     = get_global_id(0);
-    int dwteco_offset = global_id * 32;
+    int dwteco_offset = global_id * FPID_BITS;
     int dwteco_index  = 0;
+    unsigned int word = 0;
     int i = 0;
 
     /* Generate FPID */
-    if (global_id < NUMFRAME - 1) {
-        #pragma unroll
-        for (i=0; i<32; i++) {
-            dwteco_index = dwteco_offset + i;
-            
-            fpid[global_id] <<= 1;
-            
-            if (dwteco[dwteco_index] > dwteco[dwteco_index + 1]) {
-                fpid[global_id] |= 1;
-            }
+    #pragma unroll
+    for (i=0; i<FPID_BITS; i++) {
+        dwteco_index = dwteco_offset + i;
+
+        word <<= 1;
+
+        if (dwteco_index + 1 < num_dwteco && dwteco[dwteco_index] > dwteco[dwteco_index + 1]) {
+            word |= 1;
+        }
+    }
+
+    fpid[global_id] = word;
+}
+
+
+/*
+ * Batched variants: one NDRange covers num_songs songs of num_dwteco blocks.
+ * wave_offsets[s] is the index of the first sample of song s in wave16;
+ * the DWT coefficients and FPIDs of song s are stored at s * num_dwteco and
+ * s * num_frame respectively.
+ */
+__kernel void dwt_batch(
+    __global const short int *    wave16,
+    __global const unsigned int * wave_offsets,
+    __global unsigned int *       dwteco,
+    const unsigned int            num_songs,
+    const unsigned int            num_dwteco
+)
+{
+    int global_id   = get_global_id(0);
+    int song        = global_id / num_dwteco;
+    int block       = global_id % num_dwteco;
+
+    if (song >= num_songs) {
+        return;
+    }
+
+    dwteco[global_id] = (unsigned int)dwt_block(wave16, wave_offsets[song] + block * WAVE_STRIDE);
+}
+
+
+__kernel void generate_fpid_batch(
+    __global const unsigned int * dwteco,
+    __global unsigned int *       fpid,
+    const unsigned int            num_songs,
+    const unsigned int            num_dwteco
+)
+{
+    int num_frame     = (num_dwteco + FPID_BITS - 1) / FPID_BITS;
+    int global_id     = get_global_id(0);
+    int song          = global_id / num_frame;
+    int frame         = global_id % num_frame;
+    int first         = frame * FPID_BITS;
+    int dwteco_offset = song * num_dwteco + first;
+    unsigned int word = 0;
+    int i = 0;
+
+    if (song >= num_songs) {
+        return;
+    }
+
+    /* Generate FPID, the last word of a song is padded with a 0 bit */
+    #pragma unroll
+    for (i=0; i<FPID_BITS; i++) {
+        word <<= 1;
+
+        if (first + i + 1 < num_dwteco && dwteco[dwteco_offset + i] > dwteco[dwteco_offset + i + 1]) {
+            word |= 1;
+        }
+    }
+
+    fpid[global_id] = word;
+}
+
+
+/*
+ * Fused DWT + FPID kernel, one work-group of FPID_BITS work-items per FPID
+ * word. Each work-item reduces one block, the coefficients stay in local
+ * memory and the word is stored once, so dwteco never goes through global
+ * memory. Launch with global size num_frame * FPID_BITS and local size
+ * FPID_BITS.
+ */
+__attribute__((reqd_work_group_size(FPID_BITS, 1, 1)))
+__kernel void hifp_fused(
+    __global const short int * restrict wave16,
+    __global unsigned int *    restrict fpid,
+    const unsigned int                  num_dwteco
+)
+{
+    __local unsigned int dwteco[FPID_BITS + 1];
+
+    int frame = get_group_id(0);
+    int lid   = get_local_id(0);
+    int block = frame * FPID_BITS + lid;
+    int i = 0;
+
+    /* DWT of this work-item's block */
+    if (block < num_dwteco) {
+        dwteco[lid] = (unsigned int)dwt_block(wave16, block * WAVE_STRIDE);
+    }
+
+    /* first block of the next word, the last word is padded with a 0 bit */
+    if (lid == 0) {
+        if (block + FPID_BITS < num_dwteco) {
+            dwteco[FPID_BITS] = (unsigned int)dwt_block(wave16, (block + FPID_BITS) * WAVE_STRIDE);
+        } else {
+            dwteco[FPID_BITS] = 0xFFFFFFFF;
         }
-    } else {
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (lid == 0) {
+        unsigned int word = 0;
+
         #pragma unroll
-        for (i=0; i<31; i++) {
-            dwteco_index = dwteco_offset + i;
-            
-            fpid[global_id] <<= 1;
-            
-            if (dwteco[dwteco_index] > dwteco[dwteco_index + 1]) {
-                fpid[global_id] |= 1;
+        for (i=0; i<FPID_BITS; i++) {
+            word = (word << 1) | (block + i + 1 < num_dwteco && dwteco[i] > dwteco[i + 1] ? 1 : 0);
+        }
+
+        fpid[frame] = word;
+    }
+}
+
+
+/*
+ * Single work-item variant of the fused kernel for FPGA.
+ * Blocks are streamed in order, the previous coefficient and the word
+ * being built are kept in registers and shifted every iteration, so the
+ * loop pipelines with an initiation interval of 1. Launch as a task.
+ */
+__kernel void hifp_fused_swi(
+    __global const short int * restrict wave16,
+    __global unsigned int *    restrict fpid,
+    const unsigned int                  num_dwteco
+)
+{
+    unsigned int dwteco_prev = 0;
+    unsigned int word = 0;
+
+    for (int j = 0; j < num_dwteco; j++) {
+        unsigned int dwteco;
+
+        /* DWT of block j */
+        dwteco = (unsigned int)dwt_block(wave16, j * WAVE_STRIDE);
+
+        if (j > 0) {
+            word = (word << 1) | (dwteco_prev > dwteco ? 1 : 0);
+
+            /* FPID_BITS comparisons done, start the next word */
+            if ((j % FPID_BITS) == 0) {
+                fpid[j / FPID_BITS - 1] = word;
+                word = 0;
             }
         }
 
-        fpid[global_id] <<= 1;
+        dwteco_prev = dwteco;
     }
+
+    /* 0 padding bit, then left-align the last word */
+    fpid[(num_dwteco - 1) / FPID_BITS] = (word << 1) << (FPID_BITS - 1 - (num_dwteco - 1) % FPID_BITS);
 }
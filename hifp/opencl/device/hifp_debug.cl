@@ -1,6 +1,12 @@
+#ifndef NUMWAVE
 #define NUMWAVE   131072 /* Number of samples of PCM data */
+#endif
+#ifndef NUMDWTECO
 #define NUMDWTECO 4096   /* Number of bits per FPIDs */
+#endif
+#ifndef NUMFRAME
 #define NUMFRAME  128    /* Number of frames of generated FPID data */
+#endif
 
 
 __kernel void dwt(
@@ -39,32 +45,35 @@ __kernel void generate_fpid(
     int global_id     = get_global_id(0);
     int dwteco_offset = global_id * 32;
     int dwteco_index  = 0;
+    unsigned int word = 0;
     int i = 0;
 
-    /* Generate FPID */
+    /* Generate FPID in a register, fpid is not cleared by the host */
     if (global_id < NUMFRAME - 1) {
         for (i=0; i<32; i++) {
             dwteco_index = dwteco_offset + i;
             
-            fpid[global_id] <<= 1;
+            word <<= 1;
             
             if (dwteco[dwteco_index] > dwteco[dwteco_index + 1]) {
-                fpid[global_id] |= 1;
+                word |= 1;
             }
         }
     } else {
         for (i=0; i<31; i++) {
             dwteco_index = dwteco_offset + i;
             
-            fpid[global_id] <<= 1;
+            word <<= 1;
             
             if (dwteco[dwteco_index] > dwteco[dwteco_index + 1]) {
-                fpid[global_id] |= 1;
+                word |= 1;
             }
         }
 
-        fpid[global_id] <<= 1;
+        word <<= 1;
     }
+
+    fpid[global_id] = word;
 }
 
 
@@ -78,6 +87,7 @@ __kernel void generate_fpid_debug(
     int global_id = get_global_id(0);
     int dwteco_offset = global_id * 32;
     int dwteco_index  = 0;
+    unsigned int word = 0;
     int i = 0;
 
     /* Generate plain FPID */
@@ -99,7 +109,9 @@ __kernel void generate_fpid_debug(
     for (i = 0; i < 32; i++)
     {   
         dwteco_index = dwteco_offset + i;
-        fpid[global_id] <<= 1;
-        fpid[global_id] |= plain_fpid[dwteco_index];
+        word <<= 1;
+        word |= plain_fpid[dwteco_index];
     }
+
+    fpid[global_id] = word;
 }
\ No newline at end of file
@@ -5,10 +5,14 @@
 #define I_DIR "../wav"
 #define O_DIR "./fpid"
 #define CSV_DIR "./report"
+#define KERNEL_SOURCE "device/hifp.cl"
+#define KERNEL_CACHE_DIR "./cache"
 #else
 #define I_DIR "../../wav"
 #define O_DIR "../fpid"
 #define CSV_DIR "../report"
+#define KERNEL_SOURCE "../device/hifp.cl"
+#define KERNEL_CACHE_DIR "../cache"
 #endif
 
 #include <stdio.h>
@@ -18,7 +22,13 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <signal.h>
 #include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -28,20 +38,34 @@
 
 #include "AOCLUtils/aocl_utils.h"
 #include "hifp/hifp.h"
+#include "hifp/fpid_server.h"
+#include "hifp/fpid_store.h"
+#include "hifp/wav_prefetch.h"
 #include "utils/utils.h"
-#include "utils/csv.h"
+#include "utils/metrics.h"
+#include "utils/stage_stats.h"
 
 using namespace std;
 using namespace aocl_utils;
 using namespace hifp;
 using namespace my_utils;
 
-const int NUMWAVE = NUM_WAVE;
-const int NUMDWTECO = NUM_DWT_ECO;
-const int NUMFRAME = NUM_FRAME;
+// Fingerprint geometry (--samples, --block, --levels, --bits, --rate)
+FingerprintConfig fp_config;
+unsigned int num_wave   = 0;  /* shorts per song in the device layout */
+unsigned int num_dwteco = 0;  /* DWT blocks (FPID bits) per song */
+unsigned int num_frame  = 0;  /* FPID words per song */
+unsigned int host_capacity = 0;  /* DWT blocks the buffers of run() can hold */
+
+// Fingerprint store (--store), replaces the per-song .raw files
+string store_path;
+FpidStoreWriter store;
 
 // OpenCL runtime configuration
 string binary_file = "hifp.aocx";
+string kernel_cache = KERNEL_CACHE_DIR;  /* binaries of programs built from source, empty to disable */
+string platform_name;         /* --platform, part of the platform name; empty for the default */
+unsigned device_index = 0;    /* --device, index among the platform's devices */
 cl_platform_id platform = NULL;
 unsigned num_devices = 0;
 cl_device_id device = NULL;
@@ -51,15 +75,13 @@ cl_command_queue queue_2 = NULL;
 cl_program program = NULL;
 cl_kernel kernel[2];
 
-cl_mem wave16_buf = NULL;
-cl_mem fpid_buf = NULL;
-// cl_mem plain_fpid_buf = NULL;
-cl_mem dwteco_buf = NULL;
+// Device buffers of run() and the batched mode, recycled across songs
+BufferPool *buffer_pool = NULL;
 
 const cl_uint work_dim[2] = {1, 1};
 const cl_uint num_events_in_wait_list[2] = {1, 1};
 const size_t global_work_offset[2] = {0, 0};
-const size_t global_work_size[2] = {NUMDWTECO, NUMFRAME};
+size_t global_work_size[2] = {0, 0};
 const size_t local_work_size[2] = {0, 0};
 
 
@@ -68,10 +90,106 @@ const char *IDIR = I_DIR;
 const char *ODIR = O_DIR;
 const char *CSVDIR = CSV_DIR;
 
-short int    wave16[NUMWAVE];
-unsigned int fpid[NUMFRAME];
-// unsigned int plain_fpid[NUMDWTECO];
-unsigned int dwt[NUMDWTECO];
+short int    *wave16 = NULL;
+unsigned int *fpid = NULL;
+// unsigned int *plain_fpid = NULL;
+unsigned int *dwt = NULL;
+
+
+// Pipelined mode: buffer sets reused round-robin across songs
+typedef struct
+{
+    int            song;    /* song held by this slot, -1 when idle */
+    int            status;  /* 0 when the song loaded and its commands are queued */
+    double         start_time;
+    short int *    wave16;
+    unsigned int * fpid;
+    cl_mem         wave16_buf;
+    cl_mem         fpid_buf;
+    cl_mem         dwteco_buf;
+    cl_event       write_event;
+    cl_event       kernel_event[2];
+    cl_event       read_event;
+} song_slot;
+
+unsigned num_slots = 0;
+song_slot *slots = NULL;
+
+// Prefetching (--prefetch): loader threads decimate upcoming songs into
+// aligned host buffers while the device works on the current one
+unsigned prefetch_depth = 0;   /* songs loaded ahead of the device */
+int prefetch_threads = 1;
+unsigned num_prefetch_buffers = 0;
+short int **prefetch_buffers = NULL;
+WavPrefetcher *prefetcher = NULL;
+
+// Kernels used by run() and the pipelined mode
+enum kernel_mode_t
+{
+    KERNEL_SPLIT,     /* dwt then generate_fpid */
+    KERNEL_FUSED,     /* hifp_fused, one work-group per FPID word */
+    KERNEL_FUSED_SWI  /* hifp_fused_swi, single work-item task */
+};
+kernel_mode_t kernel_mode = KERNEL_SPLIT;
+cl_kernel fused_kernel = NULL;
+
+// dwt kernel variant, fixed at build time (--dwt_vector, --dwt_blocks)
+bool dwt_vector = false;           /* vloadN of each block's samples */
+unsigned dwt_blocks_per_item = 1;  /* blocks per dwt work-item */
+
+// Sample layout on the device (--dense): block-strided as in the file, or
+// only the samples the DWT uses, packed by the host
+bool dense_wave = false;
+
+// Multi-device mode (--multi_device): every device of every platform gets its
+// own context, program, queue and buffers, and a host thread pulling songs
+typedef struct
+{
+    cl_device_id     device;
+    cl_context       context;
+    cl_program       program;
+    cl_command_queue queue;
+    cl_kernel        kernel[2];
+    cl_kernel        fused_kernel;
+    short int *      wave16;
+    unsigned int *   fpid;
+    cl_mem           wave16_buf;
+    cl_mem           fpid_buf;
+    cl_mem           dwteco_buf;
+    int              num_songs;  /* songs fingerprinted so far */
+    double           busy_time;  /* ms those songs took, end to end */
+    bool             stopped;    /* pull_song() has stopped handing it songs */
+} device_ctx;
+
+bool multi_device = false;
+unsigned num_device_ctxs = 0;
+device_ctx *device_ctxs = NULL;
+
+mutex sched_lock;               /* guards the scheduler state below and the device counters */
+condition_variable song_done_cv;
+int next_song = 0;              /* next song to hand out */
+vector<char> song_done;         /* song s has its FPID in song_fpids */
+vector<char> song_failed;       /* song s could not be loaded, it has no FPID */
+vector<unsigned int> song_fpids;  /* num_frame words per song, written in song order */
+
+// Batched mode: up to batch_size songs per transfer and kernel launch
+unsigned batch_size = 0;
+cl_kernel batch_kernel[2] = {NULL, NULL};
+
+typedef struct
+{
+    short int *    wave;     /* batch_size songs of num_wave shorts */
+    unsigned int * offsets;  /* first sample of each song in wave */
+    unsigned int * fpid;     /* batch_size songs of num_frame words */
+    cl_mem         wave_buf;
+    cl_mem         offsets_buf;
+    cl_mem         dwteco_buf;
+    cl_mem         fpid_buf;
+} song_batch;
+
+// Long-running mode (--socket, --spool): jobs from an FpidServer on a warm
+// context, stopped by SIGINT and SIGTERM
+FpidServer *server = NULL;
 
 
 int song_id = 0;
@@ -81,14 +199,48 @@ vector<double> write_transfer_time;
 vector<double> read_transfer_time;
 vector<double> dwt_kernel_time;
 vector<double> genfpid_kernel_time;
+RunStats run_stats;  /* per-stage histograms, summarised at exit and saved as JSON */
+metrics_format_t report_format = METRICS_CSV;  /* --report_format */
+MetricsWriter report;  /* times of every song, written as songs finish */
+atomic<int> num_failed_songs(0);  /* songs that could not be loaded, the exit status is 1 if any */
 
 // Function prototypes
 void init_opencl();
+cl_program create_program(cl_context ctx, cl_device_id dev, bool from_source);
+void set_geometry(unsigned int nd);
+FILE *open_song(int song);
+FILE *open_path(const char *path);
 int init_problem(FILE *ifp, FILE *ofp);
-void run();
+int load_wave(FILE *ifp, short int *wave);
+int decimate_song(const WAVSOURCE *src, short int *wave);
+void run(const short int *wave);
+cl_event enqueue_kernels(cl_command_queue q, const cl_kernel *split_kernel, cl_kernel fused, cl_mem wave_buf, cl_mem dwteco_buf, cl_mem fpid_buf, cl_event *write_event, cl_event *kernel_event);
+double event_time_ms(cl_event event);
+void init_slots();
+void run_pipelined();
+void enqueue_slot(song_slot *slot);
+void finish_slot(song_slot *slot);
+void run_batched();
+void init_batch(song_batch *batch);
+void release_batch(song_batch *batch);
+void launch_batch(song_batch *batch, cl_uint count, double start_time);
+int serve();
+void serve_batch(const vector<FpidJob> &jobs, song_batch *batch);
+void stop_server(int sig);
+void init_prefetcher(unsigned int num_buffers);
+void init_devices();
+void run_multi_device();
+void device_worker(unsigned d);
+int pull_song(unsigned d);
+int run_diff_test(const char *wav_dir, const string &only);
+int diff_test_case(const string &name, const WAVSOURCE *src);
 void cleanup();
 void print_executed_time();
-void save_csv(string csvpath);
+void record_device_stats();
+int open_report(char *path);
+void report_song(const char *name, size_t i);
+void fail_song(const char *name, size_t i);
+void save_song_fpid(int song, const unsigned int *song_fpid);
 
 
 
@@ -101,66 +253,353 @@ int main(int argc, char ** argv)
         binary_file = options.get<string>("kernel_bin");
     }
 
-    init_opencl();
+    if (options.has("kernel_cache"))
+    {
+        kernel_cache = options.get<string>("kernel_cache");
+    }
+    if (options.has("no_kernel_cache"))
+    {
+        kernel_cache.clear();
+    }
+
+    if (options.has("platform"))
+    {
+        platform_name = options.get<string>("platform");
+    }
+    if (options.has("device"))
+    {
+        device_index = options.get<unsigned>("device");
+    }
+
+    if (options.has("pipeline"))
+    {
+        num_slots = options.get<unsigned>("pipeline");
+    }
+
+    if (options.has("batch"))
+    {
+        batch_size = options.get<unsigned>("batch");
+    }
+
+    if (options.has("multi_device"))
+    {
+        multi_device = true;
+    }
+
+    if (options.has("prefetch"))
+    {
+        prefetch_depth = options.get<unsigned>("prefetch");
+    }
+    if (options.has("prefetch_threads"))
+    {
+        prefetch_threads = options.get<int>("prefetch_threads");
+    }
+
+    if (options.has("report_format") && parse_metrics_format(options.get<string>("report_format"), &report_format) != 0)
+    {
+        printf("Unknown report format, use csv or binary\n");
+        return -1;
+    }
+
+    /* fingerprint geometry, --samples=0 fingerprints whole tracks */
+    fp_config = default_fingerprint_config();
+    if (options.has("samples"))
+    {
+        fp_config.num_wave = options.get<unsigned int>("samples");
+    }
+    if (options.has("block"))
+    {
+        fp_config.block_size = options.get<unsigned int>("block");
+    }
+    if (options.has("levels"))
+    {
+        fp_config.dwt_levels = options.get<unsigned int>("levels");
+    }
+    if (options.has("bits"))
+    {
+        fp_config.bits_per_word = options.get<unsigned int>("bits");
+    }
+    if (options.has("wavelet") && parse_wavelet(options.get<string>("wavelet").c_str(), &fp_config.wavelet) != 0)
+    {
+        printf("Unknown wavelet, use haar or db4\n");
+        return -1;
+    }
+    if (options.has("rate"))
+    {
+        fp_config.sample_rate = options.get<unsigned int>("rate");
+    }
+    if (check_fingerprint_config(&fp_config) != 0)
+    {
+        printf("Invalid fingerprint geometry\n");
+        return -1;
+    }
+
+    if (options.has("dwt_vector"))
+    {
+        dwt_vector = true;
+    }
+    if (options.has("dwt_blocks"))
+    {
+        dwt_blocks_per_item = options.get<unsigned>("dwt_blocks");
+    }
+    if (options.has("dense"))
+    {
+        dense_wave = true;
+    }
+    if (dwt_blocks_per_item == 0 || (dwt_vector && (fp_config.dwt_levels < 1 || fp_config.dwt_levels > 4)))
+    {
+        printf("--dwt_blocks must be at least 1, --dwt_vector needs 1 to 4 levels\n");
+        return -1;
+    }
+
+    /* the buffer sets of the pipelined and batched modes are sized once */
+    if (fp_config.num_wave == 0 && (num_slots > 0 || batch_size > 0))
+    {
+        printf("Whole-track fingerprints (--samples=0) need the default mode\n");
+        return -1;
+    }
+    if (fp_config.num_wave == 0 && prefetch_depth > 0)
+    {
+        printf("Whole-track fingerprints (--samples=0) cannot be prefetched\n");
+        return -1;
+    }
+    if (batch_size > 0 && prefetch_depth > 0)
+    {
+        printf("--prefetch applies to the default and pipelined modes\n");
+        return -1;
+    }
+    if (multi_device && (fp_config.num_wave == 0 || num_slots > 0 || batch_size > 0 || prefetch_depth > 0 || options.has("diff_test")))
+    {
+        printf("--multi_device needs a fixed --samples and replaces the pipelined, batched, prefetch and test modes\n");
+        return -1;
+    }
+    if ((options.has("socket") || options.has("spool")) &&
+        (multi_device || num_slots > 0 || prefetch_depth > 0 || options.has("store") || options.has("diff_test")))
+    {
+        printf("--socket and --spool run the default or batched mode, and write no store\n");
+        return -1;
+    }
+    if (fp_config.num_wave != 0)
+    {
+        set_geometry(config_num_dwteco(&fp_config, NULL));
+    }
+
+    if (options.has("store"))
+    {
+        store_path = options.get<string>("store");
+
+        /* store records have a fixed size */
+        if (fp_config.num_wave == 0 || store.open(store_path.c_str(), num_frame) != 0)
+        {
+            printf("Cannot write fingerprint store %s\n", store_path.c_str());
+            return -1;
+        }
+    }
+
+    if (options.has("kernel"))
+    {
+        const string mode = options.get<string>("kernel");
+
+        if (mode == "fused")
+        {
+            kernel_mode = KERNEL_FUSED;
+        }
+        else if (mode == "fused_swi")
+        {
+            kernel_mode = KERNEL_FUSED_SWI;
+        }
+        else if (mode != "split")
+        {
+            printf("Unknown kernel '%s', use split, fused or fused_swi\n", mode.c_str());
+            return -1;
+        }
+    }
+
+    if (multi_device)
+    {
+        init_devices();
+    }
+    else
+    {
+        init_opencl();
+    }
+
+    /* check the kernels against the CPU reference instead */
+    if (options.has("diff_test"))
+    {
+        const string wav_dir = options.has("diff_dir") ? options.get<string>("diff_dir") : string(IDIR);
+        const string only = options.has("diff_only") ? options.get<string>("diff_only") : string();
+        const int failures = run_diff_test(wav_dir.c_str(), only);
+
+        cleanup();
+        return failures == 0 ? 0 : 1;
+    }
+
+    /* long-running mode, jobs come from a socket and/or a spool directory */
+    if (options.has("socket") || options.has("spool"))
+    {
+        int r = 0;
+
+        server = new FpidServer();
+
+        if (options.has("socket"))
+        {
+            r |= server->listen_socket(options.get<string>("socket").c_str());
+            printf("Socket: %s \n", options.get<string>("socket").c_str());
+        }
+        if (options.has("spool"))
+        {
+            const unsigned int poll_ms = options.has("spool_poll_ms") ? options.get<unsigned int>("spool_poll_ms") : 200;
+
+            r |= server->watch_spool(options.get<string>("spool").c_str(), poll_ms);
+            printf("Spool: %s \n", options.get<string>("spool").c_str());
+        }
+        /* a batch of jobs fills one kernel launch with --batch */
+        server->set_batching(batch_size > 0 ? batch_size : 16,
+                             options.has("batch_wait_ms") ? options.get<double>("batch_wait_ms") : 5.0);
+
+        if (r == 0)
+        {
+            r = serve();
+        }
+
+        delete server;
+        server = NULL;
+        cleanup();
+        return r == 0 ? 0 : 1;
+    }
     
     DIR *dir = NULL;
     struct dirent *ep;
-    char ifpath[256];
-    char ofpath[256];
     char csvpath[256];
     FILE *ifp = NULL;
-    FILE *ofp = NULL;
     FILE *csvfp = NULL;
 
     dir = opendir(IDIR);
     ASSERT(dir != NULL);
 
-    while ((ep = readdir(dir)) != NULL && song_id < MAX_SONGS)
+    while ((ep = readdir(dir)) != NULL && song_names.size() < MAX_SONGS)
     {
         if (ep->d_type == DT_REG)
         {
-            sprintf(ifpath, "%s/%s",     IDIR, ep->d_name);
-            sprintf(ofpath, "%s/%s.raw", ODIR, ep->d_name);
-
             song_names.push_back(ep->d_name);
+        }
+    }
+
+    closedir(dir);
+    dir = NULL;
+
+    sort(song_names.begin(), song_names.end());
+
+    ASSERT(open_report(csvpath) == 0);
+
+    run_stats.start();
+
+    if (multi_device)
+    {
+        run_multi_device();
+    }
+    else if (batch_size > 0)
+    {
+        run_batched();
+    }
+    else if (num_slots > 0)
+    {
+        if (prefetch_depth > 0)
+        {
+            init_prefetcher(num_slots + prefetch_depth);
+        }
+        init_slots();
+        run_pipelined();
+    }
+    else if (prefetch_depth > 0)
+    {
+        init_prefetcher(1 + prefetch_depth);
+
+        for (song_id = 0; song_id < (int)song_names.size(); song_id++)
+        {
+            int r;
+            short int *wave = prefetcher->acquire(song_id, &r);
+
+            /* the buffer goes back to the loaders either way */
+            if (r != 0)
+            {
+                prefetcher->release(song_id);
+                fail_song(song_names[song_id].c_str(), total_time.size());
+                continue;
+            }
 
-            ifp = fopen(ifpath, "rb+");
-            ASSERT(ifp != NULL);
+            run(wave);
+            prefetcher->release(song_id);
+            save_song_fpid(song_id, fpid);
+            report_song(song_names[song_id].c_str(), total_time.size() - 1);
+        }
+    }
+    else
+    {
+        for (song_id = 0; song_id < (int)song_names.size(); song_id++)
+        {
+            ifp = open_song(song_id);
 
-            ofp = fopen(ofpath, "wb");
-            ASSERT(ofp != NULL);
+            /* a song that cannot be loaded is reported and skipped */
+            if (ifp == NULL || init_problem(ifp, NULL) != 0)
+            {
+                fail_song(song_names[song_id].c_str(), total_time.size());
+            }
+            else
+            {
+                run(wave16);
+                save_song_fpid(song_id, fpid);
+                report_song(song_names[song_id].c_str(), total_time.size() - 1);
+            }
 
-            init_problem(ifp, ofp);
-            run();
-            save_fp_to_disk(ofp, fpid);
-            
             if (ifp != NULL) {
                 fclose(ifp);
                 ifp = NULL;
             }
-
-            if (ofp != NULL) {
-                fclose(ofp);
-                ofp = NULL;
-            }
-            
-            song_id++;
         }
     }
 
+    if (store.close() != 0)
+    {
+        printf("Failed to write fingerprint store %s\n", store_path.c_str());
+    }
+    run_stats.stop();
+
     print_executed_time();
-    
-    closedir(dir);
+    if (buffer_pool != NULL)
+    {
+        printf("\n");
+        printf("Device buffers: %u created, %u reused, %0.1f MB\n",
+               buffer_pool->num_created(), buffer_pool->num_reused(), buffer_pool->bytes_allocated() * 1e-6);
+    }
+    record_device_stats();
+    run_stats.print_summary(stdout);
+
+    printf("\n");
+    printf("Report (%s): %s \n", metrics_extension(report_format), csvpath);
+    if (report.close() != 0)
+    {
+        printf("Failed to write report %s\n", csvpath);
+    }
 
-    sprintf(csvpath, "%s/%u.csv", CSVDIR, (int) round(getCurrentTimestamp()));
-    save_csv(csvpath);
+    sprintf(csvpath, "%s/%u.json", CSVDIR, (int) round(getCurrentTimestamp()));
+    printf("Report (json): %s \n", csvpath);
+    run_stats.write_json(csvpath);
 
     cleanup();
 
+    if (num_failed_songs > 0)
+    {
+        printf("%d song(s) failed\n", (int)num_failed_songs);
+        return 1;
+    }
     return 0;
 
 err:
-    // closedir(dir);
+    if (dir != NULL) {
+        closedir(dir);
+    }
     return -1;
 }
 
@@ -169,19 +608,20 @@ err:
 void init_opencl()
 {
     cl_int status;
+    cl_device_type type = 0;
 
     printf("Initializing OpenCL \n");
 
-    // Get the OpenCL platform
+    // Get the OpenCL platform, --platform picks another (e.g. a CPU runtime)
 #ifdef __APPLE__
-    platform = findPlatform("Apple");
+    platform = findPlatform(platform_name.empty() ? "Apple" : platform_name.c_str());
 #else
     if (!setCwdToExeDir())
     {
         checkError(-1, "Failed to perform setCwdToExeDir()");
     }
 
-    platform = findPlatform("Intel");
+    platform = findPlatform(platform_name.empty() ? "Intel" : platform_name.c_str());
 #endif
     if (platform == NULL)
     {
@@ -200,8 +640,13 @@ void init_opencl()
         printf("- %s (id: %d)\n", getDeviceName(devices[i]).c_str(), devices[i]);
     }
 
-    // Choose 1st device
-    device = devices[0];
+    // Choose the --device-th device, the 1st by default
+    if (device_index >= num_devices)
+    {
+        checkError(-1, "No device %u on this platform", device_index);
+    }
+    device = devices[device_index];
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
 
     printf("\n");
     printf("Choose device:\n");
@@ -211,32 +656,16 @@ void init_opencl()
     context = clCreateContext(NULL, 1, &device, &oclContextCallback, NULL, &status);
     checkError(status, "Failed to create context");
 
-    // Create the program for all device. Use the first device as the
-    // representative device (assuming all device are of the same type).
-#ifdef __APPLE__
-    FILE *fp;
-    char *source_str;
-    size_t source_size;
-
-    fp = fopen("device/hifp.cl", "r");
-    if (!fp)
-    {
-        checkError(-1, "Failed to load kernel");
-    }
-    source_str = (char *)malloc(MAX_SOURCE_SIZE);
-    source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-    fclose(fp);
+    buffer_pool = new BufferPool(context);
 
-    program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
+    // Create the program for the device: FPGA boards (and the emulator) load
+    // the precompiled binary, other devices build the kernel source
+#ifdef __APPLE__
+    program = create_program(context, device, true);
 #else
-    printf("Using kernel binary: %s\n", binary_file.c_str());
-    program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
+    program = create_program(context, device, (type & CL_DEVICE_TYPE_ACCELERATOR) == 0);
 #endif
 
-    // Build the program that was just created.
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
-
     // Command queue.
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
@@ -249,6 +678,20 @@ void init_opencl()
     kernel[1] = clCreateKernel(program, "generate_fpid", &status);
     checkError(status, "Failed to create kernel");
 
+    if (kernel_mode != KERNEL_SPLIT)
+    {
+        fused_kernel = clCreateKernel(program, kernel_mode == KERNEL_FUSED ? "hifp_fused" : "hifp_fused_swi", &status);
+        checkError(status, "Failed to create fused kernel");
+    }
+
+    if (batch_size > 0)
+    {
+        batch_kernel[0] = clCreateKernel(program, "dwt_batch", &status);
+        checkError(status, "Failed to create dwt_batch kernel");
+        batch_kernel[1] = clCreateKernel(program, "generate_fpid_batch", &status);
+        checkError(status, "Failed to create generate_fpid_batch kernel");
+    }
+
     /* Print kernel's configuration */
     printf("\n");
     printf("Launching for device:      %d  \n", device);
@@ -270,33 +713,207 @@ void init_opencl()
 
 
 
+/*
+ * Create and build the hifp program for one device, from KERNEL_SOURCE or
+ * from the precompiled binary_file. The block geometry is fixed at build
+ * time; a precompiled binary must have been compiled with the same -D
+ * options (see README), the options are ignored for it. Source builds go
+ * through the binary cache in kernel_cache, so only the first run with a
+ * given source, geometry and device pays for the compile.
+ */
+cl_program create_program(cl_context ctx, cl_device_id dev, bool from_source)
+{
+    const double start_time = getCurrentTimestamp();
+    cl_program prog;
+    cl_int status;
+    char filter_options[128];
+    char build_options[384];
+
+    /* the filter taps come from the DWT engine, so the kernels match the CPU */
+    if (dwt_kernel_options(fp_config.wavelet, filter_options, sizeof(filter_options)) != 0)
+    {
+        checkError(-1, "No kernel options for wavelet %s", wavelet_name(fp_config.wavelet));
+    }
+    sprintf(build_options, "-DDWT_BLOCK=%u -DDWT_LEVELS=%u -DFPID_BITS=%u -DDWT_VECTOR=%d -DDWT_BLOCKS_PER_ITEM=%u -DDWT_DENSE=%d %s",
+            fp_config.block_size, fp_config.dwt_levels, fp_config.bits_per_word,
+            dwt_vector ? 1 : 0, dwt_blocks_per_item, dense_wave ? 1 : 0, filter_options);
+    printf("Build options: %s\n", build_options);
+
+    if (from_source)
+    {
+        FILE *fp;
+        char *source_str;
+        size_t source_size;
+
+        fp = fopen(KERNEL_SOURCE, "r");
+        if (!fp)
+        {
+            checkError(-1, "Failed to load kernel");
+        }
+        source_str = (char *)malloc(MAX_SOURCE_SIZE);
+        source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
+        fclose(fp);
+
+        printf("Using kernel source: %s\n", KERNEL_SOURCE);
+        prog = createProgramWithCache(ctx, dev, source_str, source_size, build_options, kernel_cache.c_str());
+        free(source_str);
+    }
+    else
+    {
+        printf("Using kernel binary: %s\n", binary_file.c_str());
+        prog = createProgramFromBinary(ctx, binary_file.c_str(), &dev, 1);
+
+        status = clBuildProgram(prog, 0, NULL, build_options, NULL, NULL);
+        checkError(status, "Failed to build program");
+    }
+
+    printf("Program ready in %0.3f ms\n", (getCurrentTimestamp() - start_time) * 1e3);
+
+    return prog;
+}
+
+
+
+/*
+ * Per-song sizes for songs of nd DWT blocks. Grows the host buffers used
+ * by run() when a song (whole-track geometry) needs more room.
+ */
+void set_geometry(unsigned int nd)
+{
+    num_dwteco = nd;
+    num_frame  = config_num_frame(&fp_config, nd);
+    num_wave   = nd * (dense_wave ? (1u << fp_config.dwt_levels) : fp_config.block_size);
+
+    global_work_size[0] = (num_dwteco + dwt_blocks_per_item - 1) / dwt_blocks_per_item;
+    global_work_size[1] = num_frame;
+
+    if (nd > host_capacity)
+    {
+        alignedFree(wave16);
+        alignedFree(fpid);
+        alignedFree(dwt);
+
+        wave16 = (short int *)alignedMalloc((size_t)num_wave * sizeof(short int));
+        fpid   = (unsigned int *)alignedMalloc((size_t)num_frame * sizeof(unsigned int));
+        dwt    = (unsigned int *)alignedMalloc((size_t)nd * sizeof(unsigned int));
+
+        host_capacity = nd;
+    }
+}
+
+
+
+/* Open a song of IDIR for reading */
+FILE *open_song(int song)
+{
+    char ifpath[256];
+
+    sprintf(ifpath, "%s/%s", IDIR, song_names[song].c_str());
+
+    return open_path(ifpath);
+}
+
+
+
+FILE *open_path(const char *path)
+{
+    const double t = getCurrentTimestamp();
+    FILE *ifp;
+
+    ifp = fopen(path, "rb");
+    run_stats.record(STAGE_OPEN, (getCurrentTimestamp() - t) * 1e3);
+
+    return ifp;
+}
+
+
+
 /* Load problem data here */
 int init_problem(FILE *ifp, FILE *ofp)
 {
+    WAVSOURCE src;
+    bool mapped = false;
+    unsigned int nd;
+    double t;
+    int r;
+
     if (num_devices == 0)
     {
         checkError(-1, "No devices");
     }
 
-    /* Load 1 wav */
-    WAVEHEADER wave_header;
+    t = getCurrentTimestamp();
+    r = open_wav_source(fileno(ifp), &src);
+    ASSERT(r == 0);
+    mapped = true;
+    run_stats.record(STAGE_PARSE, (getCurrentTimestamp() - t) * 1e3);
+
+    /* song sizes, only change with whole-track geometry; a track shorter than one word has no FPID */
+    nd = config_num_dwteco(&fp_config, &src);
+    ASSERT(nd >= 2);
+    set_geometry(nd);
 
+    /* Load 1 wav */
     /* initialize all array elements to zero */
-    memset(wave16, 0, sizeof(wave16));
-    memset(fpid, 0, sizeof(fpid));
-    // memset(plain_fpid, 0, sizeof(plain_fpid));
-    memset(dwt, 0, sizeof(dwt));
+    memset(wave16, 0, num_wave * sizeof(short int));
+    memset(fpid, 0, num_frame * sizeof(unsigned int));
+    // memset(plain_fpid, 0, num_dwteco * sizeof(unsigned int));
+    memset(dwt, 0, num_dwteco * sizeof(unsigned int));
 
     /* Load data */
-    wave_header = read_wave_header(ifp);
-    read_wav_data(ifp, wave16, wave_header);
+    t = getCurrentTimestamp();
+    r = decimate_song(&src, wave16);
+    run_stats.record(STAGE_READ, (getCurrentTimestamp() - t) * 1e3);
+    run_stats.add_song(src.map_size);
+    close_wav_source(&src);
 
-    return 0;
+    return r;
+
+err:
+    if (mapped)
+    {
+        close_wav_source(&src);
+    }
+    return -1;
+}
+
+
+
+/* Copy the samples the kernels use of one song into a host buffer of num_wave shorts */
+int load_wave(FILE *ifp, short int *wave)
+{
+    WAVSOURCE src;
+    double t;
+    int r;
+
+    t = getCurrentTimestamp();
+    r = open_wav_source(fileno(ifp), &src);
+    ASSERT(r == 0);
+    run_stats.record(STAGE_PARSE, (getCurrentTimestamp() - t) * 1e3);
+
+    t = getCurrentTimestamp();
+    r = decimate_song(&src, wave);
+    run_stats.record(STAGE_READ, (getCurrentTimestamp() - t) * 1e3);
+    run_stats.add_song(src.map_size);
+    close_wav_source(&src);
+
+    return r;
+
+err:
+    return -1;
 }
 
 
 
-void run()
+/* The samples the kernels use of one song, in the device layout */
+int decimate_song(const WAVSOURCE *src, short int *wave)
+{
+    return dense_wave ? decimate_wave_dense(src, &fp_config, wave) : decimate_wave(src, &fp_config, wave);
+}
+
+
+
+void run(const short int *wave)
 {
     const double start_time = getCurrentTimestamp();
     cl_int status;
@@ -305,53 +922,127 @@ void run()
     cl_event kernel_event[2];
 
 
-    /* Create buffer */
-    wave16_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, NUMWAVE * sizeof(short int), NULL, &status);
-    checkError(status, "Failed to create buffer for input");
-    fpid_buf   = clCreateBuffer(context, CL_MEM_READ_WRITE, NUMFRAME * sizeof(unsigned int), NULL, &status);
-    checkError(status, "Failed to create buffer for output 1 - fpid");
-    dwteco_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, NUMDWTECO * sizeof(unsigned int), NULL, &status);
-    checkError(status, "Failed to create buffer for output 3 - dwt");
-
-    
-    // Set kernel arguments.
-    /* kernel 0 */
-    unsigned argi = 0;
-    status = clSetKernelArg(kernel[0], argi++, sizeof(cl_mem), &wave16_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
-    status = clSetKernelArg(kernel[0], argi++, sizeof(cl_mem), &dwteco_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);    
-    /* kernel 1 */
-    argi = 0;
-    status = clSetKernelArg(kernel[1], argi++, sizeof(cl_mem), &dwteco_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
-    status = clSetKernelArg(kernel[1], argi++, sizeof(cl_mem), &fpid_buf);
-    checkError(status, "Failed to set argument %d", argi - 1);
+    /* Buffers from the pool, returned to it when run() returns */
+    scoped_buffer wave16_buf(buffer_pool, CL_MEM_READ_ONLY, num_wave * sizeof(short int));
+    scoped_buffer fpid_buf(buffer_pool, CL_MEM_READ_WRITE, num_frame * sizeof(unsigned int));
+    scoped_buffer dwteco_buf(buffer_pool, CL_MEM_READ_WRITE, num_dwteco * sizeof(unsigned int));
 
 
     /* Transfer data to device */
-    status = clEnqueueWriteBuffer(queue, wave16_buf, CL_FALSE, 0, NUMWAVE * sizeof(short int), wave16, 0, NULL, &write_event[0]);
+    status = clEnqueueWriteBuffer(queue, wave16_buf, CL_FALSE, 0, num_wave * sizeof(short int), wave, 0, NULL, &write_event[0]);
     checkError(status, "Failed to transfer input wav");
 
 
     /* Run kernel */
-    /* kernel 0 */
-    
+    cl_event last_event = enqueue_kernels(queue, kernel, fused_kernel, wave16_buf, dwteco_buf, fpid_buf, &write_event[0], kernel_event);
 
-    status = clEnqueueNDRangeKernel(queue,
-                                    kernel[0],
-                                    work_dim[0],
+
+    /* Read result from device */
+    status = clEnqueueReadBuffer(queue, fpid_buf, CL_FALSE, 0, num_frame * sizeof(unsigned int), fpid, 1, &last_event, &read_event[0]);
+    clWaitForEvents(1, read_event);
+
+    // debug only
+    // clWaitForEvents(1, &kernel_event[0]);
+
+
+    // Print time taken.
+    const double end_time = getCurrentTimestamp();
+
+    total_time.push_back((end_time - start_time) * 1e3);
+    write_transfer_time.push_back((double)(getStartEndTime(write_event[0]) * 1e-6));
+    read_transfer_time.push_back((double)(getStartEndTime(read_event[0]) * 1e-6));
+    dwt_kernel_time.push_back(event_time_ms(kernel_event[0]));
+    genfpid_kernel_time.push_back(event_time_ms(kernel_event[1]));
+
+
+
+    /* Release all events */
+    clReleaseEvent(kernel_event[0]);
+    if (kernel_event[1] != NULL) {
+        clReleaseEvent(kernel_event[1]);
+    }
+    clReleaseEvent(read_event[0]);
+    clReleaseEvent(write_event[0]);
+
+    /* Verify result */
+    // verify_fpid(fpid, NULL, NULL);
+}
+
+/*
+ * Enqueue the kernels selected by kernel_mode on q, after write_event:
+ * split_kernel[0] and [1] (dwt, generate_fpid) or fused, all of the context
+ * of q.
+ * kernel_event[0] is the DWT (or fused) kernel, kernel_event[1] the FPID
+ * kernel or NULL when fused. Returns the event the result read must wait on.
+ * Arguments are captured at enqueue time, so callers may pass different
+ * buffers on every call.
+ */
+cl_event enqueue_kernels(cl_command_queue q, const cl_kernel *split_kernel, cl_kernel fused, cl_mem wave_buf, cl_mem dwteco_buf, cl_mem fpid_buf, cl_event *write_event, cl_event *kernel_event)
+{
+    cl_int status;
+    unsigned argi;
+
+    kernel_event[1] = NULL;
+
+    if (kernel_mode != KERNEL_SPLIT)
+    {
+        argi = 0;
+        status = clSetKernelArg(fused, argi++, sizeof(cl_mem), &wave_buf);
+        checkError(status, "Failed to set argument %d", argi - 1);
+        status = clSetKernelArg(fused, argi++, sizeof(cl_mem), &fpid_buf);
+        checkError(status, "Failed to set argument %d", argi - 1);
+        status = clSetKernelArg(fused, argi++, sizeof(cl_uint), &num_dwteco);
+        checkError(status, "Failed to set argument %d", argi - 1);
+
+        if (kernel_mode == KERNEL_FUSED)
+        {
+            /* one work-group of bits_per_word work-items per FPID word */
+            const size_t fused_global_work_size = (size_t)num_frame * fp_config.bits_per_word;
+            const size_t fused_local_work_size  = fp_config.bits_per_word;
+
+            status = clEnqueueNDRangeKernel(q, fused, 1, NULL, &fused_global_work_size, &fused_local_work_size,
+                                            1, write_event, &kernel_event[0]);
+        }
+        else
+        {
+            status = clEnqueueTask(q, fused, 1, write_event, &kernel_event[0]);
+        }
+        checkError(status, "Failed to launch fused kernel");
+
+        return kernel_event[0];
+    }
+
+    /* kernel 0 */
+    argi = 0;
+    status = clSetKernelArg(split_kernel[0], argi++, sizeof(cl_mem), &wave_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(split_kernel[0], argi++, sizeof(cl_mem), &dwteco_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(split_kernel[0], argi++, sizeof(cl_uint), &num_dwteco);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    status = clEnqueueNDRangeKernel(q,
+                                    split_kernel[0],
+                                    work_dim[0],
                                     global_work_offset[0] == 0 ? NULL : &global_work_offset[0],
                                     global_work_size[0]   == 0 ? NULL : &global_work_size[0],
                                     local_work_size[0]    == 0 ? NULL : &local_work_size[0],
                                     num_events_in_wait_list[0],
-                                    &write_event[0],
+                                    write_event,
                                     &kernel_event[0]);
     checkError(status, "Failed to launch dwt kernel");
 
     /* kernel 1 */
-    status = clEnqueueNDRangeKernel(queue,
-                                    kernel[1],
+    argi = 0;
+    status = clSetKernelArg(split_kernel[1], argi++, sizeof(cl_mem), &dwteco_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(split_kernel[1], argi++, sizeof(cl_mem), &fpid_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(split_kernel[1], argi++, sizeof(cl_uint), &num_dwteco);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    status = clEnqueueNDRangeKernel(q,
+                                    split_kernel[1],
                                     work_dim[1],
                                     global_work_offset[1] == 0 ? NULL : &global_work_offset[1],
                                     global_work_size[1]   == 0 ? NULL : &global_work_size[1],
@@ -359,76 +1050,1159 @@ void run()
                                     num_events_in_wait_list[1],
                                     &kernel_event[0],
                                     &kernel_event[1]);
-    checkError(status, "Failed to launch gen_fpid kernel");    
+    checkError(status, "Failed to launch gen_fpid kernel");
 
+    return kernel_event[1];
+}
 
-    /* Read result from device */
-    status = clEnqueueReadBuffer(queue, fpid_buf, CL_FALSE, 0, NUMFRAME * sizeof(unsigned int), fpid, 1, &kernel_event[1], &read_event[0]);
-    clWaitForEvents(1, read_event);
 
-    // debug only
-    // clWaitForEvents(1, &kernel_event[0]);
+
+/* Profiled duration of an event in ms, 0 for a kernel that was not launched */
+double event_time_ms(cl_event event)
+{
+    if (event == NULL)
+    {
+        return 0.0;
+    }
+    return (double)(getStartEndTime(event) * 1e-6);
+}
 
 
-    // Print time taken.
+
+/* Allocate the host and device buffers of every pipeline slot once */
+void init_slots()
+{
+    cl_int status;
+
+    printf("\n");
+    printf("Pipelined mode: %u buffer set(s)\n", num_slots);
+
+    slots = new song_slot[num_slots];
+
+    for (unsigned i = 0; i < num_slots; i++)
+    {
+        song_slot *slot = &slots[i];
+
+        slot->song   = -1;
+        slot->status = 0;
+        /* with --prefetch the slot borrows the buffer of its song from the prefetcher */
+        slot->wave16 = (prefetcher != NULL) ? NULL : (short int *)alignedMalloc(num_wave * sizeof(short int));
+        slot->fpid   = (unsigned int *)alignedMalloc(num_frame * sizeof(unsigned int));
+
+        slot->wave16_buf = clCreateBuffer(context, CL_MEM_READ_ONLY, num_wave * sizeof(short int), NULL, &status);
+        checkError(status, "Failed to create buffer for input");
+        slot->fpid_buf   = clCreateBuffer(context, CL_MEM_READ_WRITE, num_frame * sizeof(unsigned int), NULL, &status);
+        checkError(status, "Failed to create buffer for output 1 - fpid");
+        slot->dwteco_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, num_dwteco * sizeof(unsigned int), NULL, &status);
+        checkError(status, "Failed to create buffer for output 3 - dwt");
+    }
+}
+
+
+
+/*
+ * Songs rotate through num_slots buffer sets. Writes go to queue_2 and
+ * kernels plus the result read to queue, chained by events, so while the
+ * device runs song k the transfer of song k+1 is in flight and the host
+ * is already reading song k+2 from disk (with 3 or more slots).
+ * A slot is only waited on when it is needed again, which keeps results
+ * in song order.
+ */
+void run_pipelined()
+{
+    const double start_time = getCurrentTimestamp();
+    const int num_songs = (int)song_names.size();
+    FILE *ifp = NULL;
+
+    for (song_id = 0; song_id < num_songs; song_id++)
+    {
+        song_slot *slot = &slots[song_id % num_slots];
+
+        if (slot->song >= 0)
+        {
+            finish_slot(slot);
+        }
+
+        slot->song = song_id;
+        slot->start_time = getCurrentTimestamp();
+
+        if (prefetcher != NULL)
+        {
+            int r;
+
+            /* a failed song keeps its buffer until finish_slot() releases it, in order */
+            slot->wave16 = prefetcher->acquire(song_id, &r);
+            slot->status = r;
+            if (slot->status == 0)
+            {
+                enqueue_slot(slot);
+            }
+            continue;
+        }
+
+        /* a song that cannot be loaded holds its slot as failed, and is retired in order */
+        memset(slot->wave16, 0, num_wave * sizeof(short int));
+        ifp = open_song(song_id);
+        slot->status = (ifp != NULL) ? load_wave(ifp, slot->wave16) : -1;
+        if (ifp != NULL)
+        {
+            fclose(ifp);
+        }
+
+        if (slot->status == 0)
+        {
+            enqueue_slot(slot);
+        }
+    }
+
+    /* drain in song order */
+    for (int i = num_songs > (int)num_slots ? num_songs - num_slots : 0; i < num_songs; i++)
+    {
+        finish_slot(&slots[i % num_slots]);
+    }
+
     const double end_time = getCurrentTimestamp();
 
-    total_time.push_back((end_time - start_time) * 1e3);
-    write_transfer_time.push_back((double)(getStartEndTime(write_event[0]) * 1e-6));
-    read_transfer_time.push_back((double)(getStartEndTime(read_event[0]) * 1e-6));
-    dwt_kernel_time.push_back((double)(getStartEndTime(kernel_event[0]) * 1e-6));
-    genfpid_kernel_time.push_back((double)(getStartEndTime(kernel_event[1]) * 1e-6));
+    printf("\n");
+    printf("Pipelined %d song(s) in %0.3f ms (%0.1f songs/s)\n",
+           num_songs, (end_time - start_time) * 1e3, num_songs / (end_time - start_time));
+    if (prefetcher != NULL)
+    {
+        printf("Waited %0.3f ms for the prefetcher\n", prefetcher->wait_time_ms());
+    }
+}
 
 
 
-    /* Release all events */
-    clReleaseEvent(kernel_event[0]);
-    clReleaseEvent(kernel_event[1]);
-    clReleaseEvent(read_event[0]);
-    clReleaseEvent(write_event[0]);
+void enqueue_slot(song_slot *slot)
+{
+    cl_int status;
 
-    /* Verify result */
-    // verify_fpid(fpid, NULL, NULL);
+    /* Transfer data to device */
+    status = clEnqueueWriteBuffer(queue_2, slot->wave16_buf, CL_FALSE, 0, num_wave * sizeof(short int), slot->wave16, 0, NULL, &slot->write_event);
+    checkError(status, "Failed to transfer input wav");
+
+    cl_event last_event = enqueue_kernels(queue, kernel, fused_kernel, slot->wave16_buf, slot->dwteco_buf, slot->fpid_buf, &slot->write_event, slot->kernel_event);
+
+    /* Read result from device */
+    status = clEnqueueReadBuffer(queue, slot->fpid_buf, CL_FALSE, 0, num_frame * sizeof(unsigned int), slot->fpid, 1, &last_event, &slot->read_event);
+    checkError(status, "Failed to read fpid");
+
+    clFlush(queue_2);
+    clFlush(queue);
 }
 
-void print_executed_time() 
+
+
+/*
+ * Wait for the song held by a slot, then record its timings and save its
+ * FPID. A song that failed to load has nothing queued and is only recorded.
+ */
+void finish_slot(song_slot *slot)
 {
-    for (int i=0; i<song_id; i++) {
-        printf("\n");
-        printf("Total time:           %0.3f ms \n", total_time[i] );
-        printf("Transfer write time:  %0.3f ms \n", write_transfer_time[i]);
-        printf("Transfer read time:   %0.3f ms \n", read_transfer_time[i]);
-        printf("Kernel time dwt:      %0.3f ms \n", dwt_kernel_time[i]);
-        printf("Kernel time gen_fpid: %0.3f ms \n", genfpid_kernel_time[i]);
+    if (slot->status != 0)
+    {
+        fail_song(song_names[slot->song].c_str(), total_time.size());
+    }
+    else
+    {
+        clWaitForEvents(1, &slot->read_event);
+
+        const double end_time = getCurrentTimestamp();
+
+        total_time.push_back((end_time - slot->start_time) * 1e3);
+        write_transfer_time.push_back((double)(getStartEndTime(slot->write_event) * 1e-6));
+        read_transfer_time.push_back((double)(getStartEndTime(slot->read_event) * 1e-6));
+        dwt_kernel_time.push_back(event_time_ms(slot->kernel_event[0]));
+        genfpid_kernel_time.push_back(event_time_ms(slot->kernel_event[1]));
+        report_song(song_names[slot->song].c_str(), total_time.size() - 1);
+
+        clReleaseEvent(slot->write_event);
+        clReleaseEvent(slot->kernel_event[0]);
+        if (slot->kernel_event[1] != NULL)
+        {
+            clReleaseEvent(slot->kernel_event[1]);
+        }
+        clReleaseEvent(slot->read_event);
+
+        save_song_fpid(slot->song, slot->fpid);
+    }
+
+    /* the write has completed, the loaders may refill the buffer */
+    if (prefetcher != NULL)
+    {
+        prefetcher->release(slot->song);
+        slot->wave16 = NULL;
+    }
+
+    slot->song = -1;
+}
+
+/*
+ * Fingerprint the songs batch_size at a time: the songs of a batch are
+ * packed back to back into one host buffer, sent with a single write,
+ * processed by one launch of each batch kernel and read back at once.
+ * Per-song times are the batch times divided by the number of songs.
+ */
+void run_batched()
+{
+    const double run_start_time = getCurrentTimestamp();
+    const int num_songs = (int)song_names.size();
+    vector<int> status(batch_size);
+    FILE *ifp = NULL;
+
+    printf("\n");
+    printf("Batched mode: %u song(s) per launch\n", batch_size);
+
+    song_batch batch;
+    init_batch(&batch);
+
+    for (int first = 0; first < num_songs; first += batch_size)
+    {
+        const double start_time = getCurrentTimestamp();
+        const cl_uint count = (num_songs - first) < (int)batch_size ? (cl_uint)(num_songs - first) : batch_size;
+
+        /* Pack the batch, a song that cannot be loaded stays zeroed and is reported as failed */
+        memset(batch.wave, 0, (size_t)count * num_wave * sizeof(short int));
+        for (cl_uint i = 0; i < count; i++)
+        {
+            ifp = open_song(first + i);
+            status[i] = (ifp != NULL) ? load_wave(ifp, &batch.wave[(size_t)i * num_wave]) : -1;
+            if (ifp != NULL)
+            {
+                fclose(ifp);
+            }
+            if (status[i] != 0)
+            {
+                memset(&batch.wave[(size_t)i * num_wave], 0, num_wave * sizeof(short int));
+            }
+        }
+
+        launch_batch(&batch, count, start_time);
+
+        for (cl_uint i = 0; i < count; i++)
+        {
+            if (status[i] != 0)
+            {
+                fail_song(song_names[first + i].c_str(), total_time.size() - count + i);
+                continue;
+            }
+            save_song_fpid(first + i, &batch.fpid[(size_t)i * num_frame]);
+            report_song(song_names[first + i].c_str(), total_time.size() - count + i);
+        }
+        song_id += count;
+    }
+
+    release_batch(&batch);
+
+    const double run_end_time = getCurrentTimestamp();
+
+    printf("\n");
+    printf("Batched %d song(s) in %0.3f ms (%0.1f songs/s)\n",
+           num_songs, (run_end_time - run_start_time) * 1e3, num_songs / (run_end_time - run_start_time));
+}
+
+
+
+/* Host and pooled device buffers for batch_size songs */
+void init_batch(song_batch *batch)
+{
+    batch->wave    = (short int *)alignedMalloc((size_t)batch_size * num_wave * sizeof(short int));
+    batch->offsets = (unsigned int *)alignedMalloc(batch_size * sizeof(unsigned int));
+    batch->fpid    = (unsigned int *)alignedMalloc((size_t)batch_size * num_frame * sizeof(unsigned int));
+
+    batch->wave_buf    = buffer_pool->acquire(CL_MEM_READ_ONLY, (size_t)batch_size * num_wave * sizeof(short int));
+    batch->offsets_buf = buffer_pool->acquire(CL_MEM_READ_ONLY, batch_size * sizeof(unsigned int));
+    batch->dwteco_buf  = buffer_pool->acquire(CL_MEM_READ_WRITE, (size_t)batch_size * num_dwteco * sizeof(unsigned int));
+    batch->fpid_buf    = buffer_pool->acquire(CL_MEM_READ_WRITE, (size_t)batch_size * num_frame * sizeof(unsigned int));
+}
+
+
+
+void release_batch(song_batch *batch)
+{
+    alignedFree(batch->wave);
+    alignedFree(batch->offsets);
+    alignedFree(batch->fpid);
+
+    buffer_pool->release(batch->wave_buf);
+    buffer_pool->release(batch->offsets_buf);
+    buffer_pool->release(batch->dwteco_buf);
+    buffer_pool->release(batch->fpid_buf);
+}
+
+
+
+/*
+ * Fingerprint the first count songs packed in batch->wave into batch->fpid
+ * with one transfer and one launch per kernel, and record their times.
+ */
+void launch_batch(song_batch *batch, cl_uint count, double start_time)
+{
+    cl_int status;
+    cl_event write_event[2];
+    cl_event kernel_event[2];
+    cl_event read_event;
+    unsigned argi;
+
+    for (cl_uint i = 0; i < count; i++)
+    {
+        batch->offsets[i] = i * num_wave;
+    }
+
+    /* Transfer data to device */
+    status = clEnqueueWriteBuffer(queue, batch->wave_buf, CL_FALSE, 0, (size_t)count * num_wave * sizeof(short int), batch->wave, 0, NULL, &write_event[0]);
+    checkError(status, "Failed to transfer batch input");
+    status = clEnqueueWriteBuffer(queue, batch->offsets_buf, CL_FALSE, 0, count * sizeof(unsigned int), batch->offsets, 0, NULL, &write_event[1]);
+    checkError(status, "Failed to transfer batch offsets");
+
+    /* kernel 0 */
+    argi = 0;
+    status = clSetKernelArg(batch_kernel[0], argi++, sizeof(cl_mem), &batch->wave_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[0], argi++, sizeof(cl_mem), &batch->offsets_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[0], argi++, sizeof(cl_mem), &batch->dwteco_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[0], argi++, sizeof(cl_uint), &count);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[0], argi++, sizeof(cl_uint), &num_dwteco);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    const size_t dwt_work_size = (size_t)count * num_dwteco;
+    status = clEnqueueNDRangeKernel(queue, batch_kernel[0], 1, NULL, &dwt_work_size, NULL, 2, write_event, &kernel_event[0]);
+    checkError(status, "Failed to launch dwt_batch kernel");
+
+    /* kernel 1 */
+    argi = 0;
+    status = clSetKernelArg(batch_kernel[1], argi++, sizeof(cl_mem), &batch->dwteco_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[1], argi++, sizeof(cl_mem), &batch->fpid_buf);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[1], argi++, sizeof(cl_uint), &count);
+    checkError(status, "Failed to set argument %d", argi - 1);
+    status = clSetKernelArg(batch_kernel[1], argi++, sizeof(cl_uint), &num_dwteco);
+    checkError(status, "Failed to set argument %d", argi - 1);
+
+    const size_t fpid_work_size = (size_t)count * num_frame;
+    status = clEnqueueNDRangeKernel(queue, batch_kernel[1], 1, NULL, &fpid_work_size, NULL, 1, &kernel_event[0], &kernel_event[1]);
+    checkError(status, "Failed to launch generate_fpid_batch kernel");
+
+    /* Read result from device */
+    status = clEnqueueReadBuffer(queue, batch->fpid_buf, CL_FALSE, 0, (size_t)count * num_frame * sizeof(unsigned int), batch->fpid, 1, &kernel_event[1], &read_event);
+    checkError(status, "Failed to read batch fpid");
+    clWaitForEvents(1, &read_event);
+
+    const double end_time = getCurrentTimestamp();
+
+    for (cl_uint i = 0; i < count; i++)
+    {
+        total_time.push_back((end_time - start_time) * 1e3 / count);
+        write_transfer_time.push_back((double)(getStartEndTime(write_event, 2) * 1e-6) / count);
+        read_transfer_time.push_back((double)(getStartEndTime(read_event) * 1e-6) / count);
+        dwt_kernel_time.push_back((double)(getStartEndTime(kernel_event[0]) * 1e-6) / count);
+        genfpid_kernel_time.push_back((double)(getStartEndTime(kernel_event[1]) * 1e-6) / count);
     }
+
+    clReleaseEvent(write_event[0]);
+    clReleaseEvent(write_event[1]);
+    clReleaseEvent(kernel_event[0]);
+    clReleaseEvent(kernel_event[1]);
+    clReleaseEvent(read_event);
 }
 
 
-void save_csv(string csvpath)
+
+/*
+ * Long-running mode: fingerprint the jobs of the server on the context set
+ * up once at start, a batch of jobs at a time, until SIGINT or SIGTERM.
+ * Queued jobs are finished before exiting.
+ */
+int serve()
 {
+    vector<FpidJob> jobs;
+    song_batch batch;
+    char csvpath[256];
+
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+
+    ASSERT(server->start() == 0);
+    ASSERT(open_report(csvpath) == 0);
+    printf("Serving, stop with SIGINT or SIGTERM \n");
+
+    if (batch_size > 0)
+    {
+        init_batch(&batch);
+    }
+
+    run_stats.start();
+    while (server->next_batch(&jobs))
+    {
+        serve_batch(jobs, &batch);
+
+        /* summarise the device times a batch at a time, a server runs for long */
+        record_device_stats();
+        total_time.clear();
+        write_transfer_time.clear();
+        read_transfer_time.clear();
+        dwt_kernel_time.clear();
+        genfpid_kernel_time.clear();
+    }
+    run_stats.stop();
+
+    if (batch_size > 0)
+    {
+        release_batch(&batch);
+    }
+
     printf("\n");
-    printf("Report (csv): %s \n", csvpath.c_str());
-    
-    csv_data c_data;
-    add_collumn(&c_data, "song_names", song_names);
-    add_collumn(&c_data, "total_time", total_time);
-    add_collumn(&c_data, "write_transfer_time", write_transfer_time);
-    add_collumn(&c_data, "read_transfer_time", read_transfer_time);
-    add_collumn(&c_data, "dwt_kernel_time", dwt_kernel_time);
-    add_collumn(&c_data, "genfpid_kernel_time", genfpid_kernel_time);
+    printf("Served %llu job(s) in %llu batch(es) \n", server->num_jobs(), server->num_batches());
+    printf("Device buffers: %u created, %u reused, %0.1f MB\n",
+           buffer_pool->num_created(), buffer_pool->num_reused(), buffer_pool->bytes_allocated() * 1e-6);
+    run_stats.print_summary(stdout);
+
+    printf("Report (%s): %s \n", metrics_extension(report_format), csvpath);
+    ASSERT(report.close() == 0);
 
-    write_csv_file_v(&c_data, csvpath);
+    sprintf(csvpath, "%s/%u.json", CSVDIR, (int) round(getCurrentTimestamp()));
+    printf("Report (json): %s \n", csvpath);
+    run_stats.write_json(csvpath);
+
+    return 0;
+
+err:
+    return -1;
 }
 
 
-void cleanup()
+
+/*
+ * One batch of jobs: with --batch in a single launch of the batch kernels,
+ * otherwise one song at a time through run(). A job whose file cannot be
+ * read gets an error, the others of its batch are not affected.
+ */
+void serve_batch(const vector<FpidJob> &jobs, song_batch *batch)
 {
-    clReleaseKernel(kernel[0]);
-    clReleaseKernel(kernel[1]);
-    clReleaseCommandQueue(queue);
-    clReleaseProgram(program);
-    clReleaseContext(context);
-    clReleaseMemObject(wave16_buf);
-    clReleaseMemObject(fpid_buf);
-    clReleaseMemObject(dwteco_buf);
+    const double start_time = getCurrentTimestamp();
+    const cl_uint count = (cl_uint)jobs.size();
+    vector<int> status(count, -1);
+    FILE *ifp;
+
+    if (batch_size == 0)
+    {
+        for (cl_uint i = 0; i < count; i++)
+        {
+            ifp = open_path(jobs[i].path.c_str());
+            if (ifp != NULL)
+            {
+                status[i] = init_problem(ifp, NULL);
+                fclose(ifp);
+            }
+            if (status[i] == 0)
+            {
+                run(wave16);
+                report_song(jobs[i].path.c_str(), total_time.size() - 1);
+            }
+            server->complete(jobs[i], status[i], fpid, num_frame);
+        }
+        return;
+    }
+
+    /* next_batch() hands out at most batch_size jobs */
+    memset(batch->wave, 0, (size_t)count * num_wave * sizeof(short int));
+    for (cl_uint i = 0; i < count; i++)
+    {
+        ifp = open_path(jobs[i].path.c_str());
+        if (ifp != NULL)
+        {
+            status[i] = load_wave(ifp, &batch->wave[(size_t)i * num_wave]);
+            fclose(ifp);
+        }
+    }
+
+    launch_batch(batch, count, start_time);
+
+    for (cl_uint i = 0; i < count; i++)
+    {
+        server->complete(jobs[i], status[i], &batch->fpid[(size_t)i * num_frame], num_frame);
+        if (status[i] == 0)
+        {
+            report_song(jobs[i].path.c_str(), total_time.size() - count + i);
+        }
+    }
+}
+
+
+
+void stop_server(int sig)
+{
+    if (server != NULL)
+    {
+        server->request_stop();
+    }
+}
+
+
+
+/*
+ * Start loading every song ahead of the device into num_buffers host
+ * buffers of num_wave shorts. The buffers are aligned like the others of
+ * this host, so the runtime can DMA from them without a staging copy.
+ */
+void init_prefetcher(unsigned int num_buffers)
+{
+    vector<string> paths;
+
+    printf("\n");
+    printf("Prefetching %u song(s) ahead with %d loader thread(s)\n", prefetch_depth, prefetch_threads);
+
+    num_prefetch_buffers = num_buffers;
+    prefetch_buffers = new short int *[num_buffers];
+    for (unsigned i = 0; i < num_buffers; i++)
+    {
+        prefetch_buffers[i] = (short int *)alignedMalloc(num_wave * sizeof(short int));
+    }
+
+    for (size_t i = 0; i < song_names.size(); i++)
+    {
+        paths.push_back(string(IDIR) + "/" + song_names[i]);
+    }
+
+    prefetcher = new WavPrefetcher(&fp_config, prefetch_buffers, num_buffers, num_wave, prefetch_threads);
+    prefetcher->set_stats(&run_stats);
+    prefetcher->set_dense(dense_wave);
+    prefetcher->start(paths);
+}
+
+
+
+/*
+ * Open every device of every platform for --multi_device: a context, the
+ * program, one queue and the kernels and buffers of one song each. FPGA
+ * boards load binary_file, the other devices (CPU runtime, GPUs) build the
+ * kernel source with the same options.
+ */
+void init_devices()
+{
+    cl_uint num_platforms = 0;
+    cl_int status;
+
+    printf("Initializing OpenCL on every device\n");
+
+#ifndef __APPLE__
+    if (!setCwdToExeDir())
+    {
+        checkError(-1, "Failed to perform setCwdToExeDir()");
+    }
+#endif
+
+    status = clGetPlatformIDs(0, NULL, &num_platforms);
+    checkError(status, "Query for number of platforms failed");
+
+    scoped_array<cl_platform_id> pids(num_platforms);
+    status = clGetPlatformIDs(num_platforms, pids, NULL);
+    checkError(status, "Query for all platform ids failed");
+
+    vector<cl_device_id> found;
+
+    for (unsigned p = 0; p < num_platforms; p++)
+    {
+        cl_uint n = 0;
+
+        /* a platform without devices is not an error */
+        if (clGetDeviceIDs(pids[p], CL_DEVICE_TYPE_ALL, 0, NULL, &n) != CL_SUCCESS || n == 0)
+        {
+            continue;
+        }
+
+        scoped_array<cl_device_id> dids(n);
+        status = clGetDeviceIDs(pids[p], CL_DEVICE_TYPE_ALL, n, dids, NULL);
+        checkError(status, "Query for device ids");
+
+        printf("\n");
+        printf("Platform: %s\n", getPlatformName(pids[p]).c_str());
+        for (unsigned i = 0; i < n; i++)
+        {
+            printf("- %s (id: %d)\n", getDeviceName(dids[i]).c_str(), dids[i]);
+            found.push_back(dids[i]);
+        }
+    }
+
+    if (found.empty())
+    {
+        checkError(-1, "No devices");
+    }
+
+    num_devices = (unsigned)found.size();
+    num_device_ctxs = num_devices;
+    device_ctxs = new device_ctx[num_device_ctxs];
+    memset(device_ctxs, 0, num_device_ctxs * sizeof(device_ctx));
+
+    for (unsigned d = 0; d < num_device_ctxs; d++)
+    {
+        device_ctx *dev = &device_ctxs[d];
+        cl_device_type type = 0;
+
+        dev->device = found[d];
+        clGetDeviceInfo(dev->device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+        printf("\n");
+        printf("Device %u: %s\n", d, getDeviceName(dev->device).c_str());
+
+        dev->context = clCreateContext(NULL, 1, &dev->device, &oclContextCallback, NULL, &status);
+        checkError(status, "Failed to create context");
+
+#ifdef __APPLE__
+        dev->program = create_program(dev->context, dev->device, true);
+#else
+        dev->program = create_program(dev->context, dev->device, (type & CL_DEVICE_TYPE_ACCELERATOR) == 0);
+#endif
+
+        dev->queue = clCreateCommandQueue(dev->context, dev->device, CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create command queue");
+
+        dev->kernel[0] = clCreateKernel(dev->program, "dwt", &status);
+        checkError(status, "Failed to create kernel");
+        dev->kernel[1] = clCreateKernel(dev->program, "generate_fpid", &status);
+        checkError(status, "Failed to create kernel");
+        if (kernel_mode != KERNEL_SPLIT)
+        {
+            dev->fused_kernel = clCreateKernel(dev->program, kernel_mode == KERNEL_FUSED ? "hifp_fused" : "hifp_fused_swi", &status);
+            checkError(status, "Failed to create fused kernel");
+        }
+
+        dev->wave16 = (short int *)alignedMalloc(num_wave * sizeof(short int));
+        dev->fpid   = (unsigned int *)alignedMalloc(num_frame * sizeof(unsigned int));
+
+        dev->wave16_buf = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, num_wave * sizeof(short int), NULL, &status);
+        checkError(status, "Failed to create buffer for input");
+        dev->fpid_buf   = clCreateBuffer(dev->context, CL_MEM_READ_WRITE, num_frame * sizeof(unsigned int), NULL, &status);
+        checkError(status, "Failed to create buffer for output 1 - fpid");
+        dev->dwteco_buf = clCreateBuffer(dev->context, CL_MEM_READ_WRITE, num_dwteco * sizeof(unsigned int), NULL, &status);
+        checkError(status, "Failed to create buffer for output 3 - dwt");
+    }
+}
+
+
+
+/*
+ * One host thread per device pulls songs from a shared counter, so every
+ * device takes songs at the rate it finishes them. Results land in
+ * song_fpids and the per-song time vectors at the index of their song;
+ * this thread saves them in song order as soon as each one is done, so
+ * the output is the same whichever device fingerprinted a song.
+ */
+void run_multi_device()
+{
+    const double start_time = getCurrentTimestamp();
+    const int num_songs = (int)song_names.size();
+    vector<thread> workers;
+
+    printf("\n");
+    printf("Multi-device mode: %u device(s)\n", num_device_ctxs);
+
+    next_song = 0;
+    song_done.assign(num_songs, 0);
+    song_failed.assign(num_songs, 0);
+    song_fpids.assign((size_t)num_songs * num_frame, 0);
+
+    total_time.resize(num_songs);
+    write_transfer_time.resize(num_songs);
+    read_transfer_time.resize(num_songs);
+    dwt_kernel_time.resize(num_songs);
+    genfpid_kernel_time.resize(num_songs);
+
+    for (unsigned d = 0; d < num_device_ctxs; d++)
+    {
+        workers.push_back(thread(device_worker, d));
+    }
+
+    for (song_id = 0; song_id < num_songs; song_id++)
+    {
+        bool failed;
+
+        {
+            unique_lock<mutex> guard(sched_lock);
+
+            song_done_cv.wait(guard, [] { return song_done[song_id] != 0; });
+            failed = song_failed[song_id] != 0;
+        }
+
+        if (!failed)
+        {
+            save_song_fpid(song_id, &song_fpids[(size_t)song_id * num_frame]);
+        }
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    const double end_time = getCurrentTimestamp();
+
+    printf("\n");
+    printf("Fingerprinted %d song(s) on %u device(s) in %0.3f ms (%0.1f songs/s)\n",
+           num_songs, num_device_ctxs, (end_time - start_time) * 1e3, num_songs / (end_time - start_time));
+    for (unsigned d = 0; d < num_device_ctxs; d++)
+    {
+        const device_ctx *dev = &device_ctxs[d];
+
+        printf("- device %u: %d song(s), %0.3f ms per song\n",
+               d, dev->num_songs, dev->num_songs > 0 ? dev->busy_time / dev->num_songs : 0.0);
+    }
+}
+
+
+
+/* Fingerprint the songs pull_song() hands to device d, one at a time */
+void device_worker(unsigned d)
+{
+    device_ctx *dev = &device_ctxs[d];
+    cl_int status;
+    cl_event write_event;
+    cl_event kernel_event[2];
+    cl_event read_event;
+    FILE *ifp;
+    int song;
+
+    while ((song = pull_song(d)) >= 0)
+    {
+        const double start_time = getCurrentTimestamp();
+
+        ifp = open_song(song);
+        memset(dev->wave16, 0, num_wave * sizeof(short int));
+        if (ifp == NULL || load_wave(ifp, dev->wave16) != 0)
+        {
+            /* the other workers keep going, the song is reported as failed */
+            if (ifp != NULL)
+            {
+                fclose(ifp);
+            }
+            fail_song(song_names[song].c_str(), song);
+
+            {
+                lock_guard<mutex> guard(sched_lock);
+
+                song_failed[song] = 1;
+                song_done[song] = 1;
+            }
+            song_done_cv.notify_all();
+            continue;
+        }
+        fclose(ifp);
+
+        /* Transfer data to device */
+        status = clEnqueueWriteBuffer(dev->queue, dev->wave16_buf, CL_FALSE, 0, num_wave * sizeof(short int), dev->wave16, 0, NULL, &write_event);
+        checkError(status, "Failed to transfer input wav");
+
+        cl_event last_event = enqueue_kernels(dev->queue, dev->kernel, dev->fused_kernel, dev->wave16_buf, dev->dwteco_buf, dev->fpid_buf, &write_event, kernel_event);
+
+        /* Read result from device */
+        status = clEnqueueReadBuffer(dev->queue, dev->fpid_buf, CL_FALSE, 0, num_frame * sizeof(unsigned int), dev->fpid, 1, &last_event, &read_event);
+        checkError(status, "Failed to read fpid");
+        clWaitForEvents(1, &read_event);
+
+        const double end_time = getCurrentTimestamp();
+
+        /* every song has its own index, no other thread writes it */
+        total_time[song] = (end_time - start_time) * 1e3;
+        write_transfer_time[song] = (double)(getStartEndTime(write_event) * 1e-6);
+        read_transfer_time[song] = (double)(getStartEndTime(read_event) * 1e-6);
+        dwt_kernel_time[song] = event_time_ms(kernel_event[0]);
+        genfpid_kernel_time[song] = event_time_ms(kernel_event[1]);
+        report_song(song_names[song].c_str(), song);
+        memcpy(&song_fpids[(size_t)song * num_frame], dev->fpid, num_frame * sizeof(unsigned int));
+
+        clReleaseEvent(write_event);
+        clReleaseEvent(kernel_event[0]);
+        if (kernel_event[1] != NULL)
+        {
+            clReleaseEvent(kernel_event[1]);
+        }
+        clReleaseEvent(read_event);
+
+        {
+            lock_guard<mutex> guard(sched_lock);
+
+            dev->num_songs++;
+            dev->busy_time += total_time[song];
+            song_done[song] = 1;
+        }
+        song_done_cv.notify_all();
+    }
+}
+
+
+
+/*
+ * Next song for device d, -1 when it should stop. Near the end of the run
+ * a device that is slower than the fastest one stops taking songs once the
+ * other devices, at their measured rates, would finish everything left
+ * before it finished one more song, so a slow device (e.g. the CPU runtime
+ * next to FPGA boards) does not hold up the last song. Only devices still
+ * taking songs count, and the fastest of them never stops early, so the
+ * last device running takes every song left.
+ */
+int pull_song(unsigned d)
+{
+    lock_guard<mutex> guard(sched_lock);
+    device_ctx *dev = &device_ctxs[d];
+    const int remaining = (int)song_names.size() - next_song;
+
+    if (remaining <= 0)
+    {
+        dev->stopped = true;
+        return -1;
+    }
+
+    if (dev->num_songs > 0)
+    {
+        const double ms_per_song = dev->busy_time / dev->num_songs;
+        double others_rate = 0.0;  /* songs per ms of the other measured devices */
+        bool fastest = true;
+
+        for (unsigned e = 0; e < num_device_ctxs; e++)
+        {
+            const device_ctx *other = &device_ctxs[e];
+
+            if (e == d || other->stopped || other->num_songs == 0 || other->busy_time <= 0.0)
+            {
+                continue;
+            }
+            others_rate += other->num_songs / other->busy_time;
+            if (other->busy_time / other->num_songs < ms_per_song)
+            {
+                fastest = false;
+            }
+        }
+
+        if (!fastest && others_rate > 0.0 && remaining / others_rate < ms_per_song)
+        {
+            dev->stopped = true;
+            return -1;
+        }
+    }
+
+    return next_song++;
+}
+
+
+
+/*
+ * Differential test of the selected kernels against the CPU reference
+ * (gen_fpid_config) with the current geometry. Every synthetic signal is
+ * fingerprinted as mono and as stereo, then every WAV of wav_dir; a case
+ * fails on the first FPID word that differs. A non-empty only runs just the
+ * cases whose name starts with it. Returns the number of failed cases.
+ */
+int run_diff_test(const char *wav_dir, const string &only)
+{
+    /* a few complete words and a partial one for whole tracks */
+    const unsigned int num_samples = (fp_config.num_wave != 0) ?
+        fp_config.num_wave + 3 * fp_config.block_size :
+        fp_config.block_size * (5 * fp_config.bits_per_word + 7) + 5;
+    vector<string> names;
+    vector<short int> pcm;
+    WAVSOURCE src;
+    DIR *dir;
+    struct dirent *ep;
+    char ifpath[256];
+    FILE *ifp;
+    int num_cases = 0;
+    int failures = 0;
+
+    printf("\n");
+    printf("Differential test: %s kernels against the CPU reference\n",
+           kernel_mode == KERNEL_SPLIT ? "split" : (kernel_mode == KERNEL_FUSED ? "fused" : "fused_swi"));
+
+    for (int signal = 0; signal < NUM_TEST_SIGNALS; signal++)
+    {
+        for (unsigned int numch = 1; numch <= 2; numch++)
+        {
+            const string name = string(test_signal_name(signal)) + (numch == 1 ? " (mono)" : " (stereo)");
+
+            if (name.compare(0, only.size(), only) != 0)
+            {
+                continue;
+            }
+            make_test_source(signal, numch, num_samples, (unsigned int)signal, &pcm, &src);
+            if (fp_config.sample_rate != 0)
+            {
+                src.header.SampleRate = fp_config.sample_rate;
+            }
+
+            failures += diff_test_case(name, &src);
+            num_cases++;
+        }
+    }
+
+    dir = opendir(wav_dir);
+    if (dir != NULL)
+    {
+        while ((ep = readdir(dir)) != NULL)
+        {
+            if (ep->d_type == DT_REG && string(ep->d_name).compare(0, only.size(), only) == 0)
+            {
+                names.push_back(ep->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    sort(names.begin(), names.end());
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        sprintf(ifpath, "%s/%s", wav_dir, names[i].c_str());
+
+        ifp = fopen(ifpath, "rb");
+        if (ifp == NULL || open_wav_source(fileno(ifp), &src) != 0)
+        {
+            printf("%-24s : not a WAV file, skipped\n", names[i].c_str());
+            if (ifp != NULL)
+            {
+                fclose(ifp);
+            }
+            continue;
+        }
+
+        failures += diff_test_case(names[i], &src);
+        num_cases++;
+
+        close_wav_source(&src);
+        fclose(ifp);
+    }
+
+    printf("\n");
+    printf("%d of %d case(s) failed\n", failures, num_cases);
+
+    return failures;
+}
+
+
+
+/* One differential test case, returns 1 when the device disagrees with the CPU */
+int diff_test_case(const string &name, const WAVSOURCE *src)
+{
+    vector<unsigned int> expected;
+    int k;
+
+    set_geometry(config_num_dwteco(&fp_config, src));
+    expected.assign(num_frame, 0);
+
+    if (num_dwteco < 2 || gen_fpid_config(src, &fp_config, &expected[0]) != 0)
+    {
+        printf("%-24s : no fingerprint with this geometry, skipped\n", name.c_str());
+        return 0;
+    }
+
+    memset(wave16, 0, num_wave * sizeof(short int));
+    decimate_song(src, wave16);
+
+    /* a result that is never read back cannot pass */
+    memset(fpid, 0xA5, num_frame * sizeof(unsigned int));
+    run(wave16);
+
+    k = first_fpid_mismatch(&expected[0], fpid, num_frame);
+    if (k < 0)
+    {
+        printf("%-24s : OK, %u word(s)\n", name.c_str(), num_frame);
+        return 0;
+    }
+
+    printf("%-24s : MISMATCH at word %d of %u, CPU 0x%08x, device 0x%08x\n",
+           name.c_str(), k, num_frame, expected[k], fpid[k]);
+    return 1;
+}
+
+
+
+/* Save the FPID of a song to the store with --store, else to ODIR/<song>.raw */
+void save_song_fpid(int song, const unsigned int *song_fpid)
+{
+    const double t = getCurrentTimestamp();
+    char ofpath[256];
+    FILE *ofp = NULL;
+
+    if (!store_path.empty())
+    {
+        store.append(song_names[song], song_fpid, 1);
+    }
+    else
+    {
+        sprintf(ofpath, "%s/%s.raw", ODIR, song_names[song].c_str());
+        ofp = fopen(ofpath, "wb");
+        if (ofp != NULL)
+        {
+            save_fp_to_disk(ofp, song_fpid, num_frame);
+            fclose(ofp);
+        }
+    }
+
+    run_stats.record(STAGE_WRITE, (getCurrentTimestamp() - t) * 1e3);
+}
+
+
+
+void print_executed_time() 
+{
+    for (int i=0; i<song_id; i++) {
+        printf("\n");
+        printf("Total time:           %0.3f ms \n", total_time[i] );
+        printf("Transfer write time:  %0.3f ms \n", write_transfer_time[i]);
+        printf("Transfer read time:   %0.3f ms \n", read_transfer_time[i]);
+        printf("Kernel time dwt:      %0.3f ms \n", dwt_kernel_time[i]);
+        printf("Kernel time gen_fpid: %0.3f ms \n", genfpid_kernel_time[i]);
+    }
+}
+
+
+/* Per-song device times into the histograms, transfers and kernels summed per song */
+void record_device_stats()
+{
+    for (size_t i = 0; i < total_time.size(); i++)
+    {
+        /* failed songs have no times */
+        if (isnan(total_time[i]))
+        {
+            continue;
+        }
+        run_stats.record(STAGE_TRANSFER, write_transfer_time[i] + read_transfer_time[i]);
+        run_stats.record(STAGE_KERNEL, dwt_kernel_time[i] + genfpid_kernel_time[i]);
+        run_stats.record(STAGE_SONG, total_time[i]);
+    }
+}
+
+
+/* Start the per-song report, its path goes to path */
+int open_report(char *path)
+{
+    vector<string> columns;
+
+    columns.push_back("total_time");
+    columns.push_back("write_transfer_time");
+    columns.push_back("read_transfer_time");
+    columns.push_back("dwt_kernel_time");
+    columns.push_back("genfpid_kernel_time");
+
+    sprintf(path, "%s/%u.%s", CSVDIR, (int) round(getCurrentTimestamp()), metrics_extension(report_format));
+
+    return report.open(path, report_format, "song_names", columns);
+}
+
+
+/* Append entry i of the per-song times to the report */
+void report_song(const char *name, size_t i)
+{
+    const double values[5] = {
+        total_time[i], write_transfer_time[i], read_transfer_time[i], dwt_kernel_time[i], genfpid_kernel_time[i]
+    };
+
+    report.add_row(name, values);
+}
+
+
+/*
+ * Record a song that could not be fingerprinted: NaN in entry i of the
+ * per-song times (appended when i is their size) and in its report row.
+ * Called from the device threads of --multi_device with their own i.
+ */
+void fail_song(const char *name, size_t i)
+{
+    if (i == total_time.size())
+    {
+        total_time.resize(i + 1);
+        write_transfer_time.resize(i + 1);
+        read_transfer_time.resize(i + 1);
+        dwt_kernel_time.resize(i + 1);
+        genfpid_kernel_time.resize(i + 1);
+    }
+    total_time[i] = NAN;
+    write_transfer_time[i] = NAN;
+    read_transfer_time[i] = NAN;
+    dwt_kernel_time[i] = NAN;
+    genfpid_kernel_time[i] = NAN;
+
+    report_song(name, i);
+    printf("%s : failed \n", name);
+    num_failed_songs++;
+}
+
+
+void cleanup()
+{
+    /* every buffer the pool created, before their context */
+    delete buffer_pool;
+    buffer_pool = NULL;
+
+    if (context != NULL) {
+        clReleaseKernel(kernel[0]);
+        clReleaseKernel(kernel[1]);
+        if (fused_kernel != NULL) {
+            clReleaseKernel(fused_kernel);
+        }
+        if (batch_kernel[0] != NULL) {
+            clReleaseKernel(batch_kernel[0]);
+            clReleaseKernel(batch_kernel[1]);
+        }
+        clReleaseCommandQueue(queue);
+        clReleaseCommandQueue(queue_2);
+        clReleaseProgram(program);
+        clReleaseContext(context);
+    }
+    alignedFree(wave16);
+    alignedFree(fpid);
+    alignedFree(dwt);
+
+    for (unsigned i = 0; i < num_slots && slots != NULL; i++)
+    {
+        alignedFree(slots[i].wave16);
+        alignedFree(slots[i].fpid);
+        clReleaseMemObject(slots[i].wave16_buf);
+        clReleaseMemObject(slots[i].fpid_buf);
+        clReleaseMemObject(slots[i].dwteco_buf);
+    }
+    delete[] slots;
+    slots = NULL;
+
+    for (unsigned d = 0; d < num_device_ctxs && device_ctxs != NULL; d++)
+    {
+        device_ctx *dev = &device_ctxs[d];
+
+        alignedFree(dev->wave16);
+        alignedFree(dev->fpid);
+        if (dev->wave16_buf != NULL) {
+            clReleaseMemObject(dev->wave16_buf);
+            clReleaseMemObject(dev->fpid_buf);
+            clReleaseMemObject(dev->dwteco_buf);
+        }
+        if (dev->fused_kernel != NULL) {
+            clReleaseKernel(dev->fused_kernel);
+        }
+        if (dev->kernel[0] != NULL) {
+            clReleaseKernel(dev->kernel[0]);
+            clReleaseKernel(dev->kernel[1]);
+        }
+        if (dev->queue != NULL) {
+            clReleaseCommandQueue(dev->queue);
+        }
+        if (dev->program != NULL) {
+            clReleaseProgram(dev->program);
+        }
+        if (dev->context != NULL) {
+            clReleaseContext(dev->context);
+        }
+    }
+    delete[] device_ctxs;
+    device_ctxs = NULL;
+
+    delete prefetcher;
+    prefetcher = NULL;
+    for (unsigned i = 0; i < num_prefetch_buffers; i++)
+    {
+        alignedFree(prefetch_buffers[i]);
+    }
+    delete[] prefetch_buffers;
+    prefetch_buffers = NULL;
 }
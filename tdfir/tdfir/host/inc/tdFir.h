@@ -50,6 +50,8 @@ struct tdFirVariables{
   int   resultLength;
   int   arguments;
   int   dataSet;
+  int   numThreads;   // CPU worker threads, 0 for one per CPU
+  int   chunkLength;  // CPU result points per work item, 0 for the default
 };
 
 void tdFirSetup(struct tdFirVariables *tdFirVars);
@@ -72,9 +72,13 @@ void cleanup();
 int main(int argc, char **argv)
 {
   struct tdFirVariables tdFirVars;
+  Options options(argc, argv);
+  bool runOnFPGA = RUN_ON_FPGA && !options.has("cpu");
 
   tdFirVars.arguments = 1;
   tdFirVars.dataSet = 1;
+  tdFirVars.numThreads = options.has("threads") ? options.get<int>("threads") : 0;
+  tdFirVars.chunkLength = options.has("chunk") ? options.get<int>("chunk") : 0;
 
   if(!setCwdToExeDir()) {
     return -1;
@@ -100,17 +104,20 @@ int main(int argc, char **argv)
   */
   tdFirSetup(&tdFirVars);
 
-  if (RUN_ON_FPGA)
+  if (runOnFPGA && !initFPGA())
+  {
+    printf("No FPGA available, running on the CPU.\n");
+    runOnFPGA = false;
+  }
+
+  if (runOnFPGA)
   {
     // Perform FIR computation on FPGA
-    if(!initFPGA()) {
-      return -1;
-    }
     tdFirFPGA(&tdFirVars);
   }
   else
   {
-    // Perform FIR computation on CPU
+    // Perform FIR computation on CPU (tdFirCPU.cpp)
     tdFirCPU(&tdFirVars);
   }
 
@@ -174,60 +181,6 @@ void tdFirSetup(struct tdFirVariables *tdFirVars)
   zeroData(tdFirVars->result.data, resultLength, tdFirVars->numFilters);
 }
 
-/*
- * This is the original Time Domain FIR Filter implementation to be
- * executed on CPU
- */
-void tdFirCPU(struct tdFirVariables *tdFirVars)
-{
-  int index;
-  int filter;
-  float * inputPtr  = tdFirVars->input.data;
-  float * filterPtr = tdFirVars->filter.data;
-  float * resultPtr = tdFirVars->result.data;
-  float * inputPtrSave  = tdFirVars->input.data;
-  float * filterPtrSave = tdFirVars->filter.data;
-  float * resultPtrSave = tdFirVars->result.data;
-  int  filterLength = tdFirVars->filterLength;
-  int  inputLength  = tdFirVars->inputLength;
-  int  resultLength = filterLength + inputLength - 1;
-  double startTime = getCurrentTimestamp();
-  double stopTime = 0.0f;
-
-  for(filter = 0; filter < tdFirVars->numFilters; filter++)
-  {
-    inputPtr  = inputPtrSave  + (filter * (2*inputLength));
-    filterPtr = filterPtrSave + (filter * (2*filterLength));
-    resultPtr = resultPtrSave + (filter * (2*resultLength));
-
-    /*
-    	elCplxMul does an element wise multiply of the current filter element by
-    	the entire input vector.
-    	Input Parameters:
-    	tdFirVars->input.data  - pointer to input
-    	tdFirVars->filter.data - pointer to filter
-    	tdFirVars->result.data - pointer to result space
-    	tdFirVars->inputLength - integer value representing length of input
-     */
-    for(index = 0; index < filterLength; index++)
-	  {
-  	  elCplxMul(inputPtr, filterPtr, resultPtr, tdFirVars->inputLength);
-  	  resultPtr+=2;
-  	  filterPtr+=2;
-  	}/* end for filterLength*/
-  }/* end for each filter */
-
-  /*
-    Stop the timer.  Print out the
-    total time in Seconds it took to do the TDFIR.
-  */
-  stopTime = getCurrentTimestamp();
-  tdFirVars->time.data[0] = stopTime - startTime;
-
-  printf("Done.\n  Latency: %f s.\n", tdFirVars->time.data[0]);
-  printf("  Throughput: %.3f GFLOPs.\n", 268.44f / tdFirVars->time.data[0] / 1000.0f );
-}
-
 /*
   elCplxMul does an element wise multiply of the current filter element by
   the entire input vector.
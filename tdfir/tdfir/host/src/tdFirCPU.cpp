@@ -0,0 +1,530 @@
+/******************************************************************************
+** File: tdFirCPU.cpp
+**
+** HPEC Challenge Benchmark Suite
+** TDFIR Kernel Benchmark
+**
+** Contents: This file provides the CPU implementation of the TDFIR filter
+**           bank, run with -cpu or when no FPGA is available.
+**
+**           Each filter is computed from a split real/imaginary copy of its
+**           input, zero-padded by filterLength - 1 points on both sides, and
+**           of its taps in reverse order, so that result point n is the dot
+**           product of the taps with padded points n .. n + filterLength - 1.
+**           A block of result points is accumulated in registers over all
+**           the taps and stored once: the result is written once per filter
+**           instead of being re-read and re-written once per tap, as with
+**           elCplxMul().
+**
+**           The block kernel is selected at runtime: AVX-512, AVX2 with FMA,
+**           or portable C. The filters, and chunks of long inputs, are
+**           computed in parallel by a pool of worker threads (-threads=<N>,
+**           -chunk=<points>), each on data it allocated itself.
+**
+******************************************************************************/
+
+#include "tdFir.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "AOCLUtils/aocl_utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TDFIR_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace aocl_utils;
+
+#define TDFIR_CHUNK_LENGTH 16384  // default result points per work item
+
+/*
+  A block kernel computes numBlocks blocks of blockLength result points.
+  xr/xi are the padded input, hr/hi the reversed taps.
+ */
+typedef void (*firBlocksFn)(const float *xr, const float *xi,
+                            const float *hr, const float *hi, int filterLength,
+                            float *yr, float *yi, int numBlocks);
+
+struct firKernel {
+  const char *name;
+  int         blockLength;  // result points per block
+  firBlocksFn blocks;
+};
+
+
+/* Portable C: 8 points per block, left to the compiler to vectorise */
+static void firBlocksScalar(const float *xr, const float *xi,
+                            const float *hr, const float *hi, int filterLength,
+                            float *yr, float *yi, int numBlocks)
+{
+  for(int n = 0; n < 8 * numBlocks; n += 8)
+  {
+    float accr[8] = {0};
+    float acci[8] = {0};
+
+    for(int k = 0; k < filterLength; k++)
+    {
+      for(int i = 0; i < 8; i++)
+      {
+        accr[i] += hr[k] * xr[n + k + i] - hi[k] * xi[n + k + i];
+        acci[i] += hr[k] * xi[n + k + i] + hi[k] * xr[n + k + i];
+      }
+    }
+    memcpy(&yr[n], accr, sizeof(accr));
+    memcpy(&yi[n], acci, sizeof(acci));
+  }
+}
+
+
+#ifdef TDFIR_X86
+
+/*
+  AVX2/FMA: 32 points per block in 4 + 4 accumulators, which leaves enough
+  independent FMA chains to hide their latency. Per tap: 2 broadcasts,
+  8 loads and 16 FMAs.
+ */
+__attribute__((target("avx2,fma")))
+static void firBlocksAvx2(const float *xr, const float *xi,
+                          const float *hr, const float *hi, int filterLength,
+                          float *yr, float *yi, int numBlocks)
+{
+  for(int n = 0; n < 32 * numBlocks; n += 32)
+  {
+    __m256 accr[4];
+    __m256 acci[4];
+
+    #pragma GCC unroll 4
+    for(int i = 0; i < 4; i++)
+    {
+      accr[i] = _mm256_setzero_ps();
+      acci[i] = _mm256_setzero_ps();
+    }
+
+    for(int k = 0; k < filterLength; k++)
+    {
+      const __m256 fr = _mm256_broadcast_ss(&hr[k]);
+      const __m256 fi = _mm256_broadcast_ss(&hi[k]);
+
+      #pragma GCC unroll 4
+      for(int i = 0; i < 4; i++)
+      {
+        const __m256 dr = _mm256_loadu_ps(&xr[n + k + 8 * i]);
+        const __m256 di = _mm256_loadu_ps(&xi[n + k + 8 * i]);
+
+        accr[i] = _mm256_fmadd_ps(fr, dr, accr[i]);
+        accr[i] = _mm256_fnmadd_ps(fi, di, accr[i]);
+        acci[i] = _mm256_fmadd_ps(fr, di, acci[i]);
+        acci[i] = _mm256_fmadd_ps(fi, dr, acci[i]);
+      }
+    }
+
+    #pragma GCC unroll 4
+    for(int i = 0; i < 4; i++)
+    {
+      _mm256_store_ps(&yr[n + 8 * i], accr[i]);
+      _mm256_store_ps(&yi[n + 8 * i], acci[i]);
+    }
+  }
+}
+
+/* AVX-512: the same with 64 points per block */
+__attribute__((target("avx512f")))
+static void firBlocksAvx512(const float *xr, const float *xi,
+                            const float *hr, const float *hi, int filterLength,
+                            float *yr, float *yi, int numBlocks)
+{
+  for(int n = 0; n < 64 * numBlocks; n += 64)
+  {
+    __m512 accr[4];
+    __m512 acci[4];
+
+    #pragma GCC unroll 4
+    for(int i = 0; i < 4; i++)
+    {
+      accr[i] = _mm512_setzero_ps();
+      acci[i] = _mm512_setzero_ps();
+    }
+
+    for(int k = 0; k < filterLength; k++)
+    {
+      const __m512 fr = _mm512_set1_ps(hr[k]);
+      const __m512 fi = _mm512_set1_ps(hi[k]);
+
+      #pragma GCC unroll 4
+      for(int i = 0; i < 4; i++)
+      {
+        const __m512 dr = _mm512_loadu_ps(&xr[n + k + 16 * i]);
+        const __m512 di = _mm512_loadu_ps(&xi[n + k + 16 * i]);
+
+        accr[i] = _mm512_fmadd_ps(fr, dr, accr[i]);
+        accr[i] = _mm512_fnmadd_ps(fi, di, accr[i]);
+        acci[i] = _mm512_fmadd_ps(fr, di, acci[i]);
+        acci[i] = _mm512_fmadd_ps(fi, dr, acci[i]);
+      }
+    }
+
+    #pragma GCC unroll 4
+    for(int i = 0; i < 4; i++)
+    {
+      _mm512_store_ps(&yr[n + 16 * i], accr[i]);
+      _mm512_store_ps(&yi[n + 16 * i], acci[i]);
+    }
+  }
+}
+
+#endif /* TDFIR_X86 */
+
+
+/* The widest block kernel this CPU supports */
+static firKernel selectFirKernel()
+{
+  firKernel kernel = { "scalar", 8, firBlocksScalar };
+
+#ifdef TDFIR_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+  {
+    kernel.name = "avx512";
+    kernel.blockLength = 64;
+    kernel.blocks = firBlocksAvx512;
+  }
+  else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    kernel.name = "avx2";
+    kernel.blockLength = 32;
+    kernel.blocks = firBlocksAvx2;
+  }
+#endif
+
+  return kernel;
+}
+
+/*
+  Worker threads that run one task at a time, each thread pinned to its own
+  CPU so that the memory it touches first is allocated on its NUMA node.
+ */
+class firThreadPool {
+public:
+  explicit firThreadPool(int numThreads);
+  ~firThreadPool();
+
+  // Run task(index) on every worker and wait for all of them
+  void run(const std::function<void(int)> &task);
+
+private:
+  void work(int index);
+
+  std::vector<std::thread> m_threads;
+  std::mutex m_lock;
+  std::condition_variable m_start;
+  std::condition_variable m_done;
+  const std::function<void(int)> *m_task;
+  unsigned m_generation;
+  int m_pending;
+  bool m_stop;
+
+  firThreadPool(const firThreadPool &); // not implemented
+  void operator =(const firThreadPool &); // not implemented
+};
+
+/* Pin the calling thread to the index-th CPU of those it may run on */
+static void pinThread(int index)
+{
+#ifdef __linux__
+  cpu_set_t allowed;
+
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+    return;
+
+  int target = index % CPU_COUNT(&allowed);
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+  {
+    if(CPU_ISSET(cpu, &allowed) && target-- == 0)
+    {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      return;
+    }
+  }
+#endif
+}
+
+firThreadPool::firThreadPool(int numThreads)
+  : m_task(NULL), m_generation(0), m_pending(0), m_stop(false)
+{
+  for(int index = 0; index < numThreads; index++)
+    m_threads.push_back(std::thread(&firThreadPool::work, this, index));
+}
+
+firThreadPool::~firThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_stop = true;
+  }
+  m_start.notify_all();
+  for(size_t index = 0; index < m_threads.size(); index++)
+    m_threads[index].join();
+}
+
+void firThreadPool::run(const std::function<void(int)> &task)
+{
+  std::unique_lock<std::mutex> lock(m_lock);
+
+  m_task = &task;
+  m_pending = (int)m_threads.size();
+  m_generation++;
+  m_start.notify_all();
+  while(m_pending > 0)
+    m_done.wait(lock);
+  m_task = NULL;
+}
+
+void firThreadPool::work(int index)
+{
+  unsigned generation = 0;
+
+  // sched_getaffinity() reads the mask inherited from the creating thread
+  pinThread(index);
+
+  for(;;)
+  {
+    const std::function<void(int)> *task;
+    {
+      std::unique_lock<std::mutex> lock(m_lock);
+      while(!m_stop && m_generation == generation)
+        m_start.wait(lock);
+      if(m_stop)
+        return;
+      generation = m_generation;
+      task = m_task;
+    }
+
+    (*task)(index);
+
+    {
+      std::lock_guard<std::mutex> lock(m_lock);
+      if(--m_pending == 0)
+        m_done.notify_one();
+    }
+  }
+}
+
+
+/*
+  A work item: numBlocks result blocks of one filter from firstBlock on. Its
+  input is the matching padded points plus the filterLength - 1 points it
+  overlaps with the next chunk, so chunks are computed independently.
+ */
+struct firChunk {
+  int    filter;
+  int    firstBlock;
+  int    numBlocks;
+  size_t inputOffset;   // of its padded input in the worker's xr/xi
+  size_t resultOffset;  // of its result in the worker's yr/yi
+};
+
+/*
+  The consecutive chunks of one worker and its copies of their data, which
+  the worker allocates and writes first: the compute phase only touches
+  memory local to the worker's NUMA node.
+ */
+struct firWorker {
+  int    firstChunk;
+  int    numChunks;
+  size_t inputLength;   // padded input points of all its chunks
+  size_t resultLength;  // result points of all its chunks
+  float *xr, *xi;       // padded input, split
+  float *hr, *hi;       // reversed taps, filterLength per chunk
+  float *yr, *yi;       // result, split
+};
+
+/*
+ * Vectorised Time Domain FIR Filter implementation to be executed on CPU.
+ * Produces the same result as elCplxMul() applied once per tap, up to the
+ * rounding of the fused multiply-adds.
+ *
+ * The filter bank is cut into chunks of about chunkLength result points,
+ * split further so every thread has one when there are fewer filters than
+ * threads, and the chunks are shared out in consecutive runs among
+ * numThreads workers. Copying the data into the workers' split buffers and
+ * adding their results back are reported as buffer setup time, like the
+ * padding of the FPGA implementation; the latency is the filtering itself.
+ */
+void tdFirCPU(struct tdFirVariables *tdFirVars)
+{
+  const firKernel kernel = selectFirKernel();
+  const int  B = kernel.blockLength;
+  int  filterLength = tdFirVars->filterLength;
+  int  inputLength  = tdFirVars->inputLength;
+  int  resultLength = filterLength + inputLength - 1;
+  int  numFilters   = tdFirVars->numFilters;
+  int  numBlocks    = (resultLength + B - 1) / B;
+  int  numThreads   = tdFirVars->numThreads > 0 ? tdFirVars->numThreads
+                                                : (int)std::thread::hardware_concurrency();
+  int  chunkLength  = tdFirVars->chunkLength > 0 ? tdFirVars->chunkLength : TDFIR_CHUNK_LENGTH;
+  int  chunkBlocks  = (chunkLength + B - 1) / B;
+  int  chunksPerFilter;
+  std::vector<firChunk> chunks;
+  std::vector<firWorker> workers;
+  double startTime, stopTime;
+
+  if(numThreads < 1)
+    numThreads = 1;
+
+  chunksPerFilter = (numBlocks + chunkBlocks - 1) / chunkBlocks;
+  if(numFilters * chunksPerFilter < numThreads)
+  {
+    // not enough filters to go around: cut each one into more chunks
+    chunksPerFilter = std::min(numBlocks, (numThreads + numFilters - 1) / numFilters);
+  }
+  chunkBlocks = (numBlocks + chunksPerFilter - 1) / chunksPerFilter;
+
+  for(int filter = 0; filter < numFilters; filter++)
+  {
+    for(int block = 0; block < numBlocks; block += chunkBlocks)
+    {
+      firChunk chunk;
+      chunk.filter       = filter;
+      chunk.firstBlock   = block;
+      chunk.numBlocks    = std::min(chunkBlocks, numBlocks - block);
+      chunk.inputOffset  = 0;
+      chunk.resultOffset = 0;
+      chunks.push_back(chunk);
+    }
+  }
+
+  numThreads = std::min(numThreads, (int)chunks.size());
+  workers.resize(numThreads);
+  for(int w = 0; w < numThreads; w++)
+  {
+    firWorker &worker = workers[w];
+
+    worker.firstChunk   = (int)((size_t)w * chunks.size() / numThreads);
+    worker.numChunks    = (int)((size_t)(w + 1) * chunks.size() / numThreads) - worker.firstChunk;
+    worker.inputLength  = 0;
+    worker.resultLength = 0;
+    for(int c = worker.firstChunk; c < worker.firstChunk + worker.numChunks; c++)
+    {
+      chunks[c].inputOffset  = worker.inputLength;
+      chunks[c].resultOffset = worker.resultLength;
+      worker.inputLength    += (size_t)chunks[c].numBlocks * B + filterLength - 1;
+      worker.resultLength   += (size_t)chunks[c].numBlocks * B;
+    }
+  }
+
+  printf("tdFirVars: inputLength = %d, resultLength = %d, filterLen = %d\n",
+         inputLength, resultLength, filterLength);
+  printf("CPU kernel: %s, %d points per block, %d threads, %d chunks of %d points\n",
+         kernel.name, B, numThreads, (int)chunks.size(), chunkBlocks * B);
+
+  firThreadPool pool(numThreads);
+
+  startTime = getCurrentTimestamp();
+
+  // Each worker allocates and fills its buffers, so they are local to it
+  pool.run([&](int w) {
+    firWorker &worker = workers[w];
+
+    worker.xr = (float *)alignedMalloc(sizeof(float) * worker.inputLength);
+    worker.xi = (float *)alignedMalloc(sizeof(float) * worker.inputLength);
+    worker.hr = (float *)alignedMalloc(sizeof(float) * filterLength * worker.numChunks);
+    worker.hi = (float *)alignedMalloc(sizeof(float) * filterLength * worker.numChunks);
+    worker.yr = (float *)alignedMalloc(sizeof(float) * worker.resultLength);
+    worker.yi = (float *)alignedMalloc(sizeof(float) * worker.resultLength);
+
+    for(int c = 0; c < worker.numChunks; c++)
+    {
+      const firChunk &chunk = chunks[worker.firstChunk + c];
+      const float * inputPtr  = tdFirVars->input.data  + chunk.filter * (2*inputLength);
+      const float * filterPtr = tdFirVars->filter.data + chunk.filter * (2*filterLength);
+      const int  numPoints = chunk.numBlocks * B + filterLength - 1;
+      // input point of the first padded point of the chunk
+      const int  first = chunk.firstBlock * B - (filterLength - 1);
+      float * xr = worker.xr + chunk.inputOffset;
+      float * xi = worker.xi + chunk.inputOffset;
+
+      for(int index = 0; index < filterLength; index++)
+      {
+        worker.hr[c * filterLength + index] = filterPtr[2 * (filterLength - 1 - index)];
+        worker.hi[c * filterLength + index] = filterPtr[2 * (filterLength - 1 - index) + 1];
+      }
+      for(int index = 0; index < numPoints; index++)
+      {
+        const bool inside = first + index >= 0 && first + index < inputLength;
+
+        xr[index] = inside ? inputPtr[2 * (first + index)]     : 0.0f;
+        xi[index] = inside ? inputPtr[2 * (first + index) + 1] : 0.0f;
+      }
+    }
+  });
+
+  stopTime = getCurrentTimestamp();
+  tdFirVars->time.data[1] = stopTime - startTime;
+
+  startTime = getCurrentTimestamp();
+
+  pool.run([&](int w) {
+    firWorker &worker = workers[w];
+
+    for(int c = 0; c < worker.numChunks; c++)
+    {
+      const firChunk &chunk = chunks[worker.firstChunk + c];
+
+      kernel.blocks(worker.xr + chunk.inputOffset, worker.xi + chunk.inputOffset,
+                    worker.hr + c * filterLength, worker.hi + c * filterLength, filterLength,
+                    worker.yr + chunk.resultOffset, worker.yi + chunk.resultOffset,
+                    chunk.numBlocks);
+    }
+  });
+
+  stopTime = getCurrentTimestamp();
+  tdFirVars->time.data[0] = stopTime - startTime;
+
+  startTime = getCurrentTimestamp();
+
+  pool.run([&](int w) {
+    firWorker &worker = workers[w];
+
+    for(int c = 0; c < worker.numChunks; c++)
+    {
+      const firChunk &chunk = chunks[worker.firstChunk + c];
+      float * resultPtr = tdFirVars->result.data + chunk.filter * (2*resultLength);
+      const int  first = chunk.firstBlock * B;
+      const int  numPoints = std::min(chunk.numBlocks * B, resultLength - first);
+
+      for(int index = 0; index < numPoints; index++)
+      {
+        resultPtr[2 * (first + index)]     += worker.yr[chunk.resultOffset + index];
+        resultPtr[2 * (first + index) + 1] += worker.yi[chunk.resultOffset + index];
+      }
+    }
+
+    alignedFree(worker.xr);
+    alignedFree(worker.xi);
+    alignedFree(worker.hr);
+    alignedFree(worker.hi);
+    alignedFree(worker.yr);
+    alignedFree(worker.yi);
+  });
+
+  stopTime = getCurrentTimestamp();
+  tdFirVars->time.data[1] += stopTime - startTime;
+
+  printf("Done.\n  Latency: %f s.\n", tdFirVars->time.data[0]);
+  printf("  Buffer Setup Time: %f s.\n", tdFirVars->time.data[1]);
+  printf("  Throughput: %.3f GFLOPs.\n",
+         8.0 * numFilters * inputLength * filterLength / tdFirVars->time.data[0] / 1e9);
+}
@@ -61,6 +61,19 @@ unsigned char *loadBinaryFile(const char *file_name, size_t *size);
 // Checks if a file exists.
 bool fileExists(const char *file_name);
 
+// Create and build a OpenCL program from source for one device, through a
+// persistent cache of program binaries in cache_dir. The cache file is named
+// after a hash of the source, the build options, the platform and the device
+// (name, version and driver version). The first run builds from source and
+// saves the binary from CL_PROGRAM_BINARIES. Later runs load it with
+// clCreateProgramWithBinary and skip the compile. A missing or rejected
+// binary falls back to a build from source. A NULL or empty cache_dir
+// disables the cache. The returned program is built.
+cl_program createProgramWithCache(cl_context context, cl_device_id device, const char *source, size_t source_size, const char *options, const char *cache_dir);
+
+// Returns the path of the cached binary for the given source, options and device.
+std::string getProgramCachePath(const char *cache_dir, cl_device_id device, const char *source, size_t source_size, const char *options);
+
 // Returns the path to the AOCX file to use for the given device.
 // This is special handling for examples for the Intel(R) FPGA SDK for OpenCL(TM).
 // It uses the device name to get the board name and then looks for a
@@ -16,6 +16,7 @@ using namespace aocl_utils;
 
 // OpenCL runtime configuration
 std::string binary_file = "vector_add.aocx";
+std::string kernel_cache = "cache"; // binaries of programs built from source, empty to disable
 cl_platform_id platform = NULL;
 unsigned num_devices = 0;
 cl_device_id device;
@@ -57,6 +58,15 @@ int main(int argc, char **argv)
         binary_file = options.get<unsigned>("kernel");
     }
 
+    if (options.has("kernel_cache"))
+    {
+        kernel_cache = options.get<std::string>("kernel_cache");
+    }
+    if (options.has("no_kernel_cache"))
+    {
+        kernel_cache.clear();
+    }
+
     // Initialize OpenCL.
     if (!init_opencl())
     {
@@ -149,15 +159,17 @@ bool init_opencl()
     source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
     fclose(fp);
 
-    program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
+    // Built from source once, then loaded from the binary cache.
+    program = createProgramWithCache(context, device, source_str, source_size, "", kernel_cache.c_str());
+    free(source_str);
 #else
     printf("Using kernel binary: %s\n", binary_file.c_str());
     program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
-#endif
 
     // Build the program that was just created.
     status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
     checkError(status, "Failed to build program");
+#endif
 
     // Command queue.
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);